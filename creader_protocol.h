@@ -0,0 +1,43 @@
+/* PharmaTracker decoder -> main board serial frame formats */
+#ifndef CREADER_PROTOCOL_H_
+#define CREADER_PROTOCOL_H_
+
+#include <stdint.h>
+
+/************************************************************************/
+/* ASCII frame (compatible with the Parallax reader):                   */
+/*     LF, 10 hex characters of the tag ID, CR                          */
+/* Binary frame:                                                        */
+/*     0xA0 | sequence number (4 bits), 5 ID bytes, CRC-8               */
+/* The first byte tells the formats apart: no ASCII character has 0xA   */
+/* in its upper nibble. The CRC-8 (polynomial 0x07) covers every byte   */
+/* before it. The sequence number increments with every frame sent,     */
+/* heartbeats included.                                                 */
+/* Heartbeat frame (binary, a tag still on the antenna, if enabled):    */
+/*     0xC0 | sequence number, 5 ID bytes, CRC-8                        */
+/* The main board doesn't take it as a scan.                            */
+/* Stats frame (binary, sent every minute or so):                       */
+/*     0xB0, # of frames decoded, sync losses, parity errors (2 bytes   */
+/*     each, high byte first), frames not sent because the UART was     */
+/*     busy, longest edge ISR in timer ticks, CRC-8                     */
+/* The counts are since the previous stats frame.                       */
+/************************************************************************/
+#define CREADER_ASCII_START     0x0A
+#define CREADER_ASCII_END       0x0D
+#define CREADER_ASCII_SIZE      12
+#define CREADER_BINARY_MARK     0xA0
+#define CREADER_BINARY_SIZE     7
+#define CREADER_HEARTBEAT_MARK  0xC0    // same layout as the binary frame
+#define CREADER_ID_SIZE         5
+#define CREADER_STATS_MARK      0xB0
+#define CREADER_STATS_SIZE      10
+
+static inline uint8_t creader_crc8(uint8_t crc, uint8_t data) {
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+#endif /* CREADER_PROTOCOL_H_ */
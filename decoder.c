@@ -1,101 +1,204 @@
-/* PharmaTracker decoder firmware */
-#define F_CPU 9600000UL
+/* PharmaTracker decoder firmware (ATtiny85, internal 8 MHz oscillator) */
+#define F_CPU 8000000UL
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#include <util/delay.h>
+#include <avr/sleep.h>
+#include <avr/pgmspace.h>
 #include <stdbool.h>
+#include "manchester.h"
+#include "creader_protocol.h"
 
-#define PWM_COUNT           38
+#define CARRIER_COUNT       31      // Timer0 toggles the carrier every CARRIER_COUNT + 1 cycles
+#define TICK_PRESCALER      32      // Timer1 counts the edge timestamps at F_CPU / TICK_PRESCALER
+#define TICK_CLOCK          (1<<CS12 | 1<<CS11)    // CK/32 in TCCR1
 #define SQUARE_WAVE_125KHZ  PB0
 #define SIGNAL_INPUT        PB1
 #define TRANSMIT_PIN        PB4
-#define TOLERANCE           4
-#define BAUD_DELAY          412
+#define BAUD                2400
+#ifndef RAW_CAPTURE
+#define RAW_CAPTURE         false   // stream the run lengths of the RF signal instead of decoding it (diagnostics)
+#endif
+#define CAPTURE_BAUD        83333   // TICK_HZ / 3: one byte per run keeps up with RF/32
+#define BINARY_FRAMES       true    // send the 7-byte binary frame, 42% shorter than the 12 ASCII characters
+#define HOLD_OFF_FRAMES     8       // a tag is sent again only after being absent this many frame periods
+#define HEARTBEAT_FRAMES    0       // re-send a tag still present every this many frame periods (0: never)
+#define STATS_PERIOD_S      60      // how often the stats frame is sent (0: never)
 
+/************************************************************************/
+/* Supported data rates (RF/n: a bit lasts n periods of the carrier).   */
+/* All timing is derived at compile time from F_CPU, CARRIER_COUNT and  */
+/* TICK_PRESCALER: Timer0 toggles the carrier pin in hardware, and      */
+/* Timer1 counts the edge timestamps, 2 ticks per carrier period. The   */
+/* decoder picks the rate from the preamble at runtime by comparing     */
+/* against this table.                                                  */
+/************************************************************************/
+#define DATA_RATES(RATE)    RATE(32) RATE(40) RATE(64)  // sorted by speed, fastest first
+#define TICK_HZ             (F_CPU / TICK_PRESCALER)
+#define CARRIER_HZ          (F_CPU / (2 * (CARRIER_COUNT + 1)))
+#define HALF_BIT_TICKS(rf)  (((rf) * TICK_HZ + CARRIER_HZ) / (2 * CARRIER_HZ))
+#define RATE_ENTRY(rf)      MANCHESTER_RATE(HALF_BIT_TICKS(rf)),
+#define RATE_FITS(rf)       && HALF_BIT_TICKS(rf) * 5 / 4 * 5 / 2 < 256
+
+const manchester_rate_t data_rates[] PROGMEM = {DATA_RATES(RATE_ENTRY)};
+_Static_assert(1 DATA_RATES(RATE_FITS), "the longest pulse must fit the 8-bit edge timestamp");
+#define DATA_RATE_COUNT     (sizeof(data_rates) / sizeof(data_rates[0]))
+#define UART_BAUD           (RAW_CAPTURE ? CAPTURE_BAUD : BAUD)
+#define BAUD_TICKS          ((TICK_HZ + UART_BAUD / 2) / UART_BAUD)
+_Static_assert(BAUD_TICKS < 256, "a bit of the UART must fit the 8-bit compare step");
+_Static_assert(BAUD_TICKS * UART_BAUD * 50 > TICK_HZ * 49 && BAUD_TICKS * UART_BAUD * 50 < TICK_HZ * 51,
+               "the UART bit time must be within 2% of the baud rate");
+#define FRAME_TICKS         (64 * 2 * HALF_BIT_TICKS(64))   // one frame at the slowest supported rate
+#define EPOCHS(frames)      (((frames) * FRAME_TICKS + 255) / 256)
+#define STATS_EPOCHS        ((uint32_t)STATS_PERIOD_S * TICK_HZ / 256)
+_Static_assert(STATS_EPOCHS < 0x10000, "the stats period must fit the 16-bit epoch counter");
+
+/************************************************************************/
+/* RAM: the globals take 107 bytes of the ATtiny85's 512 (RFID 68, UART */
+/* 20, dedup 10, stats 6 and 3 single bytes), the rate table is in      */
+/* flash. The stack is deepest when the edge ISR interrupts the main    */
+/* loop in send_frame and the UART ISR interrupts the decoder: about    */
+/* 110 bytes, counted from the call depth and the registers each frame  */
+/* saves, which leaves some 300 spare. The ATtiny13 of the first boards */
+/* has 64 bytes, less than the decoder state alone.                     */
+/************************************************************************/
+
+/************************************************************************/
+/* No ISR runs per carrier period: the edge timestamp is TCNT1 itself,  */
+/* and the Timer1 overflow ISR only counts epochs of 256 ticks. The pin */
+/* change ISR measures the time since the previous edge and feeds it to */
+/* the decoder, so the main loop only ever sees complete, parity        */
+/* checked frames.                                                      */
+/************************************************************************/
 struct {
-    volatile int8_t data_in;
-    volatile bool new_data;
-    int8_t buff[10];
+    volatile uint16_t epochs;       // # of Timer1 overflows (1.024 ms each)
+    volatile int8_t wraps;          // # of overflows since the previous edge, up to 2 (-1: one counted early)
+    uint8_t last_edge;              // TCNT1 at the previous edge of the signal
+    manchester_t decoder;
+    manchester_frame_t decoded;     // written by the decoder as the last bit of a frame arrives
+    manchester_frame_t frame;       // the last complete frame, owned by the main loop while new_frame is set
+    volatile bool new_frame;
 } RFID;
 
-inline void waitfor_stable_signal(void) {
-    while(RFID.data_in == 0x01);
-    while(RFID.data_in == 0x00);
-}
-
 /************************************************************************/
-/* Transmit the decoded RFID with baud rate of 2400                     */
+/* Software UART transmitter, paced by the Timer1 compare match A: a    */
+/* bit goes out every BAUD_TICKS ticks, so the decoder keeps sampling   */
+/* while the frame is being sent. The main loop only queues bytes. The  */
+/* ISR has BAUD_TICKS * TICK_PRESCALER cycles: 3328 at 2400 baud, 96 at */
+/* CAPTURE_BAUD.                                                        */
 /************************************************************************/
-void transmit(unsigned char data) {
-    PORTB &= ~(1 << TRANSMIT_PIN);   // start bit
-    _delay_us(BAUD_DELAY);
-    for(int8_t i = 0; i < 8; i++) {
-        if (data & 1) {
-            PORTB |= (1 << TRANSMIT_PIN);
-        } else {
-            PORTB &= ~(1 << TRANSMIT_PIN);
-        }
-        _delay_us(BAUD_DELAY);
-        data >>= 1;
-    }
-    PORTB |= (1 << TRANSMIT_PIN); // stop bit
-    _delay_us(BAUD_DELAY);
-}
+#define UART_BUFF_SIZE      16      // power of 2, holds a whole ASCII frame
 
-ISR(TIM0_OVF_vect) {
-    volatile static int8_t counter = 3;
-    if (counter > 0) {
-        counter--;
+struct {
+    uint8_t buffer[UART_BUFF_SIZE];
+    volatile uint8_t head;          // next free slot, written by the main loop
+    volatile uint8_t tail;          // next byte to send, written by the ISR
+    uint8_t data;                   // byte being shifted out
+    uint8_t bits_left;              // data bits + stop bit still to send (0: idle)
+} UART;
+
+inline uint8_t UART_free(void) {
+    return UART_BUFF_SIZE - 1 - ((UART.head - UART.tail) & (UART_BUFF_SIZE - 1));
+}
+void UART_queue(uint8_t data) {
+    UART.buffer[UART.head] = data;
+    UART.head = (UART.head + 1) & (UART_BUFF_SIZE - 1);
+}
+inline void UART_next_bit(void) {
+    if (UART.bits_left == 0) {
+        if (UART.head == UART.tail) return; // nothing to send, the line stays high
+        UART.data = UART.buffer[UART.tail];
+        UART.tail = (UART.tail + 1) & (UART_BUFF_SIZE - 1);
+        UART.bits_left = 9;
+        PORTB &= ~(1 << TRANSMIT_PIN);  // start bit
         return;
     }
-    counter = 3;
-    RFID.data_in = bit_is_set(PINB,SIGNAL_INPUT)? 1 : 0;
-    RFID.new_data = true;
+    if (--UART.bits_left == 0 || (UART.data & 1)) { // the last "bit" is the stop bit
+        PORTB |= (1 << TRANSMIT_PIN);
+    } else {
+        PORTB &= ~(1 << TRANSMIT_PIN);
+    }
+    UART.data >>= 1;
+}
+
+ISR(TIMER1_COMPA_vect) {
+    OCR1A += BAUD_TICKS; // the next bit, wrapping with TCNT1
+    UART_next_bit();
 }
-int8_t get_next_sample(void) {
-    while (!RFID.new_data);
-    RFID.new_data = false;
-    return RFID.data_in;
+ISR(TIMER1_OVF_vect) {
+    RFID.epochs++;
+    if (RFID.wraps < 2) RFID.wraps++;
 }
+/************************************************************************/
+/* Counters sent to the main board in the stats frame. The ones the     */
+/* ISRs update are only read and cleared with interrupts disabled.      */
+/************************************************************************/
+struct {
+    uint16_t decoded;               // # of frames decoded, repeats of a tag on the antenna included
+    uint8_t dropped;                // # of frames not sent because the UART was still busy
+    uint8_t isr_max;                // longest run of the edge ISR, in timer ticks
+    uint16_t sent;                  // when the last stats frame was sent, in epochs
+} stats;
 
 /************************************************************************/
-/* data_stream is used by the Manchester decoding functions,            */
-/* to keep track of the state of the information stream                 */
+/* Raw capture (RAW_CAPTURE), to see why reads fail in the field: the   */
+/* edge ISR sends the run lengths it measures instead of decoding them, */
+/* one byte per run in timer ticks, and nothing else goes out. The      */
+/* levels alternate, so only a level byte tells the level of the next   */
+/* run: CAPTURE_SYNC | level first and after runs were lost to a full   */
+/* buffer, CAPTURE_LEVEL | level every CAPTURE_LEVEL_RUNS runs, so that */
+/* a capture started on a running decoder finds its footing. Lengths    */
+/* saturate below both. tools/rftrace.c records and analyzes the        */
+/* stream.                                                              */
 /************************************************************************/
-struct  {
-    int8_t current_logic;      // current logic value (1 or 0)
-    int8_t prev_logic_count;   // previous logic count
-} data_stream;
-
-inline void detect_change(void) {
-    int8_t count = 1, sample;
-    while (true) { // Keep counting until there is a change detected
-        sample = get_next_sample();
-        if (sample != data_stream.current_logic) break;
-        count++;
-    }
-    data_stream.current_logic = sample;    // store the logic value after the change occurred
-    data_stream.prev_logic_count = count;  // store the # of consecutive previous logic values
-}
+#define CAPTURE_SYNC        0xFE    // | level: runs were lost before this one
+#define CAPTURE_LEVEL       0xFC    // | level: nothing was lost
+#define CAPTURE_LEVEL_RUNS  64      // at RF/32 the stream still keeps up
 
-int8_t get_first_manchester(void) {
-    data_stream.current_logic = get_next_sample();
-    while (true) {
-        detect_change();
-        if (data_stream.prev_logic_count > TOLERANCE) 
-            break;
+bool capture_lost = true;           // the receiver needs a sync byte before the next run
+uint8_t capture_runs;               // # of runs since the last level byte
+
+inline void capture_run(uint8_t level, uint16_t length) {
+    if ((capture_lost || capture_runs >= CAPTURE_LEVEL_RUNS) && UART_free() >= 2) {
+        UART_queue((capture_lost ? CAPTURE_SYNC : CAPTURE_LEVEL) | level);
+        capture_lost = false;
+        capture_runs = 0;
+    }
+    if (capture_lost) return;
+    if (UART_free() == 0) {
+        capture_lost = true;
+        return;
     }
-    return data_stream.current_logic;
+    capture_runs++;
+    UART_queue(length < CAPTURE_LEVEL ? length : CAPTURE_LEVEL - 1);
 }
 
-int8_t get_next_manchester(void) {
-    detect_change();
-    if (data_stream.prev_logic_count <= TOLERANCE) {
-        detect_change();
-        return data_stream.current_logic;
-    } else {
-        return (data_stream.current_logic) ^ 1; // return the opposite of "current"
+ISR(PCINT0_vect) {
+    uint8_t now = TCNT1;
+    uint8_t level = bit_is_set(PINB, SIGNAL_INPUT)? 0 : 1; // level of the run that just ended
+    uint16_t length = (uint8_t)(now - RFID.last_edge);
+    int8_t wraps = RFID.wraps;
+    bool pending = bit_is_set(TIFR, TOV1) && now < 0x80; // TCNT1 wrapped before now, its ISR hasn't run yet
+    if (pending) wraps++;
+    if (wraps > 1 || (wraps == 1 && now >= RFID.last_edge)) length = MANCHESTER_MAX_RUN; // 256 ticks or more
+    RFID.wraps = pending ? -1 : 0;
+    RFID.last_edge = now;
+#if RAW_CAPTURE
+    capture_run(level, length);
+#else
+    GIMSK &= ~(1 << PCIE);  // no nesting on noisy edges, the edge after this one stays pending
+    sei();                  // keep the timestamp ticking while decoding
+    if (manchester_feed_run(&RFID.decoder, level, length, &RFID.decoded)) {
+        stats.decoded++;
+        if (!RFID.new_frame) {
+            RFID.frame = RFID.decoded;
+            RFID.new_frame = true;
+        }
     }
+    cli();
+    uint8_t spent = TCNT1 - now;
+    if (spent > stats.isr_max) stats.isr_max = spent;
+    GIMSK |= (1 << PCIE);
+#endif
 }
 
 char formatHex(int8_t i) {
@@ -105,56 +208,149 @@ char formatHex(int8_t i) {
         return (i - 10) + 'A';
     }    
 }
-
-bool successfully_decoded(void) {
-    data_stream.current_logic = 0;
-    data_stream.prev_logic_count = 0;
-    int8_t one_count = get_first_manchester();
-    while (one_count < 9) { // wait until we get 9 consecutive 1's
-        one_count = (get_next_manchester() == 1) ? one_count + 1 : 0;
+bool send_frame(manchester_frame_t * frame, uint8_t mark) { // mark: CREADER_BINARY_MARK or CREADER_HEARTBEAT_MARK
+#if BINARY_FRAMES
+    static uint8_t sequence = 0;
+    if (UART_free() < CREADER_BINARY_SIZE) return false; // previous frame still going out
+    uint8_t first = mark | (sequence++ & 0x0F);
+    uint8_t crc = creader_crc8(0, first);
+    UART_queue(first);
+    for (uint8_t i = 0; i < MANCHESTER_ID_SIZE; i++) {
+        crc = creader_crc8(crc, frame->id[i]);
+        UART_queue(frame->id[i]);
     }
-    int8_t col_parity[4] = {0};
-    for (int8_t i = 0; i < 10; i++) { // scan all 10 rfid characters
-        int8_t rfid_char = 0, row_parity = 0;
-        for (int8_t j = 3; j >= 0; j--) { //build 4-bit hex number bit by bit
-            int8_t decoded_bit = get_next_manchester();
-            rfid_char += decoded_bit << j;
-            row_parity += decoded_bit;
-            col_parity[j] += decoded_bit;
-        }
-        row_parity += get_next_manchester();
-        if ((row_parity & 1) != 0) return false; // assert row parity is even
-        RFID.buff[i] = rfid_char;
+    UART_queue(crc);
+#else
+    if (UART_free() < CREADER_ASCII_SIZE) return false;
+    UART_queue(CREADER_ASCII_START);
+    for (uint8_t i = 0; i < MANCHESTER_ID_SIZE; i++) {
+        UART_queue(formatHex(frame->id[i] >> 4));
+        UART_queue(formatHex(frame->id[i] & 0x0F));
     }
-    for (int8_t i = 3; i >= 0; i--) { // now scan all the column parities
-        col_parity[i] += get_next_manchester();
-        if((col_parity[i] & 1) != 0) return false; // assert they are all even
+    UART_queue(CREADER_ASCII_END);
+#endif
+    return true;
+}
+
+void timers_init(void) {
+    TCCR0A  = (1<<WGM01 | 1<<COM0A0);  // CTC, OC0A toggles on every compare match: the carrier
+    TCCR0B  = (1<<CS00);
+    OCR0A   = CARRIER_COUNT;
+    TCCR1   = TICK_CLOCK;               // counts 0 to 255 and wraps: the edge timestamps
+    OCR1A   = BAUD_TICKS;
+    TIMSK  |= (1<<OCIE1A | 1<<TOIE1);
+}
+void edge_capture_init(void) {
+    PCMSK |= (1<<SIGNAL_INPUT);
+    GIMSK |= (1<<PCIE);
+}
+
+/************************************************************************/
+/* Duplicate suppression: a tag on the antenna is decoded over and over */
+/* again, but it is only sent once. It is sent again after it has been  */
+/* absent (not decoded) for HOLD_OFF_FRAMES frame periods. If enabled,  */
+/* a heartbeat frame repeats it every HEARTBEAT_FRAMES frame periods    */
+/* while it stays present, which the main board doesn't take as a scan. */
+/* The main loop expires the tag on every wake, long before the epochs  */
+/* wrap, so a rescan after any absence is sent.                         */
+/************************************************************************/
+_Static_assert(BINARY_FRAMES || HEARTBEAT_FRAMES == 0, "an ASCII frame can't tell a heartbeat from a scan");
+_Static_assert(EPOCHS(HEARTBEAT_FRAMES) < 0x8000, "the heartbeat period must fit the 16-bit epoch counter");
+
+struct {
+    manchester_frame_t last;        // the last tag sent
+    bool present;                   // it was decoded within the hold-off
+    uint16_t seen;                  // when it was last decoded, in epochs
+    uint16_t sent;                  // when it was last sent, in epochs
+} dedup;
+
+uint16_t get_epochs(void) {
+    uint16_t epochs;
+    do {
+        epochs = RFID.epochs;
+    } while (epochs != RFID.epochs); // updated by the timer ISR in between the two bytes
+    return epochs;
+}
+bool is_same_tag(manchester_frame_t * a, manchester_frame_t * b) {
+    for (uint8_t i = 0; i < MANCHESTER_ID_SIZE; i++) {
+        if (a->id[i] != b->id[i]) return false;
     }
-    int8_t stop_bit = get_next_manchester();
-    if (stop_bit != 0) return false;
     return true;
 }
+void expire_tag(void) {
+    if (dedup.present && (uint16_t)(get_epochs() - dedup.seen) > EPOCHS(HOLD_OFF_FRAMES)) dedup.present = false;
+}
+void report_frame(manchester_frame_t * frame) {
+    uint16_t now = get_epochs();
+    uint8_t mark = CREADER_BINARY_MARK;
+    if (dedup.present && is_same_tag(frame, &dedup.last)) {
+        dedup.seen = now;
+#if HEARTBEAT_FRAMES
+        if ((uint16_t)(now - dedup.sent) < EPOCHS(HEARTBEAT_FRAMES)) return;
+        mark = CREADER_HEARTBEAT_MARK;
+#else
+        return;
+#endif
+    }
+    if (!send_frame(frame, mark)) { // the tag repeats, it goes out with a later copy
+        if (stats.dropped != 0xFF) stats.dropped++;
+        return;
+    }
+    dedup.last = *frame;
+    dedup.present = true;
+    dedup.seen = dedup.sent = now;
+}
 
-void PWM_init(void) {
-    TCCR0A |= (1<<WGM00 | 1<<WGM01 | 1<<COM0A0);
-    TCCR0B |= (1<<WGM02 | 1<<CS00 | 1<<FOC0A);
-    TIMSK0 |= (1<<TOIE0);
-    OCR0A   = PWM_COUNT;
+static inline void queue_counter(uint16_t value, uint8_t * crc) {
+    *crc = creader_crc8(creader_crc8(*crc, value >> 8), value & 0xFF);
+    UART_queue(value >> 8);
+    UART_queue(value & 0xFF);
+}
+void send_stats(void) {
+    uint16_t now = get_epochs();
+    if (STATS_PERIOD_S == 0 || RAW_CAPTURE || (uint16_t)(now - stats.sent) < STATS_EPOCHS) return;
+    if (UART_free() < CREADER_STATS_SIZE) return; // a frame is going out, try again on the next loop
+    cli(); // take the counters and start over
+    uint16_t decoded = stats.decoded, sync_losses = RFID.decoder.sync_losses;
+    uint16_t parity_errors = RFID.decoder.parity_errors;
+    uint8_t isr_max = stats.isr_max;
+    stats.decoded = RFID.decoder.sync_losses = RFID.decoder.parity_errors = 0;
+    stats.isr_max = 0;
+    sei();
+    uint8_t crc = creader_crc8(0, CREADER_STATS_MARK);
+    UART_queue(CREADER_STATS_MARK);
+    queue_counter(decoded, &crc);
+    queue_counter(sync_losses, &crc);
+    queue_counter(parity_errors, &crc);
+    crc = creader_crc8(creader_crc8(crc, stats.dropped), isr_max);
+    UART_queue(stats.dropped);
+    UART_queue(isr_max);
+    UART_queue(crc);
+    stats.dropped = 0;
+    stats.sent = now;
 }
 
 int main (void) {
     DDRB |= (1<<SQUARE_WAVE_125KHZ) | (1<<TRANSMIT_PIN);
-    PWM_init();
+    PORTB |= (1<<TRANSMIT_PIN); // UART line idles high
+    timers_init();
+    edge_capture_init();
+    manchester_init_adaptive(&RFID.decoder, data_rates, DATA_RATE_COUNT);
+    set_sleep_mode(SLEEP_MODE_IDLE); // the timers keep the carrier and the timestamps running
     sei();
     while (true) {
-        waitfor_stable_signal();
-        if(!successfully_decoded()) continue;
+        expire_tag(); // at least once per epoch: the overflow ISR wakes the loop
+        send_stats();
         cli();
-        transmit(0x0A);
-        for (int i = 0; i < 10; i++) {
-            transmit(formatHex(RFID.buff[i]));
+        if (!RFID.new_frame) { // sleep until the next interrupt: the UART bit clock at the latest
+            sleep_enable();
+            sei(); // the instruction after sei runs before any interrupt: SLEEP
+            sleep_cpu();
+            sleep_disable();
+            continue;
         }
-        transmit(0x0D);
         sei();
+        report_frame(&RFID.frame);
+        RFID.new_frame = false;
     }
 }
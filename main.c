@@ -1,46 +1,111 @@
 #define F_CPU 8000000UL
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <util/delay.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
+#include "creader_protocol.h"
 
-#define CARD_COUNT              2       // the amount of different RFID cards the system supports
-#define CREADER_BUFF_SIZE       12      // card reader buffer size
+#define CARD_COUNT              128     // the amount of different RFID cards the system supports (at most 128, see the card registry)
+#define CREADER_BUFF_SIZE       CREADER_ASCII_SIZE  // card reader buffer size
 #define CREADER_BAUD_REG_VAL    207     // card reader baud rate: 2400 (see pg. 242)
 #define ESP8266_BAUD_REG_VAL    51      // WiFi chip baud rate: 9600 (see pg. 242)
 #define SERVER_IP_ADDRESS       "35.162.70.152"
+#ifndef DEVICE_ID
+#define DEVICE_ID               "PT-0001"   // sent with every request: give each unit its own (-DDEVICE_ID='"..."')
+#endif
 #define LCD_DIR                 DDRA
 #define LCD_PORT                PORTA
 #define LCD_E                   PORTA2
 #define LCD_RS                  PORTA1
+#define LCD_RW                  PORTA7  // needed to read the busy flag (tied low on the first boards)
 
 #define ASSERT(condition)       if(!(condition)) {asm("break");}
 
 /************************************************************************/
 /* Buttons Functions                                                    */
+/* The buttons are sampled by the system tick (every millisecond) and   */
+/* debounced with an integrator per button: it counts up while the pin  */
+/* reads pressed and down while it reads released, and the button only  */
+/* changes state once the count hits either end, so a bounce has to     */
+/* outlast BUTTON_INTEGRATOR samples to register. Every press (and,     */
+/* while UP or DOWN is held, every auto-repeat) is queued as an event;  */
+/* probe_buttons only takes the next one out, it never waits. Once all  */
+/* the buttons are released and settled the tick stops sampling them,   */
+/* until the pin change interrupt of any button starts it again.        */
 /************************************************************************/
 typedef enum {NONE, LEFT, RIGHT, UP, DOWN, OK, INVALID} button_t;
 
-button_t probe_buttons(void) {
-    ASSERT((PINB & 0x1F) == ((PINB & 0x1F) & -(PINB & 0x1F))); // assert only 1 button is pressed at a time
-    button_t pressed;
-    if (!(PINB & 0x1F)) {
-        return NONE;
-    } else if (PINB & (1<<PB0)) {
-        pressed = RIGHT;
-    } else if (PINB & (1<<PB1)) {
-        pressed = LEFT;
-    } else if (PINB & (1<<PB2)) {
-        pressed = UP;
-    } else if (PINB & (1<<PB3)) {
-        pressed = DOWN;
-    } else if (PINB & (1<<PB4)) {
-        pressed = OK;
-    } else {
-        pressed = INVALID;
+#define BUTTON_COUNT        5       // PB0..PB4
+#define BUTTON_INTEGRATOR   10      // samples (ms) a button must read steadily to change state
+#define BUTTON_REPEAT_DELAY 500     // ms UP/DOWN is held before it starts repeating
+#define BUTTON_REPEAT_MS    120     // ms between repeats
+#define BUTTON_QUEUE_SIZE   8       // power of 2
+
+const button_t button_pins[BUTTON_COUNT] = {RIGHT, LEFT, UP, DOWN, OK}; // the button on PB0, PB1...
+
+struct {
+    uint8_t integrator[BUTTON_COUNT];
+    uint8_t pressed;                // debounced state, bit n is the button on PBn
+    volatile bool idle;             // all released and settled: nothing to sample
+    uint16_t held_ms;               // how long the last pressed button has been held
+    button_t held;                  // the last button pressed, while it is still held
+    button_t queue[BUTTON_QUEUE_SIZE];
+    volatile uint8_t head;          // written by the tick ISR
+    volatile uint8_t tail;          // written by the main loop
+} buttons;
+
+inline void buttons_queue(button_t button) {
+    uint8_t next = (buttons.head + 1) & (BUTTON_QUEUE_SIZE - 1);
+    if (next == buttons.tail) return; // full, the UI is busy: drop the press
+    buttons.queue[buttons.head] = button;
+    buttons.head = next;
+}
+inline void buttons_sample(void) { // called by the system tick ISR
+    if (buttons.idle) return;
+    uint8_t pins = PINB, settling = 0;
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        uint8_t mask = 1 << i;
+        if (pins & mask) {
+            if (buttons.integrator[i] < BUTTON_INTEGRATOR) buttons.integrator[i]++;
+            if (buttons.integrator[i] == BUTTON_INTEGRATOR && !(buttons.pressed & mask)) {
+                buttons.pressed |= mask;
+                buttons.held = button_pins[i];
+                buttons.held_ms = 0;
+                buttons_queue(button_pins[i]);
+            }
+        } else {
+            if (buttons.integrator[i] > 0) buttons.integrator[i]--;
+            if (buttons.integrator[i] == 0 && (buttons.pressed & mask)) {
+                buttons.pressed &= ~mask;
+                if (buttons.held == button_pins[i]) buttons.held = NONE;
+            }
+        }
+        settling |= buttons.integrator[i];
+    }
+    buttons.idle = (settling == 0); // an edge from now on raises the pin change interrupt
+    if (buttons.held == UP || buttons.held == DOWN) { // auto-repeat
+        if (++buttons.held_ms == BUTTON_REPEAT_DELAY) {
+            buttons.held_ms -= BUTTON_REPEAT_MS;
+            buttons_queue(buttons.held);
+        }
     }
-    _delay_ms(200);
+}
+ISR(PCINT1_vect) { // a button changed: wakes the CPU and the sampling
+    buttons.idle = false;
+}
+void buttons_init(void) {
+    PCMSK1 |= (1 << BUTTON_COUNT) - 1;  // PB0..PB4 are PCINT8..PCINT12
+    PCICR |= (1 << PCIE1);
+}
+button_t probe_buttons(void) { // the next button event, NONE if there is none
+    if (buttons.tail == buttons.head) return NONE;
+    button_t pressed = buttons.queue[buttons.tail];
+    buttons.tail = (buttons.tail + 1) & (BUTTON_QUEUE_SIZE - 1);
     return pressed;
 }
 
@@ -58,43 +123,160 @@ button_t probe_buttons(void) {
 #define cursorOn    0x0E
 #define cursorOff   0x0C
 
+#define LCD_DATA    0x78    // PA6..PA3 carry D7..D4
+#define LCD_COLUMNS 16
+#define LCD_FLUSH_BUDGET 4  // most LCD operations per call of LCD_flush_task
+#ifndef LCD_BUSY_FLAG
+#define LCD_BUSY_FLAG    0  // 1 on boards with RW wired to PA7; the first boards tie it low
+#endif
+#define LCD_WRITE_US     50 // longest the flush's writes take: 37 us, 41 us for data, at a slow LCD clock
+#define LCD_BUSY_POLLS   100 // reads of a busy flag that never clears, before the flush writes anyway
+
 void LCD_send_upper_nibble(uint8_t byte) {
-    LCD_PORT &= ~0x78; // Save the data of the LCD port (& set nibble to 0)
-    LCD_PORT |= byte >> 1 & 0x78; // set the nibble (requires shifting)
+    LCD_PORT &= ~LCD_DATA; // Save the data of the LCD port (& set nibble to 0)
+    LCD_PORT |= byte >> 1 & LCD_DATA; // set the nibble (requires shifting)
     LCD_PORT |= (1 << LCD_E);
     LCD_PORT &= ~(1 << LCD_E);
-    _delay_us(50);
+}
+void LCD_hw_write(uint8_t byte, bool is_data) { // the LCD must not be busy
+    if (is_data) {
+        LCD_PORT |= (1 << LCD_RS);
+    } else {
+        LCD_PORT &= ~(1 << LCD_RS);
+    }
+    LCD_send_upper_nibble(byte);
+    LCD_send_upper_nibble(byte << 4);
+    if (!LCD_BUSY_FLAG) _delay_us(LCD_WRITE_US); // nothing tells when it's done
+}
+/************************************************************************/
+/* With RW tied low the LCD takes every strobe as a write, so reading   */
+/* the busy flag would write whatever the floating data pins hold: the  */
+/* flag is only read on boards built with LCD_BUSY_FLAG, and even there */
+/* a flag stuck at busy (RW not wired after all) only slows the flush   */
+/* down to one write per LCD_BUSY_POLLS reads instead of hanging it.    */
+/************************************************************************/
+bool LCD_is_busy(void) {
+#if LCD_BUSY_FLAG
+    static uint8_t polls;
+    LCD_PORT &= ~(LCD_DATA | 1 << LCD_RS);
+    LCD_DIR &= ~LCD_DATA; // data pins become inputs
+    LCD_PORT |= (1 << LCD_RW);
+    LCD_PORT |= (1 << LCD_E);
+    _delay_us(1);
+    bool busy = PINA & (1 << PINA6); // D7 is the busy flag
+    LCD_PORT &= ~(1 << LCD_E);
+    LCD_PORT |= (1 << LCD_E); // the low nibble has to be clocked out as well
+    _delay_us(1);
+    LCD_PORT &= ~(1 << LCD_E);
+    LCD_PORT &= ~(1 << LCD_RW);
+    LCD_DIR |= LCD_DATA;
+    if (!busy || ++polls > LCD_BUSY_POLLS) {
+        polls = 0;
+        return false;
+    }
+    return true;
+#else
+    return false; // LCD_hw_write waited long enough
+#endif
 }
 void LCD_init(void) {
-    LCD_DIR |= 0x7E; // Data: PORTD6..PORTD3, E: PORTD2, RS: PORTD1
+    LCD_DIR |= 0xFE; // Data: PORTA6..PORTA3, E: PORTA2, RS: PORTA1, RW: PORTA7
     _delay_ms(40); // wait until LCD's voltage is high enough
-    uint8_t init_commands[] = {0x30, 0x30, 0x30, 0x20, 0x20, 0xC0, 0x00, 0xC0};
-    for (int i = 0, n = sizeof(init_commands)/sizeof(uint8_t); i < n; i++) {
+    uint8_t init_commands[] = {0x30, 0x30, 0x30, 0x20, 0x20, 0xC0, 0x00, 0xC0, 0x00, 0x10};
+    for (int i = 0, n = sizeof(init_commands)/sizeof(uint8_t); i < n; i++) { // the busy flag can't be read yet
         LCD_send_upper_nibble(init_commands[i]);
         _delay_ms(10);
     }
 }
+
+/************************************************************************/
+/* The screens only ever write to a framebuffer in RAM; the LCD_command */
+/* and LCD_char calls below act on it the way the LCD would. Flushing   */
+/* compares it against what the LCD shows, and sends only the cells     */
+/* that changed, a few at a time, and only when the LCD's busy flag     */
+/* says it is ready, so it never waits on the LCD. Boards without the   */
+/* flag wait LCD_WRITE_US after each write, LCD_FLUSH_BUDGET at most.   */
+/************************************************************************/
+struct {
+    char frame[2 * LCD_COLUMNS];    // what the screens want shown, line one then line two
+    char shown[2 * LCD_COLUMNS];    // what the LCD currently shows
+    uint8_t address;                // where the next LCD_char goes, as an LCD address
+    uint8_t hw_address;             // the LCD's own address counter
+    bool cursor_on;                 // show the cursor at address
+    bool hw_cursor_on;
+    bool stale;                     // the framebuffer was written since the LCD last showed it
+} LCD;
+
+void LCD_framebuffer_init(void) {
+    memset(LCD.frame, ' ', sizeof(LCD.frame));
+    memset(LCD.shown, ' ', sizeof(LCD.shown)); // LCD_init cleared the display
+    LCD.address = LCD.hw_address = 0;
+    LCD.cursor_on = LCD.hw_cursor_on = false;
+}
 void LCD_command(uint8_t cmd) {
-    LCD_PORT &= ~(1 << LCD_RS);
-    LCD_PORT &= ~(1 << LCD_E);
-    LCD_send_upper_nibble(cmd);
-    _delay_us(10);
-    LCD_send_upper_nibble(cmd << 4);
-    _delay_ms(5);
+    LCD.stale = true;
+    if (cmd == clear) {
+        memset(LCD.frame, ' ', sizeof(LCD.frame));
+        LCD.address = 0;
+    } else if (cmd == home) {
+        LCD.address = 0;
+    } else if (cmd == moveLeft) {
+        LCD.address--;
+    } else if (cmd == moveRight) {
+        LCD.address++;
+    } else if (cmd == cursorOn || cmd == cursorOff) {
+        LCD.cursor_on = (cmd == cursorOn);
+    } else if (cmd & setCursor) {
+        LCD.address = cmd & ~setCursor;
+    }
 }
 void LCD_char(uint8_t data) {
-    LCD_PORT |= (1 << LCD_RS);
-    LCD_PORT &= ~(1 << LCD_E);
-    LCD_send_upper_nibble(data);
-    _delay_us(10);
-    LCD_send_upper_nibble(data << 4);
-    _delay_us(10);
+    LCD.stale = true;
+    uint8_t column = LCD.address & ~lineTwo;
+    if (column < LCD_COLUMNS) LCD.frame[((LCD.address & lineTwo) ? LCD_COLUMNS : 0) + column] = data; // the rest is off screen
+    LCD.address++;
+}
+bool LCD_flush_task(void) { // returns true once the LCD shows the framebuffer
+    for (uint8_t budget = LCD_FLUSH_BUDGET; budget > 0; budget--) {
+        if (LCD_is_busy()) return false;
+        uint8_t cell = 0;
+        while (cell < 2 * LCD_COLUMNS && LCD.frame[cell] == LCD.shown[cell]) cell++;
+        if (cell < 2 * LCD_COLUMNS) { // send the first changed cell
+            uint8_t address = (cell < LCD_COLUMNS) ? cell : lineTwo + cell - LCD_COLUMNS;
+            if (LCD.hw_address != address) {
+                LCD_hw_write(setCursor | address, false);
+                LCD.hw_address = address;
+            } else {
+                LCD_hw_write(LCD.frame[cell], true);
+                LCD.shown[cell] = LCD.frame[cell];
+                LCD.hw_address++;
+            }
+        } else if (LCD.cursor_on && LCD.hw_address != LCD.address) { // the cursor sits at the address counter
+            LCD_hw_write(setCursor | LCD.address, false);
+            LCD.hw_address = LCD.address;
+        } else if (LCD.cursor_on != LCD.hw_cursor_on) {
+            LCD_hw_write(LCD.cursor_on ? cursorOn : cursorOff, false);
+            LCD.hw_cursor_on = LCD.cursor_on;
+        } else {
+            LCD.stale = false;
+            return true;
+        }
+    }
+    return false;
+}
+void LCD_flush(void) { // waits until the LCD shows the framebuffer
+    while (!LCD_flush_task());
 }
 void LCD_string(char * string) {
     for (int i = 0; string[i] != 0; i++) {
         LCD_char(string[i]);
     }
 }
+void LCD_string_P(const char * string) { // a string in flash (PSTR)
+    for (char c; (c = pgm_read_byte(string)) != 0; string++) {
+        LCD_char(c);
+    }
+}
 void LCD_uint(uint16_t num) {
     if (num == 0) {
         LCD_char('0');
@@ -111,29 +293,114 @@ void LCD_uint(uint16_t num) {
     }
 }
 
+/************************************************************************/
+/* Performance counters                                                 */
+/* Cheap enough to stay on in the field. A histogram counts its samples */
+/* in power of 2 buckets (bucket n holds the values below               */
+/* 2^(n + shift), the last one the rest) and keeps the smallest and the */
+/* largest. The counters are uploaded to the server every               */
+/* STATS_PERIOD_MS and start over.                                      */
+/************************************************************************/
+#define PERF_BUCKETS            8
+#define STATS_PERIOD_MS         600000  // how often the counters are uploaded
+
+typedef struct {
+    uint32_t count[PERF_BUCKETS];
+    uint16_t min, max;
+    uint8_t shift;                  // the first bucket holds the values below 2^shift
+} perf_histogram_t;
+
+typedef struct {
+    perf_histogram_t task_us;       // run time of each task: how long the main loop is away
+    perf_histogram_t upload_ms;     // from a request sent until its answer
+    uint8_t tick_late;              // most timer counts (8 us) the tick ISR started late
+    uint16_t creader_overruns;      // # of bytes lost by USART0 (DOR0)
+    uint16_t creader_lost;          // # of binary ID frames lost on the link, from the sequence numbers skipped
+    uint16_t esp_overruns;          // # of bytes lost by USART1 (DOR1)
+    uint16_t decoder_reports;       // # of stats frames received from the decoder
+    uint16_t decoded;               // the decoder's counters, added up from its stats frames
+    uint16_t sync_losses;
+    uint16_t parity_errors;
+    uint16_t decoder_dropped;
+    uint8_t decoder_isr_max;        // longest edge ISR of the decoder, in its timer ticks
+    uint32_t since;                 // millis() when the counters started over
+} stats_t;
+
+stats_t stats;
+uint32_t first_scan_ms;             // millis() at the first scan of a registered card, 0: none yet
+uint32_t wifi_up_ms;                // millis() at which the ESP8266 got on the network, 0: not yet
+
+static inline void perf_add(uint16_t * counter, uint16_t n) {
+    *counter = (*counter > 0xFFFF - n) ? 0xFFFF : *counter + n;
+}
+void perf_record(perf_histogram_t * histogram, uint16_t value) {
+    uint8_t bucket = 0;
+    for (uint16_t rest = value >> histogram->shift; rest != 0 && bucket < PERF_BUCKETS - 1; rest >>= 1) {
+        bucket++;
+    }
+    histogram->count[bucket]++;
+    if (value < histogram->min) histogram->min = value;
+    if (value > histogram->max) histogram->max = value;
+}
+void perf_reset(perf_histogram_t * histogram, uint8_t shift) {
+    memset(histogram, 0, sizeof(perf_histogram_t));
+    histogram->min = 0xFFFF;
+    histogram->shift = shift;
+}
+void stats_reset(uint32_t now) { // the ISRs update some of them
+    uint8_t sreg = SREG;
+    cli();
+    memset(&stats, 0, sizeof(stats));
+    perf_reset(&stats.task_us, 6);      // below 64 us, 128 us... 4 ms and more
+    perf_reset(&stats.upload_ms, 6);    // below 64 ms, 128 ms... 4 s and more
+    stats.since = now;
+    SREG = sreg;
+}
+
 /************************************************************************/
 /* UART card reader Functions                                           */
 /************************************************************************/
 #define CREADER_INDEX -1
 
-typedef enum {CHECKED_OUT, CHECKED_IN, ALARMED} card_status_t;
+typedef enum {UNREGISTERED, CHECKED_OUT, CHECKED_IN, ALARMED} card_status_t;
 
 struct {
-    char id[CREADER_BUFF_SIZE + 1]; // the RFID tag of the card attached to the medicine
+    uint8_t id[CREADER_ID_SIZE];    // the RFID tag of the card attached to the medicine, packed 2 hex characters per byte
     uint16_t max_time;              // maximum amount of time a medicine can be checked out
-    volatile uint16_t time_left;    // how much time remaining until medicine goes bad
+    uint16_t deadline;              // checked out: checkout_clock() value at which the medicine goes bad
     card_status_t status;           // is this medicine currently checked out, checked it, or overdue?
-    bool armed;                     // flag used by check_alarm to upload the alarm triggered event only once
 } cards[CARD_COUNT] = {             // default initializations mainly used for debugging
-    [0].id = {0x00, 0x33, 0x31, 0x30, 0x30, 0x33, 0x37, 0x44, 0x39, 0x33, 0x44, 0x00, 0x00},
-    [0].max_time = 5, [0].time_left = 5, [0].status = CHECKED_IN, [0].armed = true,
-    [1].id = {0x00, 0x36, 0x36, 0x30, 0x30, 0x36, 0x43, 0x34, 0x42, 0x37, 0x46, 0x00, 0x00},
-    [1].max_time = 10, [1].time_left = 10, [1].status = CHECKED_IN, [1].armed = true
+    [0].id = {0x31, 0x00, 0x37, 0xD9, 0x3D},
+    [0].max_time = 5, [0].status = CHECKED_IN,
+    [1].id = {0x66, 0x00, 0x6C, 0x4B, 0x7F},
+    [1].max_time = 10, [1].status = CHECKED_IN
 };
+/************************************************************************/
+/* Scanned IDs are queued in a single-producer/single-consumer ring:    */
+/* the RX ISR assembles a frame, and only advances head once the ID is  */
+/* complete and copied to the slot at head; the main loop consumes the  */
+/* slot at tail. One slot always stays empty, so neither side ever      */
+/* touches a slot owned by the other and no lock is needed. IDs are     */
+/* kept packed, 2 hex characters per byte, whichever frame format       */
+/* brought them.                                                        */
+/************************************************************************/
+#define CREADER_RING_SIZE       8       // power of 2, scans queued while the main loop is busy
+
 struct {
-    volatile char ID_str[CREADER_BUFF_SIZE + 1];    //extra char for null terminator
-    volatile uint8_t index;                         // pointer to an unoccupied slot
-    volatile bool locked;                           // buffer is locked from modifications by the UART rx ISR
+    volatile uint8_t ID[CREADER_RING_SIZE][CREADER_ID_SIZE];
+    volatile uint8_t head;                          // next slot to be filled by the UART rx ISR
+    volatile uint8_t tail;                          // oldest complete ID, owned by the main loop
+    uint8_t index;                                  // # of bytes of the current frame received so far
+    bool binary;                                    // the frame being received is a binary one
+    bool heartbeat;                                 // binary: it is a heartbeat, the tag is no new scan
+    uint8_t size;                                   // binary: size of the frame, ID or stats
+    uint8_t crc;                                    // binary: running CRC-8 of the frame so far
+    uint8_t sequence;                               // binary: sequence number of the frame being received
+    uint8_t next_sequence;                          // sequence number due next, after the last ID frame
+    bool sequenced;                                 // an ID frame checked out since boot
+    uint8_t raw[CREADER_STATS_SIZE - 2];            // bytes between the mark and the CRC, until the frame checks out
+    volatile uint16_t overflows;                    // # of complete IDs dropped because the ring was full
+    volatile uint16_t errors;                       // # of frames dropped for bad framing or CRC
 } creader_buff;
 
 void UART_creader_init(void) {
@@ -152,61 +419,334 @@ unsigned char UART_creader_receive(void) {
     return UDR0;
 }
 inline bool isready_creader_buff(void) {
-    return creader_buff.locked;
+    return creader_buff.head != creader_buff.tail;
 }
-inline void release_creader_buff(void) {
-    creader_buff.locked = false;
+inline void release_creader_buff(void) { // done with the oldest ID, hand its slot back to the ISR
+    creader_buff.tail = (creader_buff.tail + 1) & (CREADER_RING_SIZE - 1);
 }
-char * get_card_id(int8_t index) {
-    char * rfid = (index == CREADER_INDEX)? (char *) creader_buff.ID_str : cards[index].id;
-    return  (rfid + 1); // actually return a pointer to index 1 as index 0 is always 0x00
+inline uint8_t * get_scanned_id(void) { // the oldest ID scanned, valid until released
+    return (uint8_t *) creader_buff.ID[creader_buff.tail];
 }
-int find_card(void) {
-    for (int i = 0; i < CARD_COUNT; i++) {
-        if (strcmp(cards[i].id + 1, (char *)(creader_buff.ID_str + 1)) == 0) {
-            return i;
-        }
+static inline char format_hex(uint8_t nibble) {
+    return (nibble <= 9) ? nibble + '0' : (nibble - 10) + 'A';
+}
+static inline uint8_t parse_hex(char c) {
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('A' <= c && c <= 'F') return c - 'A' + 10;
+    return 0x10; // not a hex digit
+}
+static inline void creader_push(void) { // the frame checked out, publish its ID
+    uint8_t next = (creader_buff.head + 1) & (CREADER_RING_SIZE - 1);
+    if (next == creader_buff.tail) {
+        creader_buff.overflows++; // the main loop fell behind, keep the older scans
+        return;
+    }
+    for (uint8_t i = 0; i < CREADER_ID_SIZE; i++) {
+        creader_buff.ID[creader_buff.head][i] = creader_buff.raw[i];
+    }
+    creader_buff.head = next;
+}
+static inline uint16_t creader_counter(uint8_t offset) {
+    return (creader_buff.raw[offset] << 8) | creader_buff.raw[offset + 1];
+}
+static inline void creader_stats(void) { // a stats frame checked out, add up the decoder's counters
+    stats.decoder_reports++;
+    perf_add(&stats.decoded, creader_counter(0));
+    perf_add(&stats.sync_losses, creader_counter(2));
+    perf_add(&stats.parity_errors, creader_counter(4));
+    perf_add(&stats.decoder_dropped, creader_buff.raw[6]);
+    if (creader_buff.raw[7] > stats.decoder_isr_max) stats.decoder_isr_max = creader_buff.raw[7];
+}
+static inline void creader_sequence(void) { // an ID frame checked out, count the ones skipped since the last one
+    // over 15 in a row go uncounted, and a restart of the decoder may count up to 15
+    if (creader_buff.sequenced) {
+        perf_add(&stats.creader_lost, (creader_buff.sequence - creader_buff.next_sequence) & 0x0F);
+    }
+    creader_buff.next_sequence = creader_buff.sequence + 1;
+    creader_buff.sequenced = true;
+}
+static inline void creader_binary_byte(char c) { // accumulate a binary frame, publish it once the CRC checks out
+    uint8_t index = creader_buff.index++;
+    if (index < creader_buff.size - 1) {
+        creader_buff.crc = creader_crc8(creader_buff.crc, c);
+        if (index > 0) creader_buff.raw[index - 1] = c;
+        return;
+    }
+    creader_buff.index = 0;
+    if ((uint8_t)c != creader_buff.crc) { // corrupted frame, drop it
+        creader_buff.errors++;
+        return;
+    }
+    if (creader_buff.size == CREADER_STATS_SIZE) {
+        creader_stats();
+    } else {
+        creader_sequence();
+        if (!creader_buff.heartbeat) creader_push();
     }
-    return -1;
 }
 ISR(USART0_RX_vect) {
+    if (UCSR0A & (1 << DOR0)) perf_add(&stats.creader_overruns, 1); // a byte was lost before this one
     char c = UART_creader_receive();
-    UART_creader_send(c); // debug:: echo
-    if (creader_buff.locked) return; 
-    int8_t index = creader_buff.index;
-    ASSERT(0 <= index && index < CREADER_BUFF_SIZE);
-    if ((index == 0 && c != 0x0A) || (index == CREADER_BUFF_SIZE - 1 && c != 0x0D)) {
+    uint8_t index = creader_buff.index;
+    ASSERT(index < CREADER_BUFF_SIZE);
+    uint8_t mark = (uint8_t)c & 0xF0;
+    if (index == 0 && (mark == CREADER_BINARY_MARK || mark == CREADER_HEARTBEAT_MARK)) { // a binary frame
+        creader_buff.binary = true;
+        creader_buff.heartbeat = (mark == CREADER_HEARTBEAT_MARK);
+        creader_buff.size = CREADER_BINARY_SIZE;
+        creader_buff.crc = 0;
+        creader_buff.sequence = c & 0x0F;
+    } else if (index == 0 && (uint8_t)c == CREADER_STATS_MARK) {
+        creader_buff.binary = true;
+        creader_buff.size = CREADER_STATS_SIZE;
+        creader_buff.crc = 0;
+    } else if (index == 0) {
+        creader_buff.binary = false;
+    }
+    if (creader_buff.binary) {
+        creader_binary_byte(c);
+        return;
+    }
+    uint8_t nibble = parse_hex(c);
+    if ((index == 0 && c != CREADER_ASCII_START) || (index == CREADER_BUFF_SIZE - 1 && c != CREADER_ASCII_END)
+        || (index != 0 && index != CREADER_BUFF_SIZE - 1 && nibble > 0x0F)) {
+        if (index != 0) creader_buff.errors++;
         creader_buff.index = 0; // reset buffer since data is not valid
         return;
     }
-    creader_buff.ID_str[creader_buff.index++] = c;
-    if (creader_buff.index >= CREADER_BUFF_SIZE) { // we successfully scanned a card.
+    if (index != 0 && index != CREADER_BUFF_SIZE - 1) { // hex characters 1 to 10, high nibble first
+        uint8_t * byte = &creader_buff.raw[(index - 1) >> 1];
+        *byte = (index & 1) ? nibble << 4 : *byte | nibble;
+    }
+    if (++creader_buff.index >= CREADER_BUFF_SIZE) { // we successfully scanned a card.
         creader_buff.index = 0;
-        creader_buff.ID_str[CREADER_BUFF_SIZE - 1] = creader_buff.ID_str[0] = 0; // insert null at the beginning and at the end
-        creader_buff.locked = true; // lock the buffer so it won't be modified until consumed by user
+        creader_push();
+    }
+}
+
+/************************************************************************/
+/* Card registry                                                        */
+/* cards[] is indexed by card number, which the user sees. card_order   */
+/* lists the registered cards sorted by ID, so a scanned ID is found    */
+/* with a binary search instead of comparing it against every card.     */
+/* CARD_COUNT stops at 128 on purpose, the lookup would take more: each */
+/* card costs 14 bytes of the 4 KB of RAM (cards[], card_order,         */
+/* deadline_heap, heap_index), 1.75 KB for 128, and its 10 byte         */
+/* snapshot fills the 2 KB EEPROM up together with the journal and the  */
+/* clock ring. Several hundred cards need a part with more of both      */
+/* (the ATmega1284P has 16 KB and 4 KB) and card numbers wider than 8   */
+/* bits.                                                                */
+/************************************************************************/
+_Static_assert(CARD_COUNT <= 128, "card numbers and positions are 8 bits");
+
+uint8_t card_order[CARD_COUNT];     // numbers of the registered cards, sorted by ID
+uint8_t card_total;                 // # of registered cards
+
+int8_t compare_id(const uint8_t * a, const uint8_t * b) {
+    for (uint8_t i = 0; i < CREADER_ID_SIZE; i++) {
+        if (a[i] != b[i]) return (a[i] < b[i]) ? -1 : 1;
+    }
+    return 0;
+}
+uint8_t lower_bound_card(const uint8_t * id) { // position of the first card in card_order with an ID >= id
+    uint8_t low = 0, high = card_total;
+    while (low < high) {
+        uint8_t middle = (low + high) >> 1;
+        if (compare_id(cards[card_order[middle]].id, id) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+int16_t find_card(const uint8_t * id) { // the number of the card with this ID, -1 if none
+    uint8_t position = lower_bound_card(id);
+    if (position < card_total && compare_id(cards[card_order[position]].id, id) == 0) {
+        return card_order[position];
+    }
+    return -1;
+}
+void card_order_remove(uint8_t index) {
+    uint8_t position = lower_bound_card(cards[index].id);
+    memmove(&card_order[position], &card_order[position + 1], card_total - position - 1);
+    card_total--;
+}
+void card_order_insert(uint8_t index) {
+    uint8_t position = lower_bound_card(cards[index].id);
+    memmove(&card_order[position + 1], &card_order[position], card_total - position);
+    card_order[position] = index;
+    card_total++;
+}
+void card_registry_init(void) {
+    card_total = 0;
+    for (uint16_t i = 0; i < CARD_COUNT; i++) {
+        if (cards[i].status != UNREGISTERED) card_order_insert(i);
+    }
+}
+void register_card(uint8_t index, const uint8_t * id) { // the ID must not belong to another card
+    if (cards[index].status != UNREGISTERED) {
+        card_order_remove(index);
+    } else {
+        cards[index].status = CHECKED_IN;
+    }
+    memcpy(cards[index].id, id, CREADER_ID_SIZE);
+    card_order_insert(index);
+}
+int16_t next_card(int16_t index, int8_t step) { // the next registered card number after index, -1 if none
+    for (uint16_t i = 0; i < CARD_COUNT; i++) {
+        index = (index + step + CARD_COUNT) % CARD_COUNT;
+        if (cards[index].status != UNREGISTERED) return index;
+    }
+    return -1;
+}
+char * format_id(const uint8_t * id) {
+    static char id_str[2 * CREADER_ID_SIZE + 1];
+    for (uint8_t i = 0; i < CREADER_ID_SIZE; i++) {
+        id_str[2 * i] = format_hex(id[i] >> 4);
+        id_str[2 * i + 1] = format_hex(id[i] & 0x0F);
+    }
+    return id_str;
+}
+char * get_card_id(int16_t index) {
+    return format_id((index == CREADER_INDEX)? get_scanned_id() : cards[index].id);
+}
+
+/************************************************************************/
+/* System Tick Functions                                                */
+/* Timer2 counts milliseconds, used for every timeout that shouldn't    */
+/* stall the main loop, and seconds, which stamp the journaled events.  */
+/* Unlike TIMER1 (the checkout countdowns) it never stops, so both      */
+/* clocks only ever count up from boot.                                 */
+/************************************************************************/
+volatile uint32_t system_ms;        // milliseconds since boot, wraps after 49 days
+volatile uint32_t system_seconds;   // seconds since boot
+uint16_t second_ms;                 // milliseconds into the current second
+
+void system_tick_init(void) {
+    TCCR2A = (1 << WGM21);  // CTC mode
+    TCCR2B = (1 << CS22);   // prescaler is 64 (see pg. 180)
+    OCR2A = 124;            // TOP value:  0.001/(1/(F_CPU/prescaler))-1
+    TIMSK2 |= (1 << OCIE2A);
+}
+uint32_t millis(void) {
+    uint8_t sreg = SREG;
+    cli(); // the 4 bytes are updated by the tick ISR
+    uint32_t now = system_ms;
+    SREG = sreg;
+    return now;
+}
+uint32_t uptime(void) {
+    uint8_t sreg = SREG;
+    cli();
+    uint32_t now = system_seconds;
+    SREG = sreg;
+    return now;
+}
+uint32_t micros(void) { // for measuring, resolution is 8 us
+    uint8_t sreg = SREG;
+    cli();
+    uint32_t ms = system_ms;
+    uint8_t count = TCNT2;
+    if ((TIFR2 & (1 << OCF2A)) && count < OCR2A) ms++; // the tick ISR is pending
+    SREG = sreg;
+    return ms * 1000 + count * 8;
+}
+ISR(TIMER2_COMPA_vect) {
+    uint8_t late = TCNT2; // counts since the compare match: how long interrupts were held off
+    if (late > stats.tick_late) stats.tick_late = late;
+    system_ms++;
+    buttons_sample();
+    if (++second_ms == 1000) {
+        second_ms = 0;
+        system_seconds++;
     }
 }
 
 /************************************************************************/
 /* UART ESP8266 Functions                                               */
+/* Bytes to the ESP8266 go through a TX ring drained by the UDRE ISR,   */
+/* the RX ISR turns the received lines into response events.            */
+/************************************************************************/
+#define ESP8266_TX_SIZE  256    // a request's header and its first lines, the rest goes out as the ring drains
+#define ESP8266_EVENT_SIZE  8   // power of 2
+
+/************************************************************************/
+/* Received bytes are never stored: the RX ISR matches each one as it   */
+/* arrives against the responses the firmware waits for, and queues an  */
+/* event when a whole line matched one of them. The responses are kept  */
+/* sorted, so the ones sharing the part of the line matched so far are  */
+/* next to each other and the matcher only ever moves forward through   */
+/* the table: a byte costs a comparison or a few, never a rescan.       */
+/* The CIPSEND prompt '>' is matched as soon as it starts a line, since */
+/* no new line follows it. What the server sends comes as "+IPD,n:" and */
+/* n bytes, which are counted off instead of matched: a line of the     */
+/* answer such as the "OK" body is not a response of the ESP8266. Only  */
+/* "HTTP/1.x nnn" is looked for in them.                                */
 /************************************************************************/
-#define ESP8266_ROW_SIZE 15
-#define ESP8266_COL_SIZE 52
+typedef enum {RESPONSE_NONE, RESPONSE_ALREADY_CONNECTED, RESPONSE_CLOSED, RESPONSE_ERROR, RESPONSE_OK,
+              RESPONSE_SEND_FAIL, RESPONSE_SEND_OK, RESPONSE_STATUS_2, RESPONSE_STATUS_3, RESPONSE_STATUS_4,
+              RESPONSE_STATUS_5, RESPONSE_LINK_INVALID, RESPONSE_READY, RESPONSE_PROMPT, RESPONSE_HTTP_OK,
+              RESPONSE_HTTP_REJECTED, RESPONSE_HTTP_ERROR} response_t;
+
+const char responses[][18] PROGMEM = {  // sorted, indexed by response_t - 1
+    "ALREADY CONNECTED", "CLOSED", "ERROR", "OK", "SEND FAIL", "SEND OK",
+    "STATUS:2", "STATUS:3", "STATUS:4", "STATUS:5", // 2: got IP, 3: TCP connected, 4: disconnected, 5: no WiFi
+    "link is not valid", "ready",
+};
+#define RESPONSE_COUNT  (sizeof(responses) / sizeof(responses[0]))
+#define NO_MATCH        RESPONSE_COUNT
+#define HTTP_STATUS     "HTTP/1.? "     // '?' matches any character, the status code follows
+#define IPD_PREFIX      "+IPD,"         // the length of the data and ':' follow
 
 struct ESP8266_buff {
-    volatile char buffer[ESP8266_ROW_SIZE][ESP8266_COL_SIZE];
-    volatile uint8_t row_index;
-    volatile uint8_t col_index;
+    volatile uint8_t events[ESP8266_EVENT_SIZE];
+    volatile uint8_t event_head;            // written by the RX ISR
+    volatile uint8_t event_tail;            // written by the main loop
+    uint8_t lost;                           // # of events dropped because the queue was full
+    uint8_t candidate;                      // the first response the line still matches, NO_MATCH if none
+    uint8_t position;                       // # of characters of the line matched
+    uint8_t http;                           // # of characters of HTTP_STATUS matched, then of the code
+    uint16_t http_code;
+    uint8_t ipd;                            // # of characters of IPD_PREFIX matched at the start of the line
+    uint16_t ipd_length;                    // the length following it
+    uint16_t payload;                       // # of bytes of data from the server still to come
+    uint8_t shared[RESPONSE_COUNT];         // # of first characters each response shares with the one before it
+    volatile char tx[ESP8266_TX_SIZE];
+    volatile uint8_t tx_head;               // written by the main loop
+    volatile uint8_t tx_tail;               // written by the UDRE ISR
 } ESP8266;
 
 void UART_ESP8266_send(unsigned char data) {
-    while (!( UCSR1A & (1<<UDRE1)));
-    UDR1 = data;
+    uint8_t next = ESP8266.tx_head + 1; // wraps around with the 8-bit index
+    while (next == ESP8266.tx_tail); // only waits when more than a whole buffer is queued
+    ESP8266.tx[ESP8266.tx_head] = data;
+    ESP8266.tx_head = next;
+    UCSR1B |= (1 << UDRIE1); // (re)start draining
 }
-void UART_ESP8266_cmd(char string[]) {
+ISR(USART1_UDRE_vect) {
+    if (ESP8266.tx_tail == ESP8266.tx_head) {
+        UCSR1B &= ~(1 << UDRIE1); // nothing left to send
+        return;
+    }
+    UDR1 = ESP8266.tx[ESP8266.tx_tail];
+    ESP8266.tx_tail++;
+}
+inline uint8_t UART_ESP8266_free(void) { // # of bytes UART_ESP8266_send takes without waiting
+    return ESP8266.tx_tail - ESP8266.tx_head - 1;
+}
+void UART_ESP8266_write(const char string[]) {
     for (int i = 0; string[i] != 0; i++) {
         UART_ESP8266_send(string[i]);
     }
+}
+void UART_ESP8266_write_P(const char * string) { // a string in flash (PSTR)
+    for (char c; (c = pgm_read_byte(string)) != 0; string++) {
+        UART_ESP8266_send(c);
+    }
+}
+void UART_ESP8266_cmd_P(const char * string) {
+    UART_ESP8266_write_P(string);
     UART_ESP8266_send(0x0D);
     UART_ESP8266_send(0x0A);
 }
@@ -214,111 +754,853 @@ unsigned char UART_ESP8266_receive(void) {
     while(~(UCSR1A) & (1<<RXC1));
     return UDR1;
 }
-int ESP8266_search_for_str(char string[]) {
-    for (int i = 0; i < ESP8266_ROW_SIZE - 1; i++) {
-        if(strcmp((char *)ESP8266.buffer[i], string) == 0) {
-            ESP8266.buffer[i][0] = 0; // clear the string
-            return i;
+void ESP8266_matcher_init(void) {
+    ESP8266.shared[0] = 0;
+    for (uint8_t i = 1; i < RESPONSE_COUNT; i++) {
+        uint8_t n = 0;
+        while (pgm_read_byte(&responses[i][n]) != 0 && pgm_read_byte(&responses[i - 1][n]) == pgm_read_byte(&responses[i][n])) n++;
+        ASSERT(pgm_read_byte(&responses[i - 1][n]) < pgm_read_byte(&responses[i][n])); // sorted
+        ESP8266.shared[i] = n;
+    }
+}
+void ESP8266_clear_buffer(void) { // forget the responses received so far
+    uint8_t sreg = SREG;
+    cli();
+    ESP8266.event_tail = ESP8266.event_head;
+    ESP8266.candidate = ESP8266.position = ESP8266.http = ESP8266.ipd = 0;
+    ESP8266.payload = 0;
+    SREG = sreg;
+}
+response_t ESP8266_next_event(void) { // the oldest response not handled yet, RESPONSE_NONE if none
+    if (ESP8266.event_tail == ESP8266.event_head) return RESPONSE_NONE;
+    response_t response = ESP8266.events[ESP8266.event_tail];
+    ESP8266.event_tail = (ESP8266.event_tail + 1) & (ESP8266_EVENT_SIZE - 1);
+    return response;
+}
+
+/************************************************************************/
+/* WiFi bring-up                                                        */
+/* Runs in the network task, so cards are scanned from power on while   */
+/* the ESP8266 resets and joins the access point; the events journaled  */
+/* meanwhile go out once it is on the network.                          */
+/*     AT+RST, "ready", ATE0, then AT+CIPSTATUS until it has an IP      */
+/* No "ready" within WIFI_RESET_MS (no power, UART trouble) resets it   */
+/* again.                                                               */
+/************************************************************************/
+#define WIFI_RESET_MS           3000    // longest wait for "ready" after AT+RST
+#define WIFI_POLL_MS            500     // AT+CIPSTATUS period while joining the access point
+
+typedef enum {WIFI_RESETTING, WIFI_JOINING, WIFI_UP} wifi_state_t;
+
+struct {
+    wifi_state_t state;
+    uint32_t deadline;                  // resetting: when to give up, joining: when to poll again
+} wifi;
+
+void wifi_reset(void) {
+    ESP8266_clear_buffer();
+    UART_ESP8266_cmd_P(PSTR("AT+RST"));
+    wifi.state = WIFI_RESETTING;
+    wifi.deadline = millis() + WIFI_RESET_MS;
+}
+void wifi_task(void) { // until the ESP8266 is on the network
+    response_t response;
+    while ((response = ESP8266_next_event()) != RESPONSE_NONE) {
+        if (wifi.state == WIFI_RESETTING && response == RESPONSE_READY) {
+            UART_ESP8266_cmd_P(PSTR("ATE0")); // disable ESP8266 echo functionality
+            wifi.state = WIFI_JOINING;
+            wifi.deadline = millis() + WIFI_POLL_MS;
+        } else if (wifi.state == WIFI_JOINING && response >= RESPONSE_STATUS_2 && response <= RESPONSE_STATUS_4) {
+            wifi.state = WIFI_UP; // 2..4: it got an IP address, the uploads take over
+            wifi_up_ms = millis();
+            return;
         }
     }
-    return -1;
+    if ((int32_t)(millis() - wifi.deadline) < 0) return;
+    if (wifi.state == WIFI_RESETTING) { // seems like the ESP8266 didn't respond...
+        wifi_reset();
+        return;
+    }
+    UART_ESP8266_cmd_P(PSTR("AT+CIPSTATUS"));
+    wifi.deadline = millis() + WIFI_POLL_MS;
 }
-bool ESP8266_find(char string[]) {
-    for (int i = 0; i < ESP8266_ROW_SIZE - 1; i++) {
-        if(strcmp((char *)ESP8266.buffer[i], string) == 0) {
-            ESP8266.buffer[i][0] = 0; // clear the string
-            return true;
+/************************************************************************/
+/* EEPROM writer                                                        */
+/* Writing a byte of EEPROM takes 3.4 ms, which the main loop doesn't   */
+/* wait for: the journal and the card snapshot only note what changed,  */
+/* EEPROM_TASK copies the next record to write into eeprom_job, and the */
+/* EE_READY interrupt writes it a byte at a time, skipping the bytes    */
+/* that already hold their value (as eeprom_update_block does). EERIE   */
+/* is set while a job is being written. eeprom_read holds the interrupt */
+/* off while it reads: the library's read would race it for EEAR.       */
+/************************************************************************/
+#define EEPROM_JOB_SIZE         15      // the largest record
+
+struct {
+    uint8_t data[EEPROM_JOB_SIZE];
+    uint8_t * address;                  // where data[0] goes
+    uint8_t size;
+    uint8_t position;                   // # of bytes of data done
+} eeprom_job;
+
+ISR(EE_READY_vect) { // no write in progress
+    while (eeprom_job.position < eeprom_job.size) {
+        uint8_t value = eeprom_job.data[eeprom_job.position];
+        EEAR = (uintptr_t) (eeprom_job.address + eeprom_job.position++);
+        EECR |= (1 << EERE);
+        if (EEDR == value) continue;
+        EEDR = value;
+        EECR |= (1 << EEMPE);
+        EECR |= (1 << EEPE); // within 4 cycles of EEMPE
+        return;
+    }
+    EECR &= ~(1 << EERIE); // all written: EEPROM_TASK loads the next job
+}
+inline bool eeprom_idle(void) {
+    return !(EECR & (1 << EERIE));
+}
+void eeprom_write(const void * data, void * address, uint8_t size) { // only when eeprom_idle
+    memcpy(eeprom_job.data, data, size);
+    eeprom_job.address = address;
+    eeprom_job.size = size;
+    eeprom_job.position = 0;
+    EECR |= (1 << EERIE); // comes right away, or when the last byte written is done
+}
+void eeprom_read(void * data, const void * address, uint8_t size) {
+    uint8_t writing = EECR & (1 << EERIE);
+    EECR &= ~(1 << EERIE);
+    eeprom_read_block(data, address, size); // waits for the byte being written
+    EECR |= writing;
+}
+
+/************************************************************************/
+/* Event journal                                                        */
+/* Every event is written to a circular journal in EEPROM before it is  */
+/* uploaded, so it survives WiFi outages and resets. Records are        */
+/* written in order around the journal, so each cell is written once    */
+/* per lap (plus once more when the record is marked as sent) instead   */
+/* of a fixed location wearing out. Nothing else is stored: on boot the */
+/* newest record is the one the sequence numbers stop counting up       */
+/* after, and the oldest pending record is the first one after it that  */
+/* wasn't marked as sent.                                               */
+/* A record appended waits in RAM (staged) until the EEPROM writer gets */
+/* to it, and the sent marks are written after the staged records:      */
+/*     marked (sent, mark not written) ... written (staged) ... head    */
+/* While JOURNAL_STAGE records wait, the tasks that append don't run    */
+/* (journal_room) rather than wait for the writer. A reset loses what   */
+/* is still staged, as it lost the events before they were written.     */
+/************************************************************************/
+#define JOURNAL_SIZE            46      // records of 15 bytes: what the card snapshot leaves of the 2 KB EEPROM
+#define JOURNAL_STAGE           8       // power of 2, most records appended and not written yet
+#define JOURNAL_PENDING         0xA5    // record state: not uploaded yet
+#define JOURNAL_SENT            0x00    // record state: uploaded (anything else: empty)
+#define JOURNAL_NEXT(i)         (((i) + 1 == JOURNAL_SIZE) ? 0 : (i) + 1)
+#define JOURNAL_NO_ID           0xFF    // ID bytes of events not about a card ("----------")
+
+typedef struct __attribute__((packed)) { // no padding on the host either (the simulator)
+    uint32_t time;                      // seconds since the boot below
+    uint16_t sequence;                  // counts up by 1 from one record to the next
+    uint8_t state;
+    char action;                        // the action character of the upload request
+    uint8_t id[CREADER_ID_SIZE];        // the tag ID, packed 2 hex characters per byte
+    uint8_t boot;                       // which boot the time is relative to
+    uint8_t crc;                        // CRC-8 of the record, state excluded
+} journal_record_t;
+
+_Static_assert(sizeof(journal_record_t) <= EEPROM_JOB_SIZE, "the EEPROM writer takes a record at a time");
+
+journal_record_t EEMEM journal_eeprom[JOURNAL_SIZE];
+
+struct {
+    uint8_t head;                       // next record to be written
+    uint8_t tail;                       // oldest record not uploaded yet
+    uint16_t sequence;                  // sequence number of the next record
+    uint8_t boot;                       // number of this boot
+    uint8_t written;                    // oldest staged record
+    bool writing;                       // the EEPROM writer has it
+    uint8_t marked;                     // oldest record whose sent mark isn't written yet
+    journal_record_t staged[JOURNAL_STAGE]; // indexed by sequence number
+} journal;
+
+uint8_t journal_crc(journal_record_t * record) {
+    uint8_t crc = 0, * bytes = (uint8_t *) record;
+    for (uint8_t i = 0; i < offsetof(journal_record_t, crc); i++) {
+        if (i != offsetof(journal_record_t, state)) crc = creader_crc8(crc, bytes[i]);
+    }
+    return crc;
+}
+inline uint8_t journal_distance(uint8_t from, uint8_t to) { // # of records from one slot up to another
+    return (to >= from) ? to - from : to + JOURNAL_SIZE - from;
+}
+journal_record_t * journal_staged(uint8_t slot) { // NULL if the record isn't staged
+    uint8_t age = journal_distance(slot, journal.head); // 1: the newest
+    if (age == 0 || age > journal_distance(journal.written, journal.head)) return NULL;
+    return &journal.staged[(uint16_t)(journal.sequence - age) & (JOURNAL_STAGE - 1)];
+}
+bool journal_read(uint8_t slot, journal_record_t * record) { // false if the slot holds no record
+    journal_record_t * staged = journal_staged(slot);
+    if (staged != NULL) {
+        *record = *staged;
+    } else {
+        eeprom_read(record, &journal_eeprom[slot], sizeof(journal_record_t));
+    }
+    return (record->state == JOURNAL_PENDING || record->state == JOURNAL_SENT) && record->crc == journal_crc(record);
+}
+void journal_init(void) {
+    journal_record_t record;
+    uint8_t newest = 0;
+    bool found = false;
+    for (uint16_t slot = 0; slot < JOURNAL_SIZE; slot++) {
+        if (!journal_read(slot, &record)) continue;
+        if (found && record.sequence != (uint16_t)(journal.sequence + 1)) break; // the older lap starts here
+        found = true;
+        newest = slot;
+        journal.sequence = record.sequence;
+        journal.boot = record.boot;
+    }
+    if (found) { // the newest record might be right before slot 0, with the older lap after it
+        while (journal_read(JOURNAL_NEXT(newest), &record) && record.sequence == (uint16_t)(journal.sequence + 1)) {
+            newest = JOURNAL_NEXT(newest);
+            journal.sequence = record.sequence;
+            journal.boot = record.boot;
         }
     }
+    journal.head = found ? JOURNAL_NEXT(newest) : 0;
+    journal.sequence++;
+    journal.boot++;
+    journal.tail = journal.head; // oldest pending record: the first one after the newest
+    uint8_t slot = journal.head;
+    do {
+        if (journal_read(slot, &record) && record.state == JOURNAL_PENDING) {
+            journal.tail = slot;
+            break;
+        }
+        slot = JOURNAL_NEXT(slot);
+    } while (slot != journal.head);
+    journal.written = journal.head;
+    journal.marked = journal.tail;
+}
+inline uint8_t journal_count(void) { // # of records not uploaded yet
+    return journal_distance(journal.tail, journal.head);
+}
+inline bool journal_marks_due(void) { // a sent mark can be written: its record isn't staged
+    return journal.marked != journal.tail && journal_staged(journal.marked) == NULL;
+}
+bool journal_write_next(void) { // gives the EEPROM writer the next record or sent mark, false if none
+    if (journal.writing) { // the writer is done with the oldest staged record
+        journal.writing = false;
+        journal.written = JOURNAL_NEXT(journal.written);
+    }
+    if (journal.written != journal.head) {
+        journal_record_t * record = journal_staged(journal.written);
+        if (journal.marked == journal.written && record->state == JOURNAL_SENT) { // written with its mark
+            journal.marked = JOURNAL_NEXT(journal.marked);
+        }
+        eeprom_write(record, &journal_eeprom[journal.written], sizeof(journal_record_t));
+        journal.writing = true;
+        return true;
+    }
+    if (journal_marks_due()) {
+        static const uint8_t sent = JOURNAL_SENT;
+        eeprom_write(&sent, &journal_eeprom[journal.marked].state, sizeof(sent));
+        journal.marked = JOURNAL_NEXT(journal.marked);
+        return true;
+    }
     return false;
 }
-void ESP8266_clear_buffer(void) {
-    for (int i = 0; i < ESP8266_ROW_SIZE - 1; i++) {
-        ESP8266.buffer[i][0] = 0;
+inline bool journal_write_due(void) {
+    return journal.writing || journal.written != journal.head || journal_marks_due();
+}
+inline bool journal_room(void) { // journal_append takes a record now: the tasks that append wait for it
+    return journal_distance(journal.written, journal.head) < JOURNAL_STAGE // not all staged
+           && !(journal.head == journal.marked && journal.marked != journal.tail); // the next slot is marked
+}
+bool journal_append(const uint8_t * id, char action) { // id is NULL for events not about a card
+    if (JOURNAL_NEXT(journal.head) == journal.tail) return false; // full of events not uploaded yet
+    if (!journal_room()) return false; // the caller didn't wait for it
+    journal_record_t * record = &journal.staged[journal.sequence & (JOURNAL_STAGE - 1)];
+    *record = (journal_record_t) {.sequence = journal.sequence, .state = JOURNAL_PENDING, .action = action,
+                                  .boot = journal.boot, .time = uptime()};
+    for (uint8_t i = 0; i < CREADER_ID_SIZE; i++) {
+        record->id[i] = (id != NULL) ? id[i] : JOURNAL_NO_ID;
     }
-    ESP8266.row_index = 0;
-    ESP8266.col_index = 0;
+    record->crc = journal_crc(record);
+    journal.head = JOURNAL_NEXT(journal.head);
+    journal.sequence++;
+    return true;
 }
-//keeps polling ESP8266 connection status until connected or user pressed "back" to cancel
-bool isConnected(void) { 
-    LCD_command(clear);
-    LCD_string("Connecting...");
-    LCD_command(setCursor | lineTwo);
-    LCD_string("Connected:");
-    for (;;) {
-        UART_ESP8266_cmd("AT+CIPSTATUS");
-        _delay_ms(500);
-        LCD_command(setCursor | lineTwo);
-        if (ESP8266_find("STATUS:2")) {
-            LCD_string("Connected: YES");
-            ESP8266_clear_buffer();
-            return true;
-        } else if (ESP8266_find("STATUS:5")) {
-            LCD_string("Connected: NO ");
-            ESP8266_clear_buffer();
+void journal_mark_sent(void) { // the oldest pending record made it to the server
+    journal_record_t * staged = journal_staged(journal.tail);
+    if (staged != NULL) staged->state = JOURNAL_SENT; // not written yet: written with the mark
+    journal.tail = JOURNAL_NEXT(journal.tail);
+}
+
+/************************************************************************/
+/* Server uploads                                                       */
+/* upload_to_server only journals the event. ESP8266_task, called from  */
+/* every UI loop, keeps one HTTP/1.1 keep-alive connection to the       */
+/* server open and drains the journal over it: each POST /batch request */
+/* carries up to UPLOAD_BATCH records, and up to UPLOAD_PIPELINE        */
+/* requests are sent before the first answer comes back. The lines of a */
+/* request are queued as the TX ring to the ESP8266 drains, so no task  */
+/* waits for it. Records are marked as sent only when the server        */
+/* answers the request that carried them (the server answers in order)  */
+/* with a success, or with an error that sending them again can't fix   */
+/* (4xx). On any other error (5xx) the connection is closed and the     */
+/* records stay pending; if a request is being sent meanwhile, only     */
+/* once it is, since the ESP8266 would take AT+CIPCLOSE for its data.   */
+/* When the link is lost, AT+CIPSTATUS tells whether to reconnect, and  */
+/* every unanswered record is sent again. Failures wait before          */
+/* reconnecting, twice as long each time up to UPLOAD_RETRY_MAX_MS, and */
+/* the first answer accepted starts that over.                          */
+/*     journal: tail ... sent (waiting for answers) ... head (not sent) */
+/* A batch line: boot (2 hex), ID (10 hex), action, time (8 hex),       */
+/* sequence number (4 hex), LF. The server keeps one row per device,    */
+/* boot and sequence number, so a batch sent again after its answer got */
+/* lost isn't stored twice.                                             */
+/* The X-Device-Clock header carries the boot and time at which the     */
+/* request was sent, which the server uses to put the records on its    */
+/* own clock, and X-Device-Id which unit sent it (units share an        */
+/* address behind NAT).                                                 */
+/* Built with UPLOAD_KEEP_ALIVE 0 (and a batch of 1, one request in     */
+/* flight), it opens a connection per event instead and closes it once  */
+/* the answer is in, the way the first firmware uploaded:               */
+/* sim/bench_uploads.c compares the two.                                */
+/************************************************************************/
+#ifndef UPLOAD_BATCH
+#define UPLOAD_BATCH            8       // most records per request
+#endif
+#ifndef UPLOAD_PIPELINE
+#define UPLOAD_PIPELINE         2       // most requests waiting for an answer
+#endif
+#ifndef UPLOAD_KEEP_ALIVE
+#define UPLOAD_KEEP_ALIVE       1       // 0: a connection per request, closed once it is answered
+#endif
+#define UPLOAD_TIMEOUT_MS       5000    // longest wait for any single response
+#define UPLOAD_RETRY_DELAY_MS   1000    // the first wait after a failure
+#define UPLOAD_RETRY_MAX_MS     64000
+#define UPLOAD_STATUS_PERIOD_MS 30000   // how often an idle connection is checked with AT+CIPSTATUS
+#define HTTP_BATCH_HEADER       "POST /batch HTTP/1.1\r\nHost: " SERVER_IP_ADDRESS "\r\nX-Device-Id: " DEVICE_ID "\r\n" \
+                                "X-Device-Clock: ##########\r\nContent-Length: #\r\n\r\n"
+#define HTTP_BATCH_HEADER_SIZE  (sizeof(HTTP_BATCH_HEADER) - 2)     // but the digits of the content length
+#define HTTP_BATCH_LINE_SIZE    26
+#define HTTP_STATS_HEADER       "POST /stats HTTP/1.1\r\nHost: " SERVER_IP_ADDRESS "\r\nX-Device-Id: " DEVICE_ID "\r\n" \
+                                "X-Device-Clock: ##########\r\nContent-Length: #\r\n\r\n"
+#define HTTP_STATS_HEADER_SIZE  (sizeof(HTTP_STATS_HEADER) - 2)
+
+typedef enum {UPLOAD_IDLE, UPLOAD_CONNECTING, UPLOAD_READY, UPLOAD_PROMPT, UPLOAD_SENDING, UPLOAD_CHECKING,
+              UPLOAD_BACKOFF, UPLOAD_CLOSING} upload_state_t;
+
+struct {
+    uint8_t sent;                           // first journal record not sent yet
+    uint8_t batch;                          // # of records in the request being sent
+    uint8_t lines;                          // # of its records queued to the ESP8266 so far
+    uint8_t line_slot;                      // journal slot of the next one
+    uint8_t in_flight[UPLOAD_PIPELINE];     // # of records of each request waiting for an answer, oldest first
+    uint8_t requests;                       // # of requests waiting for an answer
+    uint32_t sent_at[UPLOAD_PIPELINE];      // millis() when each request waiting for an answer was sent
+    bool stats;                             // the request being sent carries the counters, not records
+    upload_state_t state;
+    bool connected;                         // CIPSTATUS reported the connection as up
+    bool failing;                           // an error came back while a request was being sent
+    uint32_t deadline;                      // when the current state times out
+    uint32_t answer_deadline;               // when the oldest request sent must be answered by
+    uint32_t checked;                       // when the connection was last known to be up
+    uint16_t dropped;                       // # of events lost because the journal was full
+    uint16_t rejected;                      // # of requests the server refused for good (4xx)
+    uint16_t errors;                        // # of requests the server failed to handle (5xx), sent again
+    uint32_t retry_delay;                   // how long the next failure waits before reconnecting
+} upload;
+
+void upload_to_server(const uint8_t * id, char action) {
+    if (!journal_append(id, action)) upload.dropped++;
+}
+static inline void upload_wait(upload_state_t state, uint32_t timeout) {
+    upload.state = state;
+    upload.deadline = millis() + timeout;
+}
+void upload_lost_connection(void) { // the server closed the idle connection, or the link dropped
+    upload.sent = journal.tail; // everything unanswered goes out again on the next connection
+    upload.requests = 0;
+    upload.stats = false;
+    upload.failing = false;
+    upload.state = UPLOAD_IDLE;
+}
+void upload_failed(void) {
+    UART_ESP8266_cmd_P(PSTR("AT+CIPCLOSE"));
+    upload_lost_connection();
+    if (upload.retry_delay < UPLOAD_RETRY_DELAY_MS) upload.retry_delay = UPLOAD_RETRY_DELAY_MS;
+    upload_wait(UPLOAD_BACKOFF, upload.retry_delay);
+    if (upload.retry_delay < UPLOAD_RETRY_MAX_MS) upload.retry_delay *= 2;
+}
+void UART_ESP8266_hex(uint8_t byte) {
+    UART_ESP8266_send(format_hex(byte >> 4));
+    UART_ESP8266_send(format_hex(byte & 0x0F));
+}
+static inline uint8_t decimal_digits(uint16_t value) {
+    uint8_t digits = 1;
+    for (; value >= 10; value /= 10) digits++;
+    return digits;
+}
+void UART_ESP8266_decimal(uint16_t value) { // as many digits as it takes, no leading zeros
+    char digits[5];
+    uint8_t n = 0;
+    do {
+        digits[n++] = value % 10 + '0';
+        value /= 10;
+    } while (value != 0);
+    while (n > 0) UART_ESP8266_send(digits[--n]);
+}
+void upload_send_header(const char * header, uint16_t size) { // a PSTR: fills in the device clock and the content length
+    bool clock = true; // the first run of #s, the content length is the second
+    for (char c; (c = pgm_read_byte(header)) != 0; header++) {
+        if (c != '#') {
+            UART_ESP8266_send(c);
+        } else if (clock) {
+            UART_ESP8266_hex(journal.boot);
+            uint32_t time = uptime();
+            for (int8_t shift = 24; shift >= 0; shift -= 8) {
+                UART_ESP8266_hex(time >> shift);
+            }
+            header += 9;
+            clock = false;
+        } else {
+            UART_ESP8266_decimal(size);
+        }
+    }
+}
+_Static_assert(HTTP_BATCH_HEADER_SIZE + 5 + HTTP_BATCH_LINE_SIZE < ESP8266_TX_SIZE,
+               "the header and a batch line must fit the TX ring");
+_Static_assert(HTTP_STATS_HEADER_SIZE + 5 < ESP8266_TX_SIZE, "the header must fit the TX ring");
+
+void upload_send_batch_lines(void) { // only whole lines, as many as the TX ring takes without waiting
+    journal_record_t record;
+    bool read = false; // a record read from the EEPROM waits for the byte being written (3.4 ms): one per run
+    for (; upload.lines < upload.batch && UART_ESP8266_free() >= HTTP_BATCH_LINE_SIZE; upload.lines++) {
+        if (journal_staged(upload.line_slot) == NULL) {
+            if (read) break;
+            read = true;
+        }
+        journal_read(upload.line_slot, &record);
+        upload.line_slot = JOURNAL_NEXT(upload.line_slot);
+        UART_ESP8266_hex(record.boot);
+        uint8_t no_id = JOURNAL_NO_ID;
+        for (uint8_t j = 0; j < CREADER_ID_SIZE; j++) {
+            no_id &= record.id[j];
+        }
+        if (no_id == JOURNAL_NO_ID) {
+            UART_ESP8266_write_P(PSTR("----------"));
         } else {
-            LCD_string("No response...");
+            UART_ESP8266_write(format_id(record.id));
         }
-        button_t pressed = probe_buttons();
-        if (pressed == LEFT) {
-            return false;
+        UART_ESP8266_send(record.action);
+        for (int8_t shift = 24; shift >= 0; shift -= 8) {
+            UART_ESP8266_hex(record.time >> shift);
         }
+        UART_ESP8266_hex(record.sequence >> 8);
+        UART_ESP8266_hex(record.sequence);
+        UART_ESP8266_send('\n');
+    }
+}
+void upload_send_batch(void) { // ESP8266_task sends the rest of the lines as the TX ring drains
+    upload_send_header(PSTR(HTTP_BATCH_HEADER), upload.batch * HTTP_BATCH_LINE_SIZE);
+    upload.lines = 0;
+    upload.line_slot = upload.sent;
+    upload_send_batch_lines();
+}
+void upload_start_send(uint16_t header_size, uint16_t content_length) {
+    UART_ESP8266_write_P(PSTR("AT+CIPSEND="));
+    UART_ESP8266_decimal(header_size + decimal_digits(content_length) + content_length);
+    UART_ESP8266_send(0x0D);
+    UART_ESP8266_send(0x0A);
+    upload_wait(UPLOAD_PROMPT, UPLOAD_TIMEOUT_MS);
+}
+void upload_start_batch(void) {
+    upload.batch = 0;
+    for (uint8_t slot = upload.sent; slot != journal.head && upload.batch < UPLOAD_BATCH; slot = JOURNAL_NEXT(slot)) {
+        upload.batch++;
+    }
+    upload_start_send(HTTP_BATCH_HEADER_SIZE, upload.batch * HTTP_BATCH_LINE_SIZE);
+}
+
+/************************************************************************/
+/* The counters go out as a POST /stats request of "name=value" lines,  */
+/* a histogram as "name=min,max,count of each bucket". The body isn't   */
+/* kept: a snapshot of the counters is taken when the request starts,   */
+/* the lines are written from it once to count their length (needed     */
+/* for AT+CIPSEND), and again as the TX ring drains, each line starting */
+/* over where the last pass stopped. The counters start over right      */
+/* away: a request that doesn't make it loses them. The error counts    */
+/* kept by the UART and upload code are sent as totals since boot.      */
+/************************************************************************/
+struct {
+    stats_t counters;                       // the period being sent
+    uint32_t period_s;
+    uint16_t creader_errors, creader_overflows, upload_dropped, upload_rejected, upload_errors;
+    uint8_t esp_lost;
+    uint32_t first_scan_ms, wifi_up_ms;
+    uint16_t size;                          // # of bytes of the body
+    uint8_t line;                           // the first line not sent completely
+    uint8_t column;                         // # of bytes of the line written so far in this pass
+    uint8_t sent;                           // # of bytes of the line already queued to the ESP8266
+    uint8_t room;                           // # of bytes the TX ring still takes in this pass, 0: only counts
+} stats_out;
+
+void stats_put_char(char c) {
+    if (stats_out.column++ == stats_out.sent && stats_out.room > 0) {
+        UART_ESP8266_send(c);
+        stats_out.sent++;
+        stats_out.room--;
+    }
+}
+void stats_put_P(const char * text) { // a PSTR
+    for (char c; (c = pgm_read_byte(text)) != 0; text++) {
+        stats_put_char(c);
+    }
+}
+void stats_put_uint(uint32_t value) {
+    char digits[10];
+    uint8_t i = sizeof(digits);
+    do {
+        digits[--i] = value % 10 + '0';
+        value /= 10;
+    } while (value != 0);
+    while (i < sizeof(digits)) stats_put_char(digits[i++]);
+}
+void stats_line(const char * name, uint32_t value) {
+    stats_put_P(name);
+    stats_put_char('=');
+    stats_put_uint(value);
+    stats_put_char('\n');
+}
+void stats_histogram(const char * name, const perf_histogram_t * histogram) {
+    stats_put_P(name);
+    stats_put_char('=');
+    stats_put_uint(histogram->min);
+    for (int8_t i = -1; i < PERF_BUCKETS; i++) {
+        stats_put_char(',');
+        stats_put_uint((i < 0) ? histogram->max : histogram->count[i]);
+    }
+    stats_put_char('\n');
+}
+bool stats_write_line(uint8_t line) { // false past the last one
+    const stats_t * counters = &stats_out.counters;
+    stats_out.column = 0;
+    switch (line) {
+    case 0:  stats_line(PSTR("period_s"), stats_out.period_s); break;
+    case 1:  stats_histogram(PSTR("task_us"), &counters->task_us); break;
+    case 2:  stats_histogram(PSTR("upload_ms"), &counters->upload_ms); break;
+    case 3:  stats_line(PSTR("tick_late_us"), counters->tick_late * 8); break;
+    case 4:  stats_line(PSTR("creader_overruns"), counters->creader_overruns); break;
+    case 5:  stats_line(PSTR("creader_errors"), stats_out.creader_errors); break;
+    case 6:  stats_line(PSTR("creader_overflows"), stats_out.creader_overflows); break;
+    case 7:  stats_line(PSTR("creader_lost"), counters->creader_lost); break;
+    case 8:  stats_line(PSTR("esp_overruns"), counters->esp_overruns); break;
+    case 9:  stats_line(PSTR("esp_lost"), stats_out.esp_lost); break;
+    case 10: stats_line(PSTR("upload_dropped"), stats_out.upload_dropped); break;
+    case 11: stats_line(PSTR("upload_rejected"), stats_out.upload_rejected); break;
+    case 12: stats_line(PSTR("upload_errors"), stats_out.upload_errors); break;
+    case 13: stats_line(PSTR("decoder_reports"), counters->decoder_reports); break;
+    case 14: stats_line(PSTR("decoded"), counters->decoded); break;
+    case 15: stats_line(PSTR("sync_losses"), counters->sync_losses); break;
+    case 16: stats_line(PSTR("parity_errors"), counters->parity_errors); break;
+    case 17: stats_line(PSTR("decoder_dropped"), counters->decoder_dropped); break;
+    case 18: stats_line(PSTR("decoder_isr_ticks"), counters->decoder_isr_max); break;
+    case 19: stats_line(PSTR("first_scan_ms"), stats_out.first_scan_ms); break;
+    case 20: stats_line(PSTR("wifi_up_ms"), stats_out.wifi_up_ms); break;
+    default: return false;
     }
+    return true;
 }
-void upload_to_server(char * rfid, char action) {
-    char HTTP_request_buffer[] = "GET /add/##########/& HTTP/1.0";
-    for (int i = 0 ; i < 10; i++) { // copy the RFID to the buffer (starting at first # which is index 9)
-        HTTP_request_buffer[9 + i] = rfid[i];
+void stats_snapshot(uint32_t now) {
+    uint8_t sreg = SREG;
+    cli(); // the ISRs keep counting
+    stats_out.counters = stats;
+    stats_out.creader_errors = creader_buff.errors;
+    stats_out.creader_overflows = creader_buff.overflows;
+    SREG = sreg;
+    stats_reset(now);
+    stats_out.period_s = (now - stats_out.counters.since) / 1000;
+    stats_out.esp_lost = ESP8266.lost;
+    stats_out.upload_dropped = upload.dropped;
+    stats_out.upload_rejected = upload.rejected;
+    stats_out.upload_errors = upload.errors;
+    stats_out.first_scan_ms = first_scan_ms;
+    stats_out.wifi_up_ms = wifi_up_ms;
+    stats_out.size = 0;
+    stats_out.room = 0; // count only
+    for (uint8_t line = 0; stats_write_line(line); line++) {
+        stats_out.size += stats_out.column;
     }
-    HTTP_request_buffer[20] = action; // copy the action (index 20 which is &)
-    UART_ESP8266_cmd("AT+CIPSTART=\"TCP\",\""SERVER_IP_ADDRESS"\",80");
-    _delay_ms(1000);
-    UART_ESP8266_cmd("AT+CIPSEND=34");
-    _delay_ms(1000);
-    UART_ESP8266_cmd(HTTP_request_buffer);
-    UART_ESP8266_cmd("");
-    _delay_ms(1000);
+}
+inline bool stats_due(uint32_t now) {
+    return now - stats.since >= STATS_PERIOD_MS;
+}
+void upload_start_stats(uint32_t now) {
+    stats_snapshot(now);
+    upload.batch = 0; // no records: the answer marks nothing as sent
+    upload.stats = true;
+    upload_start_send(HTTP_STATS_HEADER_SIZE, stats_out.size);
+}
+void upload_send_stats_body(void) { // only as much as the TX ring takes without waiting
+    stats_out.room = UART_ESP8266_free();
+    while (stats_out.room > 0 && stats_write_line(stats_out.line)) {
+        if (stats_out.sent < stats_out.column) break; // the ring filled up in the middle of it
+        stats_out.line++;
+        stats_out.sent = 0;
+    }
+}
+void upload_send_stats(void) { // ESP8266_task sends the rest of the body as the TX ring drains
+    upload_send_header(PSTR(HTTP_STATS_HEADER), stats_out.size);
+    stats_out.line = 0;
+    stats_out.sent = 0;
+    upload_send_stats_body();
+}
+void upload_on_answer(response_t answer) { // the HTTP status line answering the oldest request in flight
+    if (upload.requests == 0 || upload.failing) return; // not ours, or sent again anyway
+    uint32_t elapsed = millis() - upload.sent_at[0];
+    perf_record(&stats.upload_ms, (elapsed > 0xFFFF) ? 0xFFFF : elapsed);
+    if (answer == RESPONSE_HTTP_ERROR) { // the records stay pending, and go out again after a while
+        upload.errors++;
+        if (upload.state == UPLOAD_PROMPT || upload.state == UPLOAD_SENDING) {
+            upload.failing = true; // the ESP8266 takes the next bytes as data: fail once they are sent
+        } else {
+            upload_failed();
+        }
+        return;
+    }
+    if (answer == RESPONSE_HTTP_REJECTED) upload.rejected++; // retrying wouldn't help, don't block the journal on it
+    upload.retry_delay = UPLOAD_RETRY_DELAY_MS;
+    for (uint8_t i = 0; i < upload.in_flight[0]; i++) {
+        journal_mark_sent();
+    }
+    for (uint8_t i = 1; i < upload.requests; i++) {
+        upload.in_flight[i - 1] = upload.in_flight[i];
+        upload.sent_at[i - 1] = upload.sent_at[i];
+    }
+    upload.requests--;
+    upload.answer_deadline = millis() + UPLOAD_TIMEOUT_MS;
+#if !UPLOAD_KEEP_ALIVE
+    if (upload.requests == 0 && upload.state == UPLOAD_READY) { // the next request opens a new one
+        UART_ESP8266_cmd_P(PSTR("AT+CIPCLOSE"));
+        upload_wait(UPLOAD_CLOSING, UPLOAD_TIMEOUT_MS);
+    }
+#endif
+}
+void upload_on_response(response_t response) {
+    if (response >= RESPONSE_HTTP_OK) { // "+IPD,n:HTTP/1.1 200 OK"...
+        upload_on_answer(response);
+        return;
+    }
+    if (response == RESPONSE_CLOSED && upload.state != UPLOAD_BACKOFF && upload.state != UPLOAD_CLOSING) {
+        if (upload.state == UPLOAD_READY || upload.state == UPLOAD_IDLE) {
+            upload_lost_connection();
+        } else {
+            upload_failed();
+        }
+        return;
+    }
+    switch (upload.state) {
+        case UPLOAD_CONNECTING:
+            if (response == RESPONSE_OK || response == RESPONSE_ALREADY_CONNECTED) {
+                upload.state = UPLOAD_READY;
+                upload.checked = millis();
+            } else if (response == RESPONSE_ERROR) {
+                upload_failed();
+            }
+            break;
+        case UPLOAD_CHECKING:
+            if (response >= RESPONSE_STATUS_2 && response <= RESPONSE_STATUS_5) {
+                upload.connected = (response == RESPONSE_STATUS_3); // 3: TCP connection open
+            } else if (response == RESPONSE_OK) {
+                upload.checked = millis();
+                if (upload.connected) {
+                    upload.state = UPLOAD_READY;
+                } else {
+                    upload_lost_connection();
+                }
+            }
+            break;
+        case UPLOAD_PROMPT:
+            if (response == RESPONSE_PROMPT) {
+                if (upload.stats) {
+                    upload_send_stats();
+                } else {
+                    upload_send_batch();
+                }
+                upload_wait(UPLOAD_SENDING, UPLOAD_TIMEOUT_MS);
+            } else if (response == RESPONSE_ERROR || response == RESPONSE_LINK_INVALID) {
+                upload_failed();
+            }
+            break;
+        case UPLOAD_SENDING:
+            if (upload.failing && (response == RESPONSE_SEND_OK || response == RESPONSE_SEND_FAIL
+                                   || response == RESPONSE_ERROR)) {
+                upload_failed();
+            } else if (response == RESPONSE_SEND_OK) { // the next request can go out before the answer comes back
+                if (upload.requests == 0) upload.answer_deadline = millis() + UPLOAD_TIMEOUT_MS;
+                upload.sent_at[upload.requests] = millis();
+                upload.in_flight[upload.requests++] = upload.batch;
+                upload.stats = false;
+                for (uint8_t i = 0; i < upload.batch; i++) {
+                    upload.sent = JOURNAL_NEXT(upload.sent);
+                }
+                upload.state = UPLOAD_READY;
+                upload.checked = millis();
+            } else if (response == RESPONSE_SEND_FAIL || response == RESPONSE_ERROR) {
+                upload_failed();
+            }
+            break;
+        case UPLOAD_CLOSING: // CLOSED, then the OK of AT+CIPCLOSE
+            if (response == RESPONSE_OK || response == RESPONSE_ERROR) upload_lost_connection();
+            break;
+        default: // unsolicited responses (OK of AT+CIPCLOSE...) are ignored
+            break;
+    }
+}
+void ESP8266_task(void) {
+    if (wifi.state != WIFI_UP) {
+        wifi_task();
+        return;
+    }
+    response_t response;
+    while ((response = ESP8266_next_event()) != RESPONSE_NONE) {
+        upload_on_response(response);
+    }
+    uint32_t now = millis();
+    if (upload.state == UPLOAD_SENDING) {
+        if (upload.stats) {
+            upload_send_stats_body();
+        } else {
+            upload_send_batch_lines();
+        }
+    }
+    switch (upload.state) {
+        case UPLOAD_IDLE: // not connected
+            if (upload.sent == journal.head && !stats_due(now)) return; // nothing to upload
+            UART_ESP8266_cmd_P(PSTR("AT+CIPSTART=\"TCP\",\""SERVER_IP_ADDRESS"\",80"));
+            upload_wait(UPLOAD_CONNECTING, 2 * UPLOAD_TIMEOUT_MS);
+            break;
+        case UPLOAD_READY:
+            if (upload.requests != 0 && (int32_t)(now - upload.answer_deadline) >= 0) {
+                upload_failed(); // requests sent but never answered
+            } else if (upload.sent != journal.head && upload.requests < UPLOAD_PIPELINE) {
+                upload_start_batch();
+            } else if (stats_due(now) && upload.requests < UPLOAD_PIPELINE) { // events go first
+                upload_start_stats(now);
+            } else if (upload.requests == 0 && now - upload.checked >= UPLOAD_STATUS_PERIOD_MS) {
+                UART_ESP8266_cmd_P(PSTR("AT+CIPSTATUS"));
+                upload.connected = false;
+                upload_wait(UPLOAD_CHECKING, UPLOAD_TIMEOUT_MS);
+            }
+            break;
+        case UPLOAD_BACKOFF: // reconnect only if the connection is really gone
+            if ((int32_t)(now - upload.deadline) < 0) return;
+            UART_ESP8266_cmd_P(PSTR("AT+CIPSTATUS"));
+            upload.connected = false;
+            upload_wait(UPLOAD_CHECKING, UPLOAD_TIMEOUT_MS);
+            break;
+        default: // waiting for the ESP8266 to answer
+            if ((int32_t)(now - upload.deadline) >= 0) upload_failed();
+            break;
+    }
+}
+bool network_ready(void) { // the ESP8266 answered, or there is something to send
+    if (ESP8266.event_tail != ESP8266.event_head) return true;
+    if (wifi.state != WIFI_UP || upload.sent == journal.head) return false;
+    return upload.state == UPLOAD_IDLE || (upload.state == UPLOAD_READY && upload.requests < UPLOAD_PIPELINE);
 }
 void UART_ESP8266_init(void) {
     UBRR1H = (ESP8266_BAUD_REG_VAL>>8);
     UBRR1L = ESP8266_BAUD_REG_VAL;
     UCSR1B = (1<<TXEN1) | (1<<RXEN1);
     UCSR1C = (3<<UCSZ10);
+    ESP8266_matcher_init();
     UCSR1B |= (1 << RXCIE1); // enable interrupt on receive
-    for (;;) {
-        ESP8266_clear_buffer();
-        UART_ESP8266_cmd("AT+RST");
-        LCD_command(clear);
-        LCD_string("Resetting WIFI..");
-        _delay_ms(1000);
-        if (!ESP8266_find("ready")) { // seems like the ESP8266 didn't respond...
-            LCD_command(clear);
-            LCD_string("timeout/UART err");
-            LCD_command(setCursor | lineTwo);
-            LCD_string("restarting...");
-            _delay_ms(1000);
-            continue;
+    wifi_reset(); // the network task does the rest
+}
+static inline void ESP8266_event(response_t response) {
+    uint8_t next = (ESP8266.event_head + 1) & (ESP8266_EVENT_SIZE - 1);
+    if (next == ESP8266.event_tail) {
+        ESP8266.lost++;
+        return;
+    }
+    ESP8266.events[ESP8266.event_head] = response;
+    ESP8266.event_head = next;
+}
+static inline response_t ESP8266_http_response(uint16_t code) {
+    if (code >= 200 && code < 300) return RESPONSE_HTTP_OK;
+    if (code >= 400 && code < 500 && code != 408 && code != 429) return RESPONSE_HTTP_REJECTED; // for good
+    return RESPONSE_HTTP_ERROR; // 5xx, timeouts, throttling: sent again, it can succeed
+}
+static inline void ESP8266_match_http(char c) {
+    static const char status[] PROGMEM = HTTP_STATUS;
+    if (ESP8266.http < sizeof(status) - 1) {
+        char expected = pgm_read_byte(&status[ESP8266.http]);
+        if (c == expected || expected == '?') {
+            ESP8266.http++;
+            ESP8266.http_code = 0;
+        } else {
+            ESP8266.http = (c == pgm_read_byte(&status[0])); // the prefix doesn't repeat inside itself
         }
-        UART_ESP8266_cmd("ATE0"); // disable ESP8266 echo functionality
-        _delay_ms(500);
-        if (!isConnected()) continue;       // if user pressed reset, restart ESP8266
-        upload_to_server("----------",'b');  // record the restart of the system
-        break;
-    }    
+        return;
+    }
+    if (c < '0' || c > '9') {
+        ESP8266.http = 0;
+        return;
+    }
+    ESP8266.http_code = 10 * ESP8266.http_code + c - '0';
+    if (++ESP8266.http == sizeof(status) - 1 + 3) {
+        ESP8266_event(ESP8266_http_response(ESP8266.http_code));
+        ESP8266.http = 0;
+    }
+}
+static inline void ESP8266_match_ipd(char c) { // called before the line matcher sees c
+    static const char prefix[] PROGMEM = IPD_PREFIX;
+    uint8_t ipd = ESP8266.ipd;
+    if (ipd < sizeof(prefix) - 1) {
+        bool line_start = (ESP8266.candidate == 0 && ESP8266.position == 0);
+        ESP8266.ipd = (c == pgm_read_byte(&prefix[ipd]) && (ipd != 0 || line_start)) ? ipd + 1 : 0;
+        ESP8266.ipd_length = 0;
+        return;
+    }
+    if (c >= '0' && c <= '9' && ESP8266.ipd_length < 1000) {
+        ESP8266.ipd_length = 10 * ESP8266.ipd_length + c - '0';
+        return;
+    }
+    if (c == ':') ESP8266.payload = ESP8266.ipd_length; // the data starts with the next byte
+    ESP8266.ipd = 0;
 }
 ISR(USART1_RX_vect) {
+    if (UCSR1A & (1 << DOR1)) perf_add(&stats.esp_overruns, 1);
     char c = UART_ESP8266_receive();
-    int row = ESP8266.row_index, col = ESP8266.col_index;
-    ASSERT(0 <= col && col < ESP8266_COL_SIZE)
-    ESP8266.buffer[row][col] = c;
-    if ((col > 0 && ESP8266.buffer[row][col - 1] == 0x0D && ESP8266.buffer[row][col] == 0x0A)
-    || (col == ESP8266_COL_SIZE - 1)) {
-        ESP8266.buffer[row][col - 1] = 0; // insert null terminator
-        ESP8266.row_index = (row == ESP8266_ROW_SIZE - 1)? 0: row + 1;
-        ESP8266.col_index = 0;  // return to the beginning of the line
+    if (ESP8266.payload != 0) { // data from the server
+        ESP8266_match_http(c);
+        if (--ESP8266.payload == 0) ESP8266.candidate = ESP8266.position = 0; // the ESP8266's own lines resume
+        return;
+    }
+    ESP8266_match_ipd(c);
+    uint8_t candidate = ESP8266.candidate, position = ESP8266.position;
+    if (c == 0x0A) { // end of the line
+        if (candidate != NO_MATCH && pgm_read_byte(&responses[candidate][position]) == 0) ESP8266_event(candidate + 1);
+        ESP8266.candidate = ESP8266.position = 0;
+        return;
+    }
+    if (c == 0x0D || candidate == NO_MATCH) return;
+    if (position == 0 && c == '>') { // the CIPSEND prompt isn't followed by a new line
+        ESP8266_event(RESPONSE_PROMPT);
+        ESP8266.candidate = NO_MATCH;
         return;
     }
-    ESP8266.col_index++;
+    for (char expected; (expected = pgm_read_byte(&responses[candidate][position])) != c; ) {
+        if (expected > c // sorted: the responses after it don't have c here either
+        || ++candidate == RESPONSE_COUNT || ESP8266.shared[candidate] < position) {
+            ESP8266.candidate = NO_MATCH;
+            return;
+        }
+    }
+    ESP8266.candidate = candidate;
+    ESP8266.position = position + 1;
 }
 
 /************************************************************************/
@@ -334,11 +1616,87 @@ inline void enable_T1SEC(void) {
 inline void disable_T1SEC(void) {
     TIMSK1 &= ~(1 << OCIE1A);
 }
+volatile uint16_t checkout_seconds; // only counts while the timer is enabled (not during setup)
+
+uint16_t checkout_clock(void) {
+    uint8_t sreg = SREG;
+    cli(); // the 2 bytes are updated by the timer ISR
+    uint16_t now = checkout_seconds;
+    SREG = sreg;
+    return now;
+}
 ISR(TIMER1_COMPA_vect) {
-    for (uint8_t i = 0; i < CARD_COUNT; i++) {
-        if (cards[i].time_left > 0 && cards[i].status == CHECKED_OUT) {
-            cards[i].time_left--;
+    checkout_seconds++;
+}
+
+/************************************************************************/
+/* Checkout deadlines                                                   */
+/* A checked out card goes bad at a fixed deadline on the checkout      */
+/* clock, so nothing has to count down every card each second: the      */
+/* remaining time is worked out only when it is shown. The checked out  */
+/* cards are kept in a binary min-heap by deadline, so check_alarm only */
+/* looks at the top of the heap. Deadlines are at most 59:59 ahead, so  */
+/* comparing them as differences survives the 16-bit clock wrapping.    */
+/************************************************************************/
+uint8_t deadline_heap[CARD_COUNT];  // checked out cards, earliest deadline first
+uint8_t heap_index[CARD_COUNT];     // where each checked out card is in deadline_heap
+uint8_t deadline_count;             // # of cards in deadline_heap
+
+inline bool is_earlier(uint8_t a, uint8_t b) {
+    return (int16_t)(cards[a].deadline - cards[b].deadline) < 0;
+}
+void heap_place(uint8_t position, uint8_t card) {
+    deadline_heap[position] = card;
+    heap_index[card] = position;
+}
+void heap_sift_up(uint8_t position) {
+    uint8_t card = deadline_heap[position];
+    while (position > 0) {
+        uint8_t parent = (position - 1) >> 1;
+        if (!is_earlier(card, deadline_heap[parent])) break;
+        heap_place(position, deadline_heap[parent]);
+        position = parent;
+    }
+    heap_place(position, card);
+}
+void heap_sift_down(uint8_t position) {
+    uint8_t card = deadline_heap[position];
+    for (;;) {
+        uint8_t child = 2 * position + 1;
+        if (child >= deadline_count) break;
+        if (child + 1 < deadline_count && is_earlier(deadline_heap[child + 1], deadline_heap[child])) child++;
+        if (!is_earlier(deadline_heap[child], card)) break;
+        heap_place(position, deadline_heap[child]);
+        position = child;
+    }
+    heap_place(position, card);
+}
+void deadline_insert(uint8_t card) { // the card is checked out until its deadline
+    heap_place(deadline_count++, card);
+    heap_sift_up(deadline_count - 1);
+}
+void deadline_add(uint8_t card) { // the card was just checked out
+    cards[card].deadline = checkout_clock() + cards[card].max_time;
+    deadline_insert(card);
+}
+void deadline_remove(uint8_t card) { // the card is no longer checked out
+    uint8_t position = heap_index[card];
+    uint8_t last = deadline_heap[--deadline_count];
+    if (position == deadline_count) return;
+    heap_place(position, last);
+    heap_sift_up(position);
+    heap_sift_down(heap_index[last]);
+}
+uint16_t card_time_left(uint8_t card) {
+    switch (cards[card].status) {
+        case CHECKED_OUT: {
+            int16_t left = cards[card].deadline - checkout_clock();
+            return (left > 0)? left : 0;
         }
+        case ALARMED:
+            return 0;
+        default:
+            return cards[card].max_time;
     }
 }
 
@@ -363,9 +1721,151 @@ ISR(TIMER0_COMPA_vect) {
     PORTB  ^= (1 << PB5);
 }
 
+/************************************************************************/
+/* Card snapshot                                                        */
+/* The state of every card is kept in EEPROM, so a reset neither loses  */
+/* who has what checked out nor restarts the countdowns: card_save      */
+/* marks a card's record for the EEPROM writer whenever its status,     */
+/* deadline or time changes, and card_restore reads them all back at    */
+/* boot. Records never saved (erased EEPROM) leave the defaults of      */
+/* cards[] alone.                                                       */
+/* The deadlines are on the checkout clock, which would start over at   */
+/* boot, so the clock is saved too, every CLOCK_SAVE_S while any card   */
+/* is checked out (and when one is), in a ring of slots that wears the  */
+/* cells CLOCK_SLOTS times slower. On boot the clock resumes            */
+/* CLOCK_SAVE_S after the newest save, so a reset may cost the checked  */
+/* out cards up to that much time but never gives them any. The time    */
+/* the system was off isn't counted: there is no clock running then.    */
+/* The writer takes the journal first, then the clock, then the cards,  */
+/* so a deadline never reaches the EEPROM before its clock.             */
+/************************************************************************/
+#define CLOCK_SLOTS             16      // power of 2
+#define CLOCK_SAVE_S            60
+#define CARD_STATUS_SHIFT       12      // the status is kept in the top bits of the max time (at most 59:59)
+
+typedef struct __attribute__((packed)) { // no padding on the host either (the simulator)
+    uint8_t id[CREADER_ID_SIZE];
+    uint16_t max_time;                  // and the status (card_status_t) above CARD_STATUS_SHIFT
+    uint16_t deadline;
+    uint8_t crc;                        // CRC-8 of the record
+} card_record_t;
+
+typedef struct {
+    uint16_t clock;                     // checkout_clock() when saved
+    uint8_t sequence;                   // counts up by 1 from one save to the next
+    uint8_t crc;
+} clock_record_t;
+
+card_record_t EEMEM card_eeprom[CARD_COUNT];
+clock_record_t EEMEM clock_eeprom[CLOCK_SLOTS];
+
+_Static_assert(sizeof(journal_eeprom) + sizeof(card_eeprom) + sizeof(clock_eeprom) <= 2048,
+               "the journal and the snapshot must fit the EEPROM");
+
+struct {
+    uint8_t slot;                       // slot of the newest save
+    uint8_t sequence;                   // its sequence number
+    uint16_t saved;                     // the clock it holds
+    bool dirty;                         // the newest save isn't written yet
+} clock_ring;
+
+uint8_t card_dirty[CARD_COUNT / 8];     // a bit for each card whose record isn't written yet
+uint8_t card_dirty_count;
+
+uint8_t snapshot_crc(const void * record, uint8_t size) {
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < size; i++) {
+        crc = creader_crc8(crc, ((const uint8_t *) record)[i]);
+    }
+    return crc;
+}
+void clock_save(void) { // keeps the saved clock less than CLOCK_SAVE_S behind
+    uint16_t clock = checkout_clock();
+    if ((uint16_t)(clock - clock_ring.saved) < CLOCK_SAVE_S) return;
+    if (!clock_ring.dirty) { // else the save not written yet takes the newer clock
+        clock_ring.slot = (clock_ring.slot + 1) & (CLOCK_SLOTS - 1);
+        clock_ring.sequence++;
+        clock_ring.dirty = true;
+    }
+    clock_ring.saved = clock;
+}
+void card_save(uint8_t card) {
+    if (cards[card].status == CHECKED_OUT) clock_save(); // the deadline means nothing without the clock
+    uint8_t bit = 1 << (card & 7);
+    if (card_dirty[card >> 3] & bit) return;
+    card_dirty[card >> 3] |= bit;
+    card_dirty_count++;
+}
+bool card_write_next(void) { // gives the EEPROM writer the clock or the next card, false if none
+    if (clock_ring.dirty) {
+        clock_record_t record = {.clock = clock_ring.saved, .sequence = clock_ring.sequence};
+        record.crc = snapshot_crc(&record, offsetof(clock_record_t, crc));
+        eeprom_write(&record, &clock_eeprom[clock_ring.slot], sizeof(clock_record_t));
+        clock_ring.dirty = false;
+        return true;
+    }
+    if (card_dirty_count == 0) return false;
+    uint8_t card = 0;
+    while (!(card_dirty[card >> 3] & (1 << (card & 7)))) card++;
+    card_dirty[card >> 3] &= ~(1 << (card & 7));
+    card_dirty_count--;
+    card_record_t record = {.max_time = cards[card].max_time | (cards[card].status << CARD_STATUS_SHIFT),
+                            .deadline = cards[card].deadline};
+    memcpy(record.id, cards[card].id, CREADER_ID_SIZE);
+    record.crc = snapshot_crc(&record, offsetof(card_record_t, crc));
+    eeprom_write(&record, &card_eeprom[card], sizeof(card_record_t));
+    return true;
+}
+void clock_restore(void) {
+    clock_record_t record;
+    bool found = false;
+    for (uint8_t slot = 0; slot < CLOCK_SLOTS; slot++) {
+        eeprom_read_block(&record, &clock_eeprom[slot], sizeof(clock_record_t));
+        if (record.crc != snapshot_crc(&record, offsetof(clock_record_t, crc))) continue;
+        if (found && (int8_t)(record.sequence - clock_ring.sequence) < 0) continue; // older
+        found = true;
+        clock_ring.slot = slot;
+        clock_ring.sequence = record.sequence;
+        clock_ring.saved = record.clock;
+    }
+    if (found) {
+        checkout_seconds = clock_ring.saved + CLOCK_SAVE_S; // the timer isn't running yet
+    } else {
+        clock_ring.saved = -CLOCK_SAVE_S; // the first checkout saves it
+    }
+}
+void card_restore(void) { // replaces card_registry_init at boot
+    card_record_t record;
+    for (uint16_t i = 0; i < CARD_COUNT; i++) {
+        eeprom_read_block(&record, &card_eeprom[i], sizeof(card_record_t));
+        uint8_t status = record.max_time >> CARD_STATUS_SHIFT;
+        if (status > ALARMED) continue; // never saved: erased EEPROM reads 0xFF
+        if (record.crc != snapshot_crc(&record, offsetof(card_record_t, crc))) continue;
+        memcpy(cards[i].id, record.id, CREADER_ID_SIZE);
+        cards[i].max_time = record.max_time & ((1 << CARD_STATUS_SHIFT) - 1);
+        cards[i].deadline = record.deadline;
+        cards[i].status = status;
+    }
+    clock_restore();
+    card_registry_init();
+    for (uint16_t i = 0; i < CARD_COUNT; i++) {
+        if (cards[i].status == CHECKED_OUT) deadline_insert(i); // check_alarm catches the ones already due
+        if (cards[i].status == ALARMED) enable_buzzer();
+    }
+}
+
+void eeprom_task(void) { // the writer is done with the last job: the next one
+    if (!journal_write_next()) card_write_next();
+}
+bool eeprom_ready(void) {
+    return eeprom_idle() && (journal_write_due() || clock_ring.dirty || card_dirty_count != 0);
+}
+
 /************************************************************************/
 /* Helper Functions                                                     */
 /************************************************************************/
+#define MESSAGE_MS  2000    // how long check in/out and alarm messages stay on screen
+
 char * format_time(uint16_t time) {
     static char time_str[6]= {'0', '0', ':', '0', '0', 0};
     uint8_t minutes = time / 60;
@@ -376,271 +1876,488 @@ char * format_time(uint16_t time) {
     time_str[4] = (seconds % 10) + '0';
     return time_str;
 }
-bool set_card_timeout(int index) {
-    LCD_command(clear);
-    LCD_command(cursorOn);
-    LCD_string("Time for card ");
-    LCD_uint(index + 1);
-    LCD_char(':');
-    LCD_command(setCursor | lineTwo);
-    LCD_string(format_time(cards[index].max_time));
-    LCD_string(" (MM/SS)");
-    LCD_command(setCursor | lineTwo);
-    int8_t cursor_index = 0;
-    uint8_t min = cards[index].max_time / 60;
-    uint8_t sec = cards[index].max_time % 60;
-    uint8_t time[5] = {min/10, min%10, 0, sec/10, sec%10}; // time[2] is a placeholder (corresponds to ':')
-    bool setup_completed = false;
-    for(;;) {
-        button_t button = probe_buttons();
-        if (button == LEFT) {
-            if (cursor_index <= 0) { // abort setup
-                setup_completed = false;
-                break;
-            }
-            do {
-                LCD_command(moveLeft);
-                cursor_index--;
-            } while(cursor_index == 2); // don't let cursor stand on ':'
-        } else if (button == RIGHT) {
-            if (cursor_index >= 4) { // setup is finished
-                setup_completed = true;
-                break;
-            }
-            do {
-                LCD_command(moveRight);
-                cursor_index++;
-            } while(cursor_index == 2); // don't let cursor stand on ':'
-        } else if (button == UP || button == DOWN) {
-            int digit = time[cursor_index];
-            int inc = (button == UP) ? 1 : -1;
-            if (cursor_index == 0 || cursor_index == 3) {
-                time[cursor_index] = (digit + inc < 0)? 5 : (digit + inc) % 6; // digit 0~5
-            } else if (cursor_index == 1 || cursor_index == 4) {
-                time[cursor_index] = (digit + inc < 0)? 9 : (digit + inc) % 10; // digit 0~9
-            }
-            LCD_char(time[cursor_index] + '0');
-            LCD_command(moveLeft); // stay on the same digit
-        } else if (button == OK) { // setup is finished
-            setup_completed = true;
-            break;
-        }
+// state of the UI, see the UI screen functions below
+typedef enum {CLOCKS_SCREEN, CONFIRM_SETUP_SCREEN, TAGS_SCREEN, SETUP_SCREEN, CARD_ID_SCREEN, CARD_TIME_SCREEN,
+              INVALID_SCREEN} screen_t;
+
+struct {
+    screen_t screen;
+    bool enter;                     // the screen was just switched to and has to draw itself
+    bool message;                   // a message covers the screen until message_until
+    uint32_t message_until;
+    int16_t index;                  // setup: the card being configured
+    uint8_t scanned_id[CREADER_ID_SIZE];    // card ID screen: the last tag scanned
+    bool new_scanned_card;          // card ID screen: scanned_id can be given to the card
+    int8_t cursor_index;            // card time screen: the digit under the cursor
+    uint16_t clock;                 // clocks screen: the checkout clock it was last drawn at
+    uint8_t time[5];                // card time screen: MM:SS, time[2] is a placeholder (corresponds to ':')
+} ui = {.enter = true};
+
+inline bool is_setup(screen_t screen) { // the checkout clocks and alarms are stopped on these screens
+    return screen == SETUP_SCREEN || screen == CARD_ID_SCREEN || screen == CARD_TIME_SCREEN;
+}
+void ui_message(uint16_t ms) { // keep what was just drawn on screen for a while
+    ui.message = true;
+    ui.message_until = millis() + ms;
+}
+
+void store_card_timeout(void) {
+    uint8_t * time = ui.time;
+    cards[ui.index].max_time = 60 * (10 * time[0] + time[1]) + 10 * time[3] + time[4];
+    if (cards[ui.index].status == CHECKED_OUT) { // start the new time from now
+        deadline_remove(ui.index);
+        deadline_add(ui.index);
     }
-    cards[index].max_time = cards[index].time_left = 60 * (10 * time[0] + time[1]) + 10 * time[3] + time[4];
+    card_save(ui.index);
     LCD_command(cursorOff);
-    return setup_completed;
 }
-bool set_card_id(int index) {
-    LCD_command(clear);
-    LCD_string("Scan card ");
-    LCD_char(index + '1');
-    LCD_string(":");
-    LCD_command(setCursor | lineTwo);
-    LCD_string(get_card_id(index));
-    bool setup_complete = false, new_scanned_card = false;
-    for(;;) {
-        button_t pressed = probe_buttons();
-        if (isready_creader_buff()) { // if something is available, show it to the screen
-            LCD_command(setCursor | lineTwo);
-            LCD_string(get_card_id(CREADER_INDEX));
-            new_scanned_card = true;
-            release_creader_buff();
-        } else if (pressed == OK || pressed == RIGHT) {
-            setup_complete = true;
-            if (new_scanned_card) {
-                LCD_command(clear);
-                LCD_string("Updating...");
-                strcpy(get_card_id(index), get_card_id(CREADER_INDEX));
-                upload_to_server(get_card_id(index), 'r');
-            }                
-            break;
-        } else if (pressed == LEFT) {
-            setup_complete = false;
-            break;
+screen_t card_time_screen(button_t button) {
+    if (ui.enter) {
+        LCD_command(clear);
+        LCD_command(cursorOn);
+        LCD_string_P(PSTR("Card "));
+        LCD_uint(ui.index + 1);
+        LCD_string_P(PSTR(" time:"));
+        LCD_command(setCursor | lineTwo);
+        LCD_string(format_time(cards[ui.index].max_time));
+        LCD_string_P(PSTR(" (MM/SS)"));
+        LCD_command(setCursor | lineTwo);
+        ui.cursor_index = 0;
+        uint8_t min = cards[ui.index].max_time / 60;
+        uint8_t sec = cards[ui.index].max_time % 60;
+        uint8_t time[5] = {min/10, min%10, 0, sec/10, sec%10};
+        memcpy(ui.time, time, sizeof(time));
+    }
+    if (button == LEFT) {
+        if (ui.cursor_index <= 0) { // abort setup
+            store_card_timeout();
+            return CARD_ID_SCREEN;
         }
+        do {
+            LCD_command(moveLeft);
+            ui.cursor_index--;
+        } while(ui.cursor_index == 2); // don't let cursor stand on ':'
+    } else if (button == RIGHT) {
+        if (ui.cursor_index >= 4) { // setup is finished
+            store_card_timeout();
+            ui.index = (ui.index + 1) % CARD_COUNT; // offer the next card
+            return SETUP_SCREEN;
+        }
+        do {
+            LCD_command(moveRight);
+            ui.cursor_index++;
+        } while(ui.cursor_index == 2); // don't let cursor stand on ':'
+    } else if (button == UP || button == DOWN) {
+        int digit = ui.time[ui.cursor_index];
+        int inc = (button == UP) ? 1 : -1;
+        if (ui.cursor_index == 0 || ui.cursor_index == 3) {
+            ui.time[ui.cursor_index] = (digit + inc < 0)? 5 : (digit + inc) % 6; // digit 0~5
+        } else if (ui.cursor_index == 1 || ui.cursor_index == 4) {
+            ui.time[ui.cursor_index] = (digit + inc < 0)? 9 : (digit + inc) % 10; // digit 0~9
+        }
+        LCD_char(ui.time[ui.cursor_index] + '0');
+        LCD_command(moveLeft); // stay on the same digit
+    } else if (button == OK) { // setup is finished
+        store_card_timeout();
+        ui.index = (ui.index + 1) % CARD_COUNT;
+        return SETUP_SCREEN;
     }
-    return setup_complete;
+    return CARD_TIME_SCREEN;
+}
+screen_t card_id_screen(button_t pressed) {
+    if (ui.enter) {
+        LCD_command(clear);
+        LCD_string_P(PSTR("Scan card "));
+        LCD_uint(ui.index + 1);
+        LCD_string_P(PSTR(":"));
+        LCD_command(setCursor | lineTwo);
+        if (cards[ui.index].status != UNREGISTERED) LCD_string(get_card_id(ui.index));
+        ui.new_scanned_card = false;
+    }
+    if (isready_creader_buff()) { // if something is available, show it to the screen
+        memcpy(ui.scanned_id, get_scanned_id(), CREADER_ID_SIZE);
+        release_creader_buff();
+        LCD_command(setCursor | lineTwo);
+        int16_t owner = find_card(ui.scanned_id);
+        ui.new_scanned_card = (owner < 0 || owner == ui.index);
+        if (ui.new_scanned_card) {
+            LCD_string(format_id(ui.scanned_id));
+            LCD_string_P(PSTR("      "));
+        } else { // IDs must be unique
+            LCD_string_P(PSTR("Used by card "));
+            LCD_uint(owner + 1);
+        }
+    }
+    if (pressed == OK || pressed == RIGHT) {
+        if (ui.new_scanned_card) {
+            register_card(ui.index, ui.scanned_id);
+            card_save(ui.index);
+            upload_to_server(cards[ui.index].id, 'r');
+        }
+        return CARD_TIME_SCREEN;
+    } else if (pressed == LEFT) {
+        return SETUP_SCREEN;
+    }
+    return CARD_ID_SCREEN;
 }
 void probe_card_reader(void) {
     if (!isready_creader_buff()) return; // no card is near the RFID scanner
     LCD_command(clear);
-    int card_index = find_card();
+    int16_t card_index = find_card(get_scanned_id());
+    release_creader_buff();
     if (card_index < 0) { // card not found
-        LCD_string("This card is");
+        LCD_string_P(PSTR("This card is"));
         LCD_command(setCursor | lineTwo);
-        LCD_string("not registered.");
-        _delay_ms(500);
-        LCD_command(clear);
-        release_creader_buff();
+        LCD_string_P(PSTR("not registered."));
+        ui_message(500);
         return;
     }
     ASSERT(card_index < CARD_COUNT);
-    LCD_string("Card ");
-    LCD_char(card_index + '1');
-    release_creader_buff();
     card_status_t current_status = cards[card_index].status;
     char status_to_upload = '?';
     switch(current_status) {
         case ALARMED:
             disable_buzzer(); // disable buzzer and fall through
         case CHECKED_OUT: 
+            if (current_status == CHECKED_OUT) deadline_remove(card_index);
             cards[card_index].status = CHECKED_IN;
-            cards[card_index].armed = true;
-            cards[card_index].time_left = cards[card_index].max_time;
-            LCD_string(" check in");
+            LCD_string_P(PSTR("Check in: "));
             status_to_upload = 'i';
             break;
         case CHECKED_IN:
             cards[card_index].status = CHECKED_OUT;
-            LCD_string(" check out");
+            deadline_add(card_index);
+            LCD_string_P(PSTR("Check out: "));
             status_to_upload = 'o';
             break;
+        case UNREGISTERED: // not in the registry
+            break;
     }
     ASSERT(status_to_upload != '?'); // make sure one of the cases was actually executed.
+    LCD_uint(card_index + 1);
     LCD_command(setCursor | lineTwo);
-    LCD_string("ID: ");
+    LCD_string_P(PSTR("ID: "));
     LCD_string(get_card_id(card_index));
-    upload_to_server(get_card_id(card_index), status_to_upload);
-    LCD_command(clear);
-    release_creader_buff();
+    LCD_flush(); // a few ms: the message is up before the next scan is taken
+    if (first_scan_ms == 0) first_scan_ms = millis();
+    card_save(card_index);
+    upload_to_server(cards[card_index].id, status_to_upload);
+    ui_message(MESSAGE_MS);
 }
-void check_alarm(void) { //check if the card ran out of time and if we need to trigger the alarm
-    for (int i = 0; i < CARD_COUNT; i++) {
-        if (cards[i].time_left == 0 && cards[i].armed) {
-            enable_buzzer();
-            LCD_command(clear);
-            LCD_string("Card ");
-            LCD_char(i + '1');
-            LCD_string(" ran out");
-            LCD_command(setCursor | lineTwo);
-            LCD_string("of time!!!");
-            cards[i].status = ALARMED;
-            upload_to_server(get_card_id(i), 'a');
-            cards[i].armed = false;
-            LCD_command(clear);
-        }
+bool card_reader_ready(void) { // on setup screens the scans belong to the card ID screen
+    return isready_creader_buff() && !is_setup(ui.screen) && journal_room(); // else the scan waits in the ring
+}
+uint16_t alarm_clock; // the checkout clock check_alarm last looked at
+
+bool alarm_ready(void) { // the checkout clock ticked, or an alarm waits for room in the journal
+    if (!journal_room()) return false;
+    return checkout_clock() != alarm_clock
+           || (!is_setup(ui.screen) && deadline_count > 0
+               && (int16_t)(cards[deadline_heap[0]].deadline - alarm_clock) <= 0);
+}
+void check_alarm(void) { //check if a card ran out of time and if we need to trigger the alarm
+    uint16_t now = checkout_clock();
+    alarm_clock = now;
+    if (is_setup(ui.screen)) return;
+    while (deadline_count > 0 && (int16_t)(cards[deadline_heap[0]].deadline - now) <= 0 && journal_room()) {
+        uint8_t i = deadline_heap[0];
+        deadline_remove(i); // alarms only once per checkout
+        enable_buzzer();
+        LCD_command(clear);
+        LCD_string_P(PSTR("Card "));
+        LCD_uint(i + 1);
+        LCD_string_P(PSTR(" ran out"));
+        LCD_command(setCursor | lineTwo);
+        LCD_string_P(PSTR("of time!!!"));
+        cards[i].status = ALARMED;
+        card_save(i);
+        upload_to_server(cards[i].id, 'a');
+        ui_message(MESSAGE_MS);
     }
+    if (deadline_count > 0) clock_save();
 }
+
 /************************************************************************/
 /* UI screen functions                                                  */
-/* Each UI screen function returns the next screen to transition to.    */
+/* The UI is a state machine run by the UI task: each call handles one  */
+/* button event (or none) and returns the screen to show next, which is */
+/* the same screen unless the user moved on. A screen draws its static  */
+/* parts when ui.enter is set, i.e. on its first call.                  */
 /* clocks screen     - show the remaining time of each tag              */
 /* confirm setup     - if user pressed OK, goes to setup screen         */
 /* tags ID screen    - show the ID of each tag                          */
-/* setup screen      - configure the system with time & tag ID          */
+/* setup screen      - pick the card to configure                       */
+/* card ID screen    - scan the tag of that card                        */
+/* card time screen  - set the checkout time of that card               */
 /************************************************************************/
-typedef enum {CLOCKS_SCREEN, CONFIRM_SETUP_SCREEN, TAGS_SCREEN, SETUP_SCREEN, INVALID_SCREEN} screen_t;
-
-screen_t setup_screen(void) {
-    disable_T1SEC(); // stop timer while we are at the setup
-    disable_buzzer(); // if currently buzzing, don't buzz while we are configuring the system
-    LCD_command(clear);
-    int counter = 0;
-    for (;;) {
-        if (counter == 2 * CARD_COUNT) break; // (# of config stages) * (# of cards) -> done with config
-        bool success = ((counter & 1) == 0)? set_card_id(counter >> 1) : set_card_timeout(counter >> 1);
-        counter = (success)? counter + 1 : counter - 1;
-        if (counter < 0) break; // exit the setup screen
+screen_t setup_screen(button_t pressed) { // pick the card to set up with UP/DOWN
+    if (ui.enter) {
+        LCD_command(clear);
+        LCD_string_P(PSTR("Set up card:"));
+        LCD_command(setCursor | lineTwo);
+        LCD_string_P(PSTR("UP/DOWN, then OK"));
+    }
+    if (pressed == LEFT) {
+        return CLOCKS_SCREEN; // exit the setup screen
+    } else if (pressed == OK || pressed == RIGHT) {
+        return CARD_ID_SCREEN;
+    } else if (pressed == UP) {
+        ui.index = (ui.index + 1) % CARD_COUNT;
+    } else if (pressed == DOWN) {
+        ui.index = (ui.index + CARD_COUNT - 1) % CARD_COUNT;
     }
-    enable_T1SEC(); // let the time start ticking...
-    return CLOCKS_SCREEN; // go back to the clock screen
+    LCD_command(setCursor | 13);
+    LCD_uint(ui.index + 1);
+    LCD_string_P(PSTR("  ")); // erase the digits of a longer number
+    return SETUP_SCREEN;
 }
-screen_t clocks_screen(void) {
-    LCD_command(clear);
-    for(;;) {
-        check_alarm();
-        probe_card_reader();
-        button_t pressed = probe_buttons();
-        if (pressed == LEFT) {
-            return TAGS_SCREEN;
-        } else if (pressed == RIGHT) {
-            return CONFIRM_SETUP_SCREEN;
+/************************************************************************/
+/* The clocks and tags ID screens show 2 registered cards at a time,    */
+/* UP/DOWN pages through the rest.                                      */
+/************************************************************************/
+int16_t shown_card; // the card on the first line
+
+void LCD_card_line(int16_t card, bool show_id) { // "12: 04:59 OUT" or "12: 310037D93D", padded to the whole line
+    static const char status_str[][7] PROGMEM = {[UNREGISTERED] = "", [CHECKED_OUT] = " OUT", [CHECKED_IN] = " IN",
+                                                 [ALARMED] = " ALARM"};
+    uint8_t length = 0;
+    if (card >= 0) {
+        uint8_t number = card + 1;
+        LCD_uint(number);
+        LCD_string_P(PSTR(": "));
+        char * text = (show_id)? get_card_id(card) : format_time(card_time_left(card));
+        LCD_string(text);
+        length = ((number < 10)? 1 : (number < 100)? 2 : 3) + 2 + strlen(text);
+        if (!show_id) {
+            LCD_string_P(status_str[cards[card].status]);
+            length += strlen_P(status_str[cards[card].status]);
         }
+    }
+    while (length++ < 16) LCD_char(' ');
+}
+void LCD_card_page(button_t pressed, bool show_id) {
+    if (cards[shown_card].status == UNREGISTERED) shown_card = next_card(shown_card, 1);
+    if (shown_card < 0) { // nothing registered
+        shown_card = 0;
         LCD_command(home);
-        for (int i = 0; i < 2; i++) {
-            LCD_char(i + '1');
-            LCD_string(": ");
-            LCD_string(format_time(cards[i].time_left));
-            switch(cards[i].status) {
-                case CHECKED_IN: LCD_string(" IN"); break;
-                case CHECKED_OUT: LCD_string(" OUT"); break;
-                case ALARMED: LCD_string(" ALARMED"); break;
-            }
-            LCD_command(setCursor | lineTwo);
+        LCD_string_P(PSTR("No cards        "));
+        return;
+    }
+    if (pressed == UP || pressed == DOWN) {
+        for (uint8_t i = 0; i < 2; i++) {
+            shown_card = next_card(shown_card, (pressed == DOWN)? 1 : -1);
         }
     }
+    int16_t second = next_card(shown_card, 1);
+    LCD_command(home);
+    LCD_card_line(shown_card, show_id);
+    LCD_command(setCursor | lineTwo);
+    LCD_card_line((second != shown_card)? second : -1, show_id);
 }
-screen_t tagsID_screen(void) {
-    LCD_command(clear);
-    for(;;) {
-        check_alarm();
-        probe_card_reader();
-        button_t pressed = probe_buttons();
-        if (pressed == LEFT) {
-            return CONFIRM_SETUP_SCREEN;
-        } else if (pressed == RIGHT) {
-            return CLOCKS_SCREEN;
-        }
-        LCD_command(home);
-        LCD_string("1: ");
-        LCD_string(get_card_id(0));
-        LCD_command(setCursor | lineTwo);
-        LCD_string("2: ");
-        LCD_string(get_card_id(1));
+screen_t clocks_screen(button_t pressed) {
+    if (ui.enter) LCD_command(clear);
+    if (pressed == LEFT) {
+        return TAGS_SCREEN;
+    } else if (pressed == RIGHT) {
+        return CONFIRM_SETUP_SCREEN;
     }
+    LCD_card_page(pressed, false);
+    return CLOCKS_SCREEN;
 }
-screen_t confirm_setup_screen(void) {
-    LCD_command(clear);
-    for(;;) {
-        check_alarm();
-        probe_card_reader();
-        button_t pressed = probe_buttons();
-        if (pressed == LEFT) {
-            return CLOCKS_SCREEN;
-        } else if (pressed == RIGHT) {
-            return TAGS_SCREEN;
-        } else if (pressed == OK) {
-            return SETUP_SCREEN;
-        }
-        LCD_command(home);
-        LCD_string("Press OK to");
+screen_t tagsID_screen(button_t pressed) {
+    if (ui.enter) LCD_command(clear);
+    if (pressed == LEFT) {
+        return CONFIRM_SETUP_SCREEN;
+    } else if (pressed == RIGHT) {
+        return CLOCKS_SCREEN;
+    }
+    LCD_card_page(pressed, true);
+    return TAGS_SCREEN;
+}
+screen_t confirm_setup_screen(button_t pressed) {
+    if (ui.enter) {
+        LCD_command(clear);
+        LCD_string_P(PSTR("Press OK to"));
         LCD_command(setCursor | lineTwo);
-        LCD_string("configure system");
+        LCD_string_P(PSTR("configure system"));
+    }
+    if (pressed == LEFT) {
+        return CLOCKS_SCREEN;
+    } else if (pressed == RIGHT) {
+        return TAGS_SCREEN;
+    } else if (pressed == OK) {
+        return SETUP_SCREEN;
+    }
+    return CONFIRM_SETUP_SCREEN;
+}
+
+/************************************************************************/
+/* Tasks                                                                */
+/* Each one does a bounded amount of work and returns; none of them     */
+/* waits on anything. The card reader and alarm messages take over the  */
+/* screen for a while, the UI leaves it alone until then.               */
+/************************************************************************/
+void ui_task(void) {
+    if (ui.message) {
+        if ((int32_t)(millis() - ui.message_until) < 0) return; // button presses wait in the queue
+        ui.message = false;
+        ui.enter = true; // redraw what the message covered
+    }
+    ui.clock = checkout_clock();
+    button_t pressed = probe_buttons();
+    screen_t next_screen;
+    switch(ui.screen) {
+        case CLOCKS_SCREEN:
+            next_screen = clocks_screen(pressed);
+            break;
+        case CONFIRM_SETUP_SCREEN:
+            next_screen = confirm_setup_screen(pressed);
+            break;
+        case TAGS_SCREEN:
+            next_screen = tagsID_screen(pressed);
+            break;
+        case SETUP_SCREEN:
+            next_screen = setup_screen(pressed);
+            break;
+        case CARD_ID_SCREEN:
+            next_screen = card_id_screen(pressed);
+            break;
+        case CARD_TIME_SCREEN:
+            next_screen = card_time_screen(pressed);
+            break;
+        default:
+            next_screen = INVALID_SCREEN;
+    }
+    ASSERT(next_screen != INVALID_SCREEN);
+    ui.enter = (next_screen != ui.screen);
+    if (!is_setup(ui.screen) && is_setup(next_screen)) {
+        disable_T1SEC(); // stop timer while we are at the setup
+        disable_buzzer(); // if currently buzzing, don't buzz while we are configuring the system
+        ui.index = 0;
+    } else if (is_setup(ui.screen) && !is_setup(next_screen)) {
+        enable_T1SEC(); // let the time start ticking...
     }
+    ui.screen = next_screen;
+}
+bool ui_ready(void) {
+    if (ui.message) return (int32_t)(millis() - ui.message_until) >= 0;
+    if (ui.screen == CARD_ID_SCREEN && !journal_room()) return false; // registering a card journals it
+    return ui.enter || buttons.head != buttons.tail || (ui.screen == CARD_ID_SCREEN && isready_creader_buff())
+        || (ui.screen == CLOCKS_SCREEN && checkout_clock() != ui.clock);
+}
+void display_task(void) {
+    LCD_flush_task();
 }
+bool display_ready(void) {
+    return LCD.stale;
+}
+
+/************************************************************************/
+/* Task Scheduler                                                       */
+/* A cooperative, run-to-completion scheduler. A task is runnable when  */
+/* its event trigger (ready) says so or its period has elapsed. After   */
+/* every task run the table is scanned again from the top, so a task    */
+/* waits at most for the longest run of one other task: the tasks are   */
+/* in priority order, most urgent first. The run time of every task is  */
+/* measured, task_stats gives the longest and the average run.          */
+/* Most tasks are only triggered by events, which the interrupts bring: */
+/* a scan (USART0), an ESP8266 response (USART1), a button (pin         */
+/* change), a second of the checkout clock (Timer1) or a record written */
+/* to the EEPROM (EE_READY). When no task is runnable the CPU sleeps in */
+/* idle mode until the next interrupt; the millisecond tick wakes it at */
+/* least every millisecond, so a periodic task is at most that late.    */
+/************************************************************************/
+#define NETWORK_PERIOD_MS   10      // timeouts, and the request bodies as the TX ring drains
+
+typedef struct {
+    void (*run)(void);
+    bool (*ready)(void);            // event trigger, NULL: none
+    uint16_t period;                // ms between periodic runs, 0: none
+    uint32_t next_run;              // when the next periodic run is due
+    uint32_t max_us;                // longest run
+    uint16_t runs;                  // # of runs in total_us
+    uint32_t total_us;              // total run time
+} task_t;
+
+enum {CARD_READER_TASK, ALARM_TASK, UI_TASK, NETWORK_TASK, DISPLAY_TASK, EEPROM_TASK, TASK_COUNT};
+task_t tasks[TASK_COUNT] = {        // indexed by the enum above
+    {.run = probe_card_reader, .ready = card_reader_ready},
+    {.run = check_alarm, .ready = alarm_ready},
+    {.run = ui_task, .ready = ui_ready},
+    {.run = ESP8266_task, .ready = network_ready, .period = NETWORK_PERIOD_MS},
+    {.run = display_task, .ready = display_ready},
+    {.run = eeprom_task, .ready = eeprom_ready},
+};
+
+inline bool task_runnable(task_t * task, uint32_t now) {
+    if (task->ready != NULL && task->ready()) return true;
+    return task->period != 0 && (int32_t)(now - task->next_run) >= 0;
+}
+task_t * scheduler_next(uint32_t now) { // the most urgent runnable task, NULL if none
+    for (uint8_t i = 0; i < TASK_COUNT; i++) {
+        if (task_runnable(&tasks[i], now)) return &tasks[i];
+    }
+    return NULL;
+}
+bool scheduler_run(void) { // run the most urgent runnable task, false if there is none
+    uint32_t now = millis();
+    task_t * task = scheduler_next(now);
+    if (task == NULL) return false;
+    if (task->period != 0) {
+        task->next_run += task->period;
+        if ((int32_t)(now - task->next_run) >= 0) task->next_run = now + task->period; // don't catch up
+    }
+    uint32_t start = micros();
+    task->run();
+    uint32_t elapsed = micros() - start;
+    if (elapsed > task->max_us) task->max_us = elapsed;
+    if (task->runs == 0xFFFF || task->total_us > 0xFFFFFFFF - elapsed) { // keep the average of the recent runs
+        task->runs >>= 1;
+        task->total_us >>= 1;
+    }
+    task->runs++;
+    task->total_us += elapsed;
+    perf_record(&stats.task_us, (elapsed > 0xFFFF) ? 0xFFFF : elapsed); // its top bucket is 4 ms and more
+    return true;
+}
+void scheduler_idle(void) { // sleep until an interrupt brings work
+    cli();
+    if (scheduler_next(millis()) == NULL) { // checked with interrupts off, so no event slips in before the sleep
+        sleep_enable();
+        sei(); // the instruction after sei runs before any interrupt: SLEEP
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
+}
+void task_stats(uint8_t task, uint32_t * max_us, uint32_t * average_us) {
+    *max_us = tasks[task].max_us;
+    *average_us = (tasks[task].runs != 0)? tasks[task].total_us / tasks[task].runs : 0;
+}
+
 int main(void) {
     sei();
     LCD_init();
+    LCD_framebuffer_init();
     T1SEC_init();
+    system_tick_init();
+    buttons_init();
     buzzer_init();
     UART_creader_init();
-    UART_ESP8266_init();
+    card_restore();
+    journal_init();
+    upload.sent = journal.tail; // events journaled before the reset go out first
+    stats_reset(0);
+    UART_ESP8266_init(); // only starts the bring-up, cards are scanned meanwhile
+    upload_to_server(NULL, 'b'); // record the restart of the system
     LCD_command(clear);
-    LCD_string(" PharmaTracker 9");
-    _delay_ms(2000);
+    LCD_string_P(PSTR(" PharmaTracker 9"));
+    ui_message(MESSAGE_MS);
     enable_T1SEC();
-    screen_t current_screen = CLOCKS_SCREEN;
+    set_sleep_mode(SLEEP_MODE_IDLE); // the timers and the USARTs keep running
     for(;;) {
-        screen_t next_screen;
-        switch(current_screen) {
-            case CLOCKS_SCREEN:
-                next_screen = clocks_screen();
-                break;
-            case CONFIRM_SETUP_SCREEN:
-                next_screen = confirm_setup_screen();
-                break;
-            case TAGS_SCREEN:
-                next_screen = tagsID_screen();
-                break;
-            case SETUP_SCREEN:
-                next_screen = setup_screen();
-                break;
-            default:
-                next_screen = INVALID_SCREEN;
-        }
-        ASSERT(next_screen != INVALID_SCREEN);
-        current_screen = next_screen;
+        if (!scheduler_run()) scheduler_idle();
     }
     ASSERT(false); // execution shouldn't reach this point
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,300 @@
+/* PharmaTracker EM4100 Manchester decode engine */
+#include "manchester.h"
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define RATE_FIELD(rate, field)     pgm_read_byte(&(rate)->field)   // the rate tables are in flash
+#else
+#define RATE_FIELD(rate, field)     ((rate)->field)
+#endif
+
+enum {MANCHESTER_HUNT, MANCHESTER_SYNCED, MANCHESTER_LOST}; // lost: adaptive mode, hunting with a rate known
+
+static void lose_sync(manchester_t * m) {
+    if (m->state == MANCHESTER_SYNCED) m->sync_losses++;
+    m->state = (m->state != MANCHESTER_HUNT && m->adaptive) ? MANCHESTER_LOST : MANCHESTER_HUNT;
+    for (uint8_t i = 0; i < MANCHESTER_MAX_RATES; i++) {
+        m->streak[i] = 0;
+    }
+}
+
+void manchester_init(manchester_t * m, uint16_t threshold) {
+    m->adaptive = false;
+    m->state = MANCHESTER_HUNT;
+    lose_sync(m);
+    m->sync_losses = m->parity_errors = 0;
+    m->threshold = threshold;
+    m->pending_short = false;
+    m->run_length = 0;
+    m->held_length = m->glitch = 0;
+}
+
+/************************************************************************/
+/* Bit clock recovery (adaptive mode)                                   */
+/* The preamble (a long pulse followed by the 16 short pulses of the 9  */
+/* header 1's) is looked for at every supported data rate at once. The  */
+/* average of its short pulses is the half bit period, and the rate     */
+/* with the closest nominal period is picked. From then on a software   */
+/* PLL predicts where the next mid-bit edge is due: edges are           */
+/* classified against the recovered clock instead of against the        */
+/* jittery previous edge, and every mid-bit edge pulls the phase 3/4    */
+/* and the period 1/16 of the way towards it. Only shifts and compares, */
+/* no division. When an edge is too far off the clock, the decoder      */
+/* synchronizes again on the next long pulse at the rate it had, as the */
+/* fixed mode does, or on the next preamble of any rate.                */
+/************************************************************************/
+static void set_half_bit(manchester_t * m, int16_t half_bit) {
+    int16_t lowest = RATE_FIELD(m->rate, lowest) << MANCHESTER_FRACTION;
+    int16_t highest = RATE_FIELD(m->rate, highest) << MANCHESTER_FRACTION;
+    if (half_bit < lowest) half_bit = lowest;
+    if (half_bit > highest) half_bit = highest;
+    m->half_bit = half_bit;
+    m->threshold = (half_bit + (half_bit >> 1)) >> MANCHESTER_FRACTION;        // 1.5 half bits
+    m->long_limit = ((half_bit << 1) + (half_bit >> 1)) >> MANCHESTER_FRACTION; // 2.5 half bits
+}
+
+void manchester_init_adaptive(manchester_t * m, const manchester_rate_t * rates, uint8_t rate_count) {
+    manchester_init(m, 0);
+    m->adaptive = true;
+    m->rates = rates;
+    m->rate_count = (rate_count > MANCHESTER_MAX_RATES) ? MANCHESTER_MAX_RATES : rate_count;
+    m->rate = rates;
+    set_half_bit(m, RATE_FIELD(rates, half_bit) << MANCHESTER_FRACTION);
+}
+
+/************************************************************************/
+/* Frame detection                                                      */
+/* Every decoded bit is shifted into a 64-bit window, which is checked  */
+/* for a complete EM4100 frame: 9 header 1's, 10 rows of 4 data bits +  */
+/* even parity bit, 4 even column parity bits and a 0 stop bit. A frame */
+/* is found at whatever bit it starts, and a parity error only rejects  */
+/* the window, not the bit synchronization. A header followed by 55     */
+/* zeros passes every parity check, and is what a fade right after a    */
+/* header decodes to: the all-zero ID is never accepted.                */
+/************************************************************************/
+#define PARITY_OF_5_BITS    0x96696996UL    // bit n is the parity of n
+
+static bool frame_valid(manchester_t * m, uint64_t window, manchester_frame_t * frame) {
+    if ((window >> 55) != 0x1FF || (window & 1) != 0) return false; // header and stop bit
+    if ((window & ((1ULL << 55) - 1)) == 0) return false; // no ID, the signal faded after the header
+    uint8_t columns = (window >> 1) & 0x0F;
+    uint8_t id[MANCHESTER_ID_SIZE] = {0};
+    window >>= 5;
+    for (int8_t row = 9; row >= 0; row--, window >>= 5) { // last row first
+        uint8_t bits = window & 0x1F;
+        if ((PARITY_OF_5_BITS >> bits) & 1) { // assert row parity is even
+            m->parity_errors++;
+            return false;
+        }
+        uint8_t nibble = bits >> 1;
+        columns ^= nibble;
+        id[row >> 1] |= (row & 1) ? nibble : nibble << 4;
+    }
+    if (columns != 0) { // assert the column parities are all even
+        m->parity_errors++;
+        return false;
+    }
+    for (uint8_t i = 0; i < MANCHESTER_ID_SIZE; i++) {
+        frame->id[i] = id[i];
+    }
+    return true;
+}
+
+static bool push_bit(manchester_t * m, uint8_t bit, manchester_frame_t * frame) {
+    m->window = (m->window << 1) | bit;
+    if (m->adaptive) { // 9 1's in a row only happen in the header, re-measure the half bit on them
+        m->ones = bit ? m->ones + 1 : 0;
+        if (m->ones <= 1) m->preamble_sum = 0; // a new streak of 1's starts with a long pulse
+        if (m->ones == 9) set_half_bit(m, m->preamble_sum >> (4 - MANCHESTER_FRACTION)); // average of 16 short runs
+    }
+    return frame_valid(m, m->window, frame);
+}
+
+static void start_sync(manchester_t * m, uint64_t window) {
+    m->state = MANCHESTER_SYNCED;
+    m->window = window;
+    m->pending_short = false;
+    m->phase = 0;
+}
+
+static void hunt_preamble(manchester_t * m, uint8_t level, uint16_t length) {
+    for (uint8_t i = 0; i < m->rate_count; i++) {
+        const manchester_rate_t * rate = &m->rates[i];
+        uint8_t nominal = RATE_FIELD(rate, half_bit);
+        if (length > RATE_FIELD(rate, limit) || length < (nominal >> 1)) { // not a pulse at this rate
+            m->streak[i] = 0;
+        } else if (length > RATE_FIELD(rate, threshold)) { // a long low pulse ending on a 1 may lead the preamble
+            m->streak[i] = (level == 0);
+            m->streak_sum[i] = 0;
+        } else if (m->streak[i] != 0) {
+            m->streak_sum[i] += length;
+            if (++m->streak[i] == 17) break;
+        }
+    }
+    uint8_t found = 0;
+    while (found < m->rate_count && m->streak[found] != 17) found++;
+    if (found == m->rate_count) return;
+    // several rates can claim the same preamble, the measured half bit decides
+    uint16_t half_bit = m->streak_sum[found] >> 4;
+    uint16_t best = 0xFFFF;
+    for (uint8_t i = 0; i < m->rate_count; i++) {
+        uint16_t nominal = RATE_FIELD(&m->rates[i], half_bit);
+        uint16_t distance = (half_bit > nominal) ? half_bit - nominal : nominal - half_bit;
+        if (distance < best) {
+            best = distance;
+            m->rate = &m->rates[i];
+        }
+    }
+    set_half_bit(m, m->streak_sum[found] >> (4 - MANCHESTER_FRACTION));
+    start_sync(m, 0x1FF); // the preamble was the 9 header 1's
+    m->ones = 9;
+}
+
+static bool push_tracked(manchester_t * m, uint8_t level, uint16_t length, manchester_frame_t * frame) {
+    int16_t half_bit = m->half_bit;
+    int16_t elapsed = (length > m->long_limit ? m->long_limit + 1 : length) << MANCHESTER_FRACTION;
+    m->preamble_sum += length;
+    if (m->pending_short) {
+        elapsed += m->elapsed;
+        m->pending_short = false;
+    } else {
+        elapsed += m->phase; // time since the predicted middle of the previous bit
+        if (elapsed <= half_bit + (half_bit >> 1)) { // bit boundary, the mid-bit edge comes next
+            m->elapsed = elapsed;
+            m->pending_short = true;
+            return false;
+        }
+    }
+    int16_t error = elapsed - (half_bit << 1); // how late the mid-bit edge is
+    if (error > half_bit - (half_bit >> 2) || error < (half_bit >> 2) - half_bit) {
+        lose_sync(m); // too far off the recovered clock
+        return false;
+    }
+    m->phase = error >> MANCHESTER_PHASE_SHIFT;
+    set_half_bit(m, half_bit + (error >> MANCHESTER_PERIOD_SHIFT));
+    return push_bit(m, level ^ 1, frame);
+}
+
+/************************************************************************/
+/* Consume a run of "length" samples at "level" that just ended with a  */
+/* transition (in adaptive mode, past the glitch filter). A long run    */
+/* always ends in the middle of a bit period, which is how the decoder  */
+/* synchronizes to the bits. Two short runs make one bit.               */
+/* The decoded bit is the level after the mid-bit transition.           */
+/************************************************************************/
+static bool feed_run(manchester_t * m, uint8_t level, uint16_t length, manchester_frame_t * frame) {
+    bool is_long = length > m->threshold;
+    uint8_t bit = level ^ 1;
+    if (m->state != MANCHESTER_SYNCED && m->adaptive) {
+        bool lost = (m->state == MANCHESTER_LOST);
+        hunt_preamble(m, level, length);
+        if (!lost || m->state == MANCHESTER_SYNCED || !is_long || length > m->long_limit) return false;
+        start_sync(m, 0); // at the rate of the last preamble, without waiting for the next one
+        m->ones = 0;
+        return push_bit(m, bit, frame);
+    }
+    if (m->state == MANCHESTER_HUNT) {
+        if (!is_long) return false; // wait for the first long pulse to synchronize
+        start_sync(m, 0);
+        return push_bit(m, bit, frame);
+    }
+    if (m->adaptive) return push_tracked(m, level, length, frame);
+    if (m->pending_short) {
+        m->pending_short = false;
+        return push_bit(m, bit, frame);
+    }
+    if (!is_long) {
+        m->pending_short = true;
+        return false;
+    }
+    return push_bit(m, bit, frame);
+}
+
+/************************************************************************/
+/* Glitch filter (adaptive mode)                                        */
+/* A noise spike cuts a run in three, and the two extra edges would     */
+/* cost the recovered clock its lock until the next preamble. Each run  */
+/* is held back until the next one shows it wasn't cut: a run shorter   */
+/* than a quarter of the half bit is no pulse at any rate, and the held */
+/* run goes on across it. Frames come out one run later.                */
+/************************************************************************/
+bool manchester_feed_run(manchester_t * m, uint8_t level, uint16_t length, manchester_frame_t * frame) {
+    if (!m->adaptive) return feed_run(m, level, length, frame);
+    if (m->glitch != 0) { // the run cut by the glitch goes on
+        uint32_t held = (uint32_t)m->held_length + m->glitch + length;
+        m->held_length = (held > MANCHESTER_MAX_RUN) ? MANCHESTER_MAX_RUN : held;
+        m->glitch = 0;
+        return false;
+    }
+    if (m->held_length != 0 && length < (m->half_bit >> (MANCHESTER_FRACTION + MANCHESTER_GLITCH_SHIFT))) {
+        m->glitch = length;
+        return false;
+    }
+    bool decoded = m->held_length != 0 && feed_run(m, m->held_level, m->held_length, frame);
+    m->held_level = level;
+    m->held_length = length;
+    return decoded;
+}
+
+bool manchester_feed_sample(manchester_t * m, uint8_t sample, manchester_frame_t * frame) {
+    if (m->run_length != 0 && sample == m->run_level) {
+        if (m->run_length < MANCHESTER_MAX_RUN) m->run_length++;
+        return false;
+    }
+    bool decoded = (m->run_length != 0) && manchester_feed_run(m, m->run_level, m->run_length, frame);
+    m->run_level = sample;
+    m->run_length = 1;
+    return decoded;
+}
+
+/************************************************************************/
+/* Decode a buffer of samples (one 0/1 sample per byte).                */
+/* Stops early once max_frames frames were decoded.                     */
+/* Returns the number of samples consumed.                              */
+/************************************************************************/
+size_t manchester_decode_samples(manchester_t * m, const uint8_t * samples, size_t n,
+                                 manchester_frame_t * frames, size_t max_frames, size_t * frame_count) {
+    size_t i = 0, count = 0;
+    while (i < n && count < max_frames) {
+        if (manchester_feed_sample(m, samples[i++], &frames[count])) count++;
+    }
+    *frame_count = count;
+    return i;
+}
+
+#ifndef __AVR__
+/************************************************************************/
+/* Batch path for recorded traces: samples are packed 64 per word,      */
+/* oldest sample in the least significant bit. Transitions of a whole   */
+/* word are found at once (word XOR itself shifted by one sample), and  */
+/* only the edges are visited, so steady stretches cost nothing.        */
+/* A frame spans well over 64 runs, so a word completes at most one.    */
+/* Returns the number of words consumed.                                */
+/************************************************************************/
+size_t manchester_decode_packed(manchester_t * m, const uint64_t * words, size_t n,
+                                manchester_frame_t * frames, size_t max_frames, size_t * frame_count) {
+    size_t i = 0, count = 0;
+    for (; i < n && count < max_frames; i++) {
+        uint64_t word = words[i];
+        if (m->run_length == 0) m->run_level = word & 1;
+        uint64_t edges = word ^ ((word << 1) | m->run_level);
+        uint32_t length = m->run_length;
+        unsigned start = 0;
+        while (edges) {
+            unsigned edge = __builtin_ctzll(edges);
+            length += edge - start;
+            if (manchester_feed_run(m, m->run_level, length > MANCHESTER_MAX_RUN ? MANCHESTER_MAX_RUN : length,
+                                    &frames[count])) {
+                count++;
+            }
+            m->run_level ^= 1;
+            length = 0;
+            start = edge;
+            edges &= edges - 1;
+        }
+        length += 64 - start;
+        m->run_length = length > MANCHESTER_MAX_RUN ? MANCHESTER_MAX_RUN : length;
+    }
+    *frame_count = count;
+    return i;
+}
+#endif
@@ -0,0 +1,83 @@
+/* PharmaTracker EM4100 Manchester decode engine */
+#ifndef MANCHESTER_H_
+#define MANCHESTER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MANCHESTER_TOLERANCE    4       // runs longer than this many samples are long (full bit) pulses
+#define MANCHESTER_ID_SIZE      5       // 10 hex characters packed into 5 bytes
+#define MANCHESTER_MAX_RUN      0xFFFF  // run lengths saturate instead of wrapping
+#define MANCHESTER_FRACTION     3       // the adaptive half bit estimate is kept in 1/8 samples
+#define MANCHESTER_PHASE_SHIFT  2       // 1/4 of the phase error of a mid-bit edge is left after correction
+#define MANCHESTER_PERIOD_SHIFT 5       // the half bit period moves 1/16 of the way towards each mid-bit edge
+#define MANCHESTER_MAX_RATES    4       // most data rates the adaptive mode can detect
+#define MANCHESTER_GLITCH_SHIFT 2       // adaptive: runs shorter than 1/4 half bit are noise, not pulses
+
+/************************************************************************/
+/* A decoded EM4100 frame: the 10 data nibbles of the tag, high nibble  */
+/* first (id[0] >> 4 is the first character sent by the tag).           */
+/************************************************************************/
+typedef struct {
+    uint8_t id[MANCHESTER_ID_SIZE];
+} manchester_frame_t;
+
+/************************************************************************/
+/* A supported data rate (RF/32, RF/40, RF/64...), in samples. Tables   */
+/* of these are meant to be built at compile time so that detecting the */
+/* rate at runtime costs only comparisons. Sorted by half_bit. On the   */
+/* AVR they are read from flash: declare them PROGMEM.                  */
+/************************************************************************/
+typedef struct {
+    uint8_t half_bit;       // nominal half bit period
+    uint8_t lowest;         // shortest half bit accepted for this rate (-25%)
+    uint8_t highest;        // longest half bit accepted for this rate (+25%)
+    uint8_t threshold;      // nominal short/long boundary (1.5 half bits)
+    uint8_t limit;          // nominal longest pulse (2.5 half bits)
+} manchester_rate_t;
+#define MANCHESTER_RATE(half_bit)   {(half_bit), (half_bit) * 3 / 4, (half_bit) * 5 / 4, (half_bit) * 3 / 2, (half_bit) * 5 / 2}
+
+/************************************************************************/
+/* The decoder is fed one run-length (a number of consecutive samples   */
+/* at the same logic level) at a time, so it can be driven by a polling */
+/* loop, an ISR or a recorded trace alike. It never blocks.             */
+/************************************************************************/
+typedef struct {
+    uint8_t state;          // hunting for bit synchronization, or in sync
+    uint16_t threshold;     // runs of at most this many samples are short (half bit) pulses
+    bool pending_short;     // a short pulse was seen; its partner completes the bit
+    uint64_t window;        // the last 64 decoded bits, newest in bit 0
+    bool adaptive;          // the threshold follows the bit clock of the tag instead of being fixed
+    const manchester_rate_t * rates;    // adaptive: the supported data rates
+    uint8_t rate_count;
+    const manchester_rate_t * rate;     // adaptive: data rate detected on the last preamble
+    uint16_t half_bit;      // adaptive: estimated half bit period, in 1/8 samples
+    uint16_t long_limit;    // adaptive: runs longer than this (2.5 half bits) are not Manchester data
+    int16_t phase;          // adaptive: how late the last mid-bit edge was against the recovered clock
+    int16_t elapsed;        // adaptive: time since the predicted middle of the bit, at the boundary edge
+    uint8_t ones;           // adaptive: # of consecutive 1's decoded
+    uint16_t preamble_sum;  // adaptive: sum of the short runs of the current streak of 1's
+    uint8_t streak[MANCHESTER_MAX_RATES];       // adaptive hunting: per rate, a long pulse + # of short ones since
+    uint16_t streak_sum[MANCHESTER_MAX_RATES];  // adaptive hunting: per rate, sum of those short pulses
+    uint8_t held_level;     // adaptive: level of the last run, fed once the next one shows it wasn't cut
+    uint16_t held_length;   // adaptive: its length (0: none)
+    uint16_t glitch;        // adaptive: a run too short to be a pulse, which the held run goes on across
+    uint8_t run_level;      // sample level of the run currently being measured
+    uint16_t run_length;    // # of samples in the run currently being measured (0: no run yet)
+    uint16_t sync_losses;   // # of times the bit clock was lost after synchronizing
+    uint16_t parity_errors; // # of windows framed by a header and a stop bit that failed a parity check
+} manchester_t;
+
+void manchester_init(manchester_t * m, uint16_t threshold);
+void manchester_init_adaptive(manchester_t * m, const manchester_rate_t * rates, uint8_t rate_count);
+bool manchester_feed_run(manchester_t * m, uint8_t level, uint16_t length, manchester_frame_t * frame);
+bool manchester_feed_sample(manchester_t * m, uint8_t sample, manchester_frame_t * frame);
+size_t manchester_decode_samples(manchester_t * m, const uint8_t * samples, size_t n,
+                                 manchester_frame_t * frames, size_t max_frames, size_t * frame_count);
+#ifndef __AVR__
+size_t manchester_decode_packed(manchester_t * m, const uint64_t * words, size_t n,
+                                manchester_frame_t * frames, size_t max_frames, size_t * frame_count);
+#endif
+
+#endif /* MANCHESTER_H_ */
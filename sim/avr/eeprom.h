@@ -0,0 +1,16 @@
+/* PharmaTracker host simulator: EEPROM */
+#ifndef SIM_AVR_EEPROM_H_
+#define SIM_AVR_EEPROM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// EEMEM variables are gathered in one section, which sim_eeprom_erase fills with 0xFF like a new chip
+#define EEMEM   __attribute__((section("sim_eeprom")))
+
+uint8_t eeprom_read_byte(const uint8_t * address);
+void eeprom_update_byte(uint8_t * address, uint8_t value);
+void eeprom_read_block(void * destination, const void * source, size_t n);
+void eeprom_update_block(const void * source, void * destination, size_t n);
+
+#endif /* SIM_AVR_EEPROM_H_ */
@@ -0,0 +1,12 @@
+/* PharmaTracker host simulator: interrupts */
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+#include "io.h"
+
+// the board wrapper runs the vectors through sim_isr, like the chip would
+#define ISR(vector, ...)    void vector(void); void vector(void)
+#define sei()               (SREG |= SIM_I)
+#define cli()               (SREG &= ~SIM_I)
+
+#endif /* SIM_AVR_INTERRUPT_H_ */
@@ -0,0 +1,180 @@
+/* PharmaTracker host simulator: I/O registers of the simulated board */
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+#include "../sim.h"
+
+/************************************************************************/
+/* Every register access goes through sim_register, which lets the      */
+/* peripheral models see it and advances the board's clock. The board   */
+/* wrappers pick the chip the way avr-gcc -mmcu would.                  */
+/************************************************************************/
+#define SIM_REGISTER(name)      (*sim_register(SIM_##name))
+#define SIM_REGISTER16(name)    (*sim_register16(SIM_##name))
+
+#define PINA    SIM_REGISTER(PINA)
+#define DDRA    SIM_REGISTER(DDRA)
+#define PORTA   SIM_REGISTER(PORTA)
+#define PINB    SIM_REGISTER(PINB)
+#define DDRB    SIM_REGISTER(DDRB)
+#define PORTB   SIM_REGISTER(PORTB)
+#define TCCR0A  SIM_REGISTER(TCCR0A)
+#define TCCR0B  SIM_REGISTER(TCCR0B)
+#define TCNT0   SIM_REGISTER(TCNT0)
+#define OCR0A   SIM_REGISTER(OCR0A)
+#define TIMSK0  SIM_REGISTER(TIMSK0)
+#define TIFR0   SIM_REGISTER(TIFR0)
+#define TCCR1A  SIM_REGISTER(TCCR1A)
+#define TCCR1B  SIM_REGISTER(TCCR1B)
+#define TIMSK1  SIM_REGISTER(TIMSK1)
+#define TIFR1   SIM_REGISTER(TIFR1)
+#define TCCR2A  SIM_REGISTER(TCCR2A)
+#define TCCR2B  SIM_REGISTER(TCCR2B)
+#define TCNT2   SIM_REGISTER(TCNT2)
+#define OCR2A   SIM_REGISTER(OCR2A)
+#define TIMSK2  SIM_REGISTER(TIMSK2)
+#define TIFR2   SIM_REGISTER(TIFR2)
+#define UBRR0H  SIM_REGISTER(UBRR0H)
+#define UBRR0L  SIM_REGISTER(UBRR0L)
+#define UCSR0A  SIM_REGISTER(UCSR0A)
+#define UCSR0B  SIM_REGISTER(UCSR0B)
+#define UCSR0C  SIM_REGISTER(UCSR0C)
+#define UDR0    SIM_REGISTER(UDR0)
+#define UBRR1H  SIM_REGISTER(UBRR1H)
+#define UBRR1L  SIM_REGISTER(UBRR1L)
+#define UCSR1A  SIM_REGISTER(UCSR1A)
+#define UCSR1B  SIM_REGISTER(UCSR1B)
+#define UCSR1C  SIM_REGISTER(UCSR1C)
+#define UDR1    SIM_REGISTER(UDR1)
+#define GIMSK   SIM_REGISTER(GIMSK)
+#define GIFR    SIM_REGISTER(GIFR)
+#define PCMSK   SIM_REGISTER(PCMSK)
+#define PCICR   SIM_REGISTER(PCICR)
+#define PCIFR   SIM_REGISTER(PCIFR)
+#define PCMSK0  SIM_REGISTER(PCMSK0)
+#define PCMSK1  SIM_REGISTER(PCMSK1)
+#define MCUCR   SIM_REGISTER(MCUCR)
+#define SMCR    SIM_REGISTER(SMCR)
+#define SREG    SIM_REGISTER(SREG)
+#define EECR    SIM_REGISTER(EECR)
+#define EEDR    SIM_REGISTER(EEDR)
+#define EEAR    SIM_REGISTER16(EEAR)
+
+#define bit_is_set(reg, bit)    ((reg) & (1 << (bit)))
+#define bit_is_clear(reg, bit)  (!((reg) & (1 << (bit))))
+
+#define PA0 0
+#define PA1 1
+#define PA2 2
+#define PA3 3
+#define PA4 4
+#define PA5 5
+#define PA6 6
+#define PA7 7
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PORTA0 0
+#define PORTA1 1
+#define PORTA2 2
+#define PORTA3 3
+#define PORTA4 4
+#define PORTA5 5
+#define PORTA6 6
+#define PORTA7 7
+#define PINA0 0
+#define PINA1 1
+#define PINA2 2
+#define PINA3 3
+#define PINA4 4
+#define PINA5 5
+#define PINA6 6
+#define PINA7 7
+
+// TCCR0A, TCCR0B (same bits on both chips)
+#define WGM00   0
+#define WGM01   1
+#define COM0A0  6
+#define COM0A1  7
+#define CS00    0
+#define CS01    1
+#define CS02    2
+#define WGM02   3
+#define FOC0A   7
+
+#if defined(__AVR_ATtiny85__)
+#define TCCR1   SIM_REGISTER(TCCR1)
+#define TCNT1   SIM_REGISTER(TCNT1_8)
+#define OCR1A   SIM_REGISTER(OCR1A_8)
+#define TIMSK   SIM_REGISTER(TIMSK)
+#define TIFR    SIM_REGISTER(TIFR)
+#define CS10    0
+#define CS11    1
+#define CS12    2
+#define CS13    3
+#define TOIE1   2
+#define OCIE1A  6
+#define TOV1    2
+#define OCF1A   6
+#define PCIE    5
+#define PCIF    5
+#define SM0     3
+#define SM1     4
+#define SE      5
+#elif defined(__AVR_ATmega644P__)
+#define OCR1A   SIM_REGISTER16(OCR1A)
+#define TCNT1   SIM_REGISTER16(TCNT1)
+#define TOIE0   0
+#define OCIE0A  1
+#define TOV0    0
+#define OCF0A   1
+#define WGM12   3
+#define CS10    0
+#define CS11    1
+#define CS12    2
+#define OCIE1A  1
+#define OCF1A   1
+#define WGM21   1
+#define CS20    0
+#define CS21    1
+#define CS22    2
+#define OCIE2A  1
+#define OCF2A   1
+#define RXC0    7
+#define UDRE0   5
+#define DOR0    3
+#define RXCIE0  7
+#define UDRIE0  5
+#define RXEN0   4
+#define TXEN0   3
+#define UCSZ00  1
+#define RXC1    7
+#define UDRE1   5
+#define DOR1    3
+#define RXCIE1  7
+#define UDRIE1  5
+#define RXEN1   4
+#define TXEN1   3
+#define UCSZ10  1
+#define PCIE0   0
+#define PCIE1   1
+#define PCIF0   0
+#define PCIF1   1
+#define SE      0
+#define SM0     1
+#define SM1     2
+#define SM2     3
+#define EERE    0
+#define EEPE    1
+#define EEMPE   2
+#define EERIE   3
+#else
+#error "the board wrapper must define the simulated chip"
+#endif
+
+#endif /* SIM_AVR_IO_H_ */
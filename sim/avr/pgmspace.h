@@ -0,0 +1,14 @@
+/* PharmaTracker host simulator: program memory */
+#ifndef SIM_AVR_PGMSPACE_H_
+#define SIM_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// the host has a single address space: data kept in flash is plain const data
+#define PROGMEM
+#define PSTR(s)             (s)
+#define pgm_read_byte(p)    (*(const uint8_t *)(p))
+#define strlen_P            strlen
+
+#endif /* SIM_AVR_PGMSPACE_H_ */
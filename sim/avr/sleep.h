@@ -0,0 +1,22 @@
+/* PharmaTracker host simulator: sleep modes */
+#ifndef SIM_AVR_SLEEP_H_
+#define SIM_AVR_SLEEP_H_
+
+#include "io.h"
+
+// only idle sleep is modelled: the CPU stops, the timers and the USARTs run on and wake it
+#if defined(__AVR_ATtiny85__)
+#define SIM_SLEEP_CONTROL       MCUCR
+#define SIM_SLEEP_MODES         (1 << SM0 | 1 << SM1)
+#elif defined(__AVR_ATmega644P__)
+#define SIM_SLEEP_CONTROL       SMCR
+#define SIM_SLEEP_MODES         (1 << SM0 | 1 << SM1 | 1 << SM2)
+#endif
+#define SLEEP_MODE_IDLE         0
+
+#define set_sleep_mode(mode)    (SIM_SLEEP_CONTROL = (SIM_SLEEP_CONTROL & ~SIM_SLEEP_MODES) | (mode))
+#define sleep_enable()          (SIM_SLEEP_CONTROL |= (1 << SE))
+#define sleep_disable()         (SIM_SLEEP_CONTROL &= ~(1 << SE))
+#define sleep_cpu()             sim_sleep(SIM_SLEEP_CONTROL & (1 << SE | SIM_SLEEP_MODES), 1 << SE)
+
+#endif /* SIM_AVR_SLEEP_H_ */
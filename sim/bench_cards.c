@@ -0,0 +1,118 @@
+/* PharmaTracker host benchmark: the card lookup of main.c
+ *
+ * Build and run from the repository root:
+ *   make bench
+ *   build/bench_cards [lookups] [seed]
+ *
+ * Registers 2, 64 and CARD_COUNT cards with random IDs of one vendor
+ * (the first byte shared) on the simulated main board, and times
+ * find_card for IDs that are registered and IDs that aren't, against a
+ * linear scan of the registered cards run the same way. Times are in cycles of the
+ * simulator's clock, which charges SIM_LOOP_CYCLES per loop iteration
+ * (a step of the search or an ID byte compared) and nothing for the
+ * rest of the C code: they count the work, they aren't what the AVR
+ * spends. The build stops at CARD_COUNT (128, see the card registry),
+ * so larger registries can't be measured.
+ */
+#include "main_board.c"
+
+#define LOOKUPS         10000   // per registry size, half of them misses
+#define MHZ             (F_CPU / 1000000.0)
+
+static uint64_t random_state;
+static uint32_t lookups;
+static bool done;
+
+static uint32_t random_below(uint32_t n) { // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (random_state * 0x2545F4914F6CDD1DULL >> 32) % n;
+}
+
+static void random_id(uint8_t * id) {
+    id[0] = 0xB5;
+    for (uint8_t i = 1; i < CREADER_ID_SIZE; i++) id[i] = random_below(256);
+}
+
+static int16_t linear_find(const uint8_t * id) { // every registered card in turn, as the first firmware did
+    for (uint8_t position = 0; position < card_total; position++) {
+        sim_tick(SIM_LOOP_CYCLES); // the simulator charges the firmware's loops, not this file's
+        if (compare_id(cards[card_order[position]].id, id) == 0) return card_order[position];
+    }
+    return -1;
+}
+
+typedef struct {
+    uint64_t total;
+    uint32_t worst, count;
+} cost_t;
+
+static void cost_add(cost_t * cost, uint32_t cycles) {
+    cost->total += cycles;
+    cost->count++;
+    if (cycles > cost->worst) cost->worst = cycles;
+}
+
+static void bench_size(uint8_t size) {
+    for (uint8_t card = 0; card < CARD_COUNT; card++) cards[card].status = UNREGISTERED;
+    card_total = 0;
+    for (uint8_t card = 0; card < size; card++) {
+        uint8_t id[CREADER_ID_SIZE];
+        do random_id(id); while (find_card(id) >= 0);
+        register_card(card, id);
+    }
+    cost_t costs[2][2] = {{{0}}}; // [binary search, linear scan][hit, miss]
+    for (uint32_t i = 0; i < lookups; i++) {
+        uint8_t id[CREADER_ID_SIZE];
+        bool hit = (i & 1) == 0;
+        if (hit) {
+            memcpy(id, cards[random_below(size)].id, CREADER_ID_SIZE);
+        } else {
+            do random_id(id); while (find_card(id) >= 0);
+        }
+        uint64_t start = main_board.board.cycles;
+        int16_t found = find_card(id);
+        cost_add(&costs[0][!hit], main_board.board.cycles - start);
+        start = main_board.board.cycles;
+        int16_t scanned = linear_find(id);
+        cost_add(&costs[1][!hit], main_board.board.cycles - start);
+        if (found != scanned || (found >= 0) != hit) {
+            fprintf(stderr, "%u cards: find_card gave %d, the scan %d\n", size, found, scanned);
+            exit(1);
+        }
+    }
+    static const char * names[2] = {"find_card", "linear scan"};
+    for (uint8_t way = 0; way < 2; way++) {
+        cost_t * hits = &costs[way][0], * misses = &costs[way][1];
+        uint32_t worst = (hits->worst > misses->worst) ? hits->worst : misses->worst;
+        printf("%5u %-12s %8.1f %6u %8.1f %6u %9.1f\n", size, names[way], (double) hits->total / hits->count,
+               hits->worst, (double) misses->total / misses->count, misses->worst, worst / MHZ);
+    }
+}
+
+static void cards_main(void) { // runs on the board instead of main.c's main()
+    printf("card lookup, in simulated cycles (%u per loop iteration), %u lookups per size\n", SIM_LOOP_CYCLES,
+           lookups);
+    printf("cards way          hit avg  worst miss avg  worst  worst us\n");
+    static const uint8_t sizes[] = {2, 64, CARD_COUNT};
+    for (uint8_t i = 0; i < sizeof(sizes); i++) bench_size(sizes[i]);
+    done = true;
+    for (;;) sim_tick(SIM_LOOP_CYCLES);
+}
+
+int main(int argc, char ** argv) {
+    lookups = (argc > 1) ? atoi(argv[1]) : LOOKUPS;
+    random_state = (argc > 2) ? strtoull(argv[2], NULL, 0) | 1 : 1;
+    static sim_link_t creader;
+    static sim_esp_t esp;
+    static sim_lcd_t lcd;
+    sim_esp_init(&esp, 9600);
+    sim_board_t * board = main_board_create(&creader, &esp, &lcd);
+    board->main = cards_main;
+    for (uint64_t now = 0; !done; ) {
+        now += 1000000000;
+        sim_run(now);
+    }
+    return 0;
+}
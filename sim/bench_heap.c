@@ -0,0 +1,143 @@
+/* PharmaTracker host benchmark: the checkout clock and the alarms of main.c
+ *
+ * Build and run from the repository root:
+ *   make bench
+ *   build/bench_heap [seconds between deadlines] [seed]
+ *
+ * Boots main.c on the simulated main board with all CARD_COUNT cards
+ * checked out, their deadlines 1 s apart (by default) in random order,
+ * and measures the work of a tick of the checkout clock and the latency
+ * of the alarms. The work of a tick is the TIMER1_COMPA ISR, timed
+ * before main() runs against the ISR of the first firmware, which
+ * counted down the time left of every card, and the runs of the alarm
+ * task, which looks at the top of the deadline heap once the clock
+ * ticked. The latency of an alarm is the time from the compare match
+ * that brings the clock to the card's deadline to the card being marked
+ * as alarmed, with everything else the firmware does going on
+ * meanwhile, polled every SIM_QUANTUM_NS. With 0 s between them every
+ * card runs out on the same tick, and the alarms queue up behind the
+ * journal. Cycles are the simulator's (see bench_cards.c). Exits with
+ * status 1 when a card is alarmed before its deadline.
+ */
+#include "main_board.c"
+
+#define FIRST_S         5           // the first deadline, after the boot message and the ESP8266 bring-up
+#define MAX_SPACING_S   10          // between two deadlines
+#define COARSE_NS       1000000     // poll step far from a deadline
+#define MHZ             (F_CPU / 1000000.0)
+
+static uint64_t random_state;
+static uint32_t isr_cycles, countdown_cycles;
+
+static uint32_t random_below(uint32_t n) { // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (random_state * 0x2545F4914F6CDD1DULL >> 32) % n;
+}
+
+static uint16_t time_left[CARD_COUNT];
+
+static void countdown_isr(void) { // the TIMER1_COMPA ISR of the first firmware
+    for (uint8_t i = 0; i < CARD_COUNT; i++) {
+        sim_tick(SIM_LOOP_CYCLES); // the simulator charges the firmware's loops, not this file's
+        if (time_left[i] > 0 && cards[i].status == CHECKED_OUT) time_left[i]--;
+    }
+}
+
+static void bench_main(void) { // runs on the board: times both ISRs, then main.c's main()
+    sim_board_t * board = &main_board.board;
+    for (uint8_t i = 0; i < CARD_COUNT; i++) time_left[i] = cards[i].deadline - checkout_seconds;
+    uint64_t start = board->cycles;
+    sim_isr(board, MAIN_TIMER1_COMPA, TIMER1_COMPA_vect);
+    isr_cycles = board->cycles - start;
+    start = board->cycles;
+    sim_isr(board, MAIN_TIMER1_COMPA, countdown_isr);
+    countdown_cycles = board->cycles - start;
+    board->reg[SIM_SREG] &= ~SIM_I; // out of reset, until main() enables them
+    checkout_seconds = 0;
+    main_board_main();
+}
+
+static uint64_t tick_ns(void) { // the next compare match of Timer1
+    return main_board.timer1 * 1000000000ULL / F_CPU;
+}
+
+static int compare_ns(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char ** argv) {
+    uint16_t spacing = (argc > 1) ? atoi(argv[1]) : 1;
+    if (spacing > MAX_SPACING_S) spacing = MAX_SPACING_S;
+    random_state = (argc > 2) ? strtoull(argv[2], NULL, 0) | 1 : 1;
+    static sim_link_t creader;
+    static sim_esp_t esp;
+    static sim_lcd_t lcd;
+    sim_lcd_init(&lcd);
+    sim_esp_init(&esp, 9600);
+    sim_board_t * board = main_board_create(&creader, &esp, &lcd);
+    board->main = bench_main;
+    uint8_t by_deadline[CARD_COUNT];
+    for (uint8_t i = 0; i < CARD_COUNT; i++) by_deadline[i] = i;
+    for (uint8_t i = CARD_COUNT - 1; i > 0; i--) { // shuffled, so the heap has some work to do
+        uint8_t j = random_below(i + 1), card = by_deadline[i];
+        by_deadline[i] = by_deadline[j];
+        by_deadline[j] = card;
+    }
+    for (uint8_t i = 0; i < CARD_COUNT; i++) { // the erased EEPROM leaves these at boot
+        uint8_t card = by_deadline[i];
+        uint8_t id[CREADER_ID_SIZE] = {0xB5, 0x00, 0x00, card, 0x01};
+        memcpy(cards[card].id, id, CREADER_ID_SIZE);
+        cards[card].max_time = FIRST_S + i * spacing; // checked out at 0 on the checkout clock
+        cards[card].deadline = FIRST_S + i * spacing;
+        cards[card].status = CHECKED_OUT;
+    }
+
+    static uint64_t latency_ns[CARD_COUNT], tick_at[FIRST_S + CARD_COUNT * MAX_SPACING_S];
+    uint16_t clock = 0, last = FIRST_S + (CARD_COUNT - 1) * spacing;
+    uint8_t alarms = 0, next = 0; // by_deadline[next]: the first card not alarmed yet
+    bool alarmed[CARD_COUNT] = {false};
+    for (uint64_t ns = 0; alarms < CARD_COUNT; ) {
+        if (checkout_seconds != clock) { // it ticked, the next compare match is a period on
+            clock = checkout_seconds;
+            uint64_t period = (uint64_t) prescaler(board->reg[SIM_TCCR1B], false) * (board->reg16[SIM_OCR1A] + 1);
+            if (clock <= last) tick_at[clock] = (main_board.timer1 - period) * 1000000000ULL / F_CPU;
+        }
+        for (uint8_t i = next; i < CARD_COUNT && FIRST_S + i * spacing <= clock; i++) {
+            uint8_t card = by_deadline[i];
+            if (alarmed[i] || cards[card].status != ALARMED) continue;
+            alarmed[i] = true;
+            alarms++;
+            latency_ns[i] = sim_board_ns(board) - tick_at[FIRST_S + i * spacing];
+        }
+        while (next < CARD_COUNT && alarmed[next]) next++;
+        for (uint8_t i = next; i < CARD_COUNT; i++) {
+            if (!alarmed[i] && cards[by_deadline[i]].status == ALARMED) {
+                fprintf(stderr, "card %u: alarmed at %u s on the checkout clock, its deadline is %u s\n",
+                        by_deadline[i] + 1, clock, FIRST_S + i * spacing);
+                return 1;
+            }
+        }
+        // fine steps while an alarm is due or the clock is about to tick
+        bool due = next < CARD_COUNT && FIRST_S + next * spacing <= clock;
+        ns += (due || tick_ns() <= ns + 2 * COARSE_NS) ? SIM_QUANTUM_NS : COARSE_NS;
+        sim_run(ns);
+    }
+
+    printf("checkout clock with %u cards checked out, deadlines %u s apart, in simulated cycles (%u per loop"
+           " iteration)\n", CARD_COUNT, spacing, SIM_LOOP_CYCLES);
+    printf("TIMER1_COMPA per tick: %u cycles (%.1f us), counting down every card: %u cycles (%.1f us)\n",
+           isr_cycles, isr_cycles / MHZ, countdown_cycles, countdown_cycles / MHZ);
+    uint32_t max_us, average_us;
+    uint16_t runs;
+    main_board_task_stats(ALARM_TASK, &max_us, &average_us, &runs);
+    printf("alarm task: %u runs, %u us on average, %u us at most\n", runs, average_us, max_us);
+    uint64_t total = 0;
+    for (uint8_t i = 0; i < CARD_COUNT; i++) total += latency_ns[i];
+    qsort(latency_ns, CARD_COUNT, sizeof(latency_ns[0]), compare_ns);
+    printf("deadline to alarm: %.3f ms on average, %.3f ms median, %.3f ms at most\n",
+           total / 1e6 / CARD_COUNT, latency_ns[CARD_COUNT / 2] / 1e6, latency_ns[CARD_COUNT - 1] / 1e6);
+    return 0;
+}
@@ -0,0 +1,95 @@
+/* PharmaTracker host benchmark: the upload rate of main.c
+ *
+ * Build and run from the repository root:
+ *   make bench
+ *   build/bench_uploads [scans per second]
+ *   build/bench_uploads_per_event [scans per second]
+ *
+ * Boots main.c on the simulated main board with SCAN_CARDS registered
+ * cards and scans them in turn, more often than the uploads keep up
+ * with, for LOAD_S seconds, then prints how many events per second
+ * reached the server once the journal filled up (from WARMUP_S on).
+ * bench_uploads is the firmware as it is built for the board: one
+ * persistent connection, UPLOAD_BATCH records per request and
+ * UPLOAD_PIPELINE requests in flight. bench_uploads_per_event is built
+ * with -DUPLOAD_BATCH=1 -DUPLOAD_PIPELINE=1 -DUPLOAD_KEEP_ALIVE=0: an
+ * AT+CIPSTART, one request and an AT+CIPCLOSE for every event, as the
+ * first firmware uploaded them (without its fixed 1 s waits). Both run
+ * against the same ESP8266 model at 9600 baud, with a 40 ms connect and
+ * a 60 ms round trip to the server. Past what the uploads carry, scans
+ * wait for room in the journal.
+ */
+#include "main_board.c"
+
+#define SCAN_CARDS      24
+#define SCAN_RATE       20      // scans per second, by default: more than either way carries
+#define LOAD_S          60
+#define WARMUP_S        10      // of the load, before the events are counted
+#define START_MS        3000    // the first scan: booted, the WiFi up
+#define BYTE_NS         (10 * 1000000000ULL / 2400)
+#define MS              1000000ULL
+
+static uint8_t crc8(uint8_t crc, uint8_t data) { // creader_crc8, which main_board.c compiled for the board only
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static void send_scan(sim_link_t * link, uint8_t card, uint8_t sequence, uint64_t ns) {
+    uint8_t frame[CREADER_BINARY_SIZE] = {CREADER_BINARY_MARK | (sequence & 0x0F)};
+    memcpy(&frame[1], cards[card].id, CREADER_ID_SIZE);
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < CREADER_BINARY_SIZE - 1; i++) {
+        crc = crc8(crc, frame[i]);
+    }
+    frame[CREADER_BINARY_SIZE - 1] = crc;
+    for (uint8_t i = 0; i < CREADER_BINARY_SIZE; i++) {
+        ns += BYTE_NS;
+        sim_link_push(link, frame[i], ns);
+    }
+}
+
+int main(int argc, char ** argv) {
+    uint32_t rate = (argc > 1) ? atoi(argv[1]) : SCAN_RATE;
+    if (rate == 0) rate = SCAN_RATE;
+    static sim_link_t creader;
+    static sim_esp_t esp;
+    static sim_lcd_t lcd;
+    sim_lcd_init(&lcd);
+    sim_esp_init(&esp, 9600);
+    main_board_create(&creader, &esp, &lcd);
+    for (uint8_t card = 0; card < SCAN_CARDS; card++) { // the erased EEPROM leaves these at boot
+        uint8_t id[CREADER_ID_SIZE] = {0xB5, 0x00, 0x00, card, 0x02};
+        memcpy(cards[card].id, id, CREADER_ID_SIZE);
+        cards[card].max_time = 59 * 60 + 59; // no alarm while the benchmark runs
+        cards[card].status = CHECKED_IN;
+    }
+
+    uint64_t ns = START_MS * MS, period = 1000 * MS / rate;
+    sim_run(ns);
+    uint64_t from = ns + WARMUP_S * 1000 * MS, to = ns + LOAD_S * 1000 * MS;
+    uint32_t scans = 0, requests = 0;
+    for (; ns < to; ns += period) {
+        send_scan(&creader, scans % SCAN_CARDS, scans, ns);
+        scans++;
+        sim_run(ns + period);
+        if (ns < from) requests = esp.requests;
+    }
+    uint32_t events = 0;
+    for (uint32_t i = 0; i < esp.record_count; i++) {
+        if (esp.records[i].received_ns >= from && esp.records[i].received_ns < to) events++;
+    }
+    requests = esp.requests - requests;
+    double window_s = (to - from) / 1e9;
+    printf("%-22s %5.1f events/s in %4.1f requests/s, %u scans/s offered\n",
+           UPLOAD_KEEP_ALIVE ? "persistent connection" : "connection per event", events / window_s,
+           requests / window_s, rate);
+    if (esp.bad_lengths != 0 || esp.closed != 0 || esp.failed != 0) {
+        fprintf(stderr, "%u requests with a wrong Content-Length, %u closed, %u failed\n", esp.bad_lengths,
+                esp.closed, esp.failed);
+        return 1;
+    }
+    return 0;
+}
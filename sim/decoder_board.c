@@ -0,0 +1,106 @@
+/* PharmaTracker host simulator: the decoder board (ATtiny85 running decoder.c) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sim.h"
+
+/************************************************************************/
+/* The firmware is included as is. Every loop iteration advances the    */
+/* clock, so that a loop spinning on a flag set by an ISR lets the ISR  */
+/* run, and ASSERT stops the simulation.                                */
+/************************************************************************/
+#define __AVR_ATtiny85__
+#define main            decoder_main
+#define while(...)      while (sim_tick(SIM_LOOP_CYCLES), (__VA_ARGS__))
+#define for(...)        for (__VA_ARGS__) if (sim_tick(SIM_LOOP_CYCLES), 0) {} else
+#define asm(x)          sim_break(__FILE__, __LINE__)
+#define stats           decoder_stats   // both firmwares have one
+#define TIMER1_COMPA_vect decoder_TIMER1_COMPA_vect
+#include "../decoder.c"
+#include "../manchester.c"
+#undef main
+#undef while
+#undef for
+#undef asm
+#undef stats
+#undef TIMER1_COMPA_vect
+
+/************************************************************************/
+/* Peripherals: Timer1 (counting up to 255 and wrapping, with its       */
+/* compare match A), the pin change interrupt on the demodulated        */
+/* signal, and the software UART on the TX pin, read by a UART          */
+/* receiver. Timer0 only toggles the carrier pin, which isn't modelled. */
+/************************************************************************/
+enum {DECODER_PCINT0 = 2, DECODER_TIMER1_COMPA = 3, DECODER_TIMER1_OVF = 4}; // vector numbers, the lower one wins
+
+static struct {
+    sim_board_t board;
+    const sim_tag_t * tag;
+    sim_uart_rx_t tx;
+    uint64_t tick;                  // cycle of the next Timer1 count
+} decoder_board;
+
+static void decoder_step(sim_board_t * board) {
+    uint8_t * reg = board->reg;
+    uint8_t clock = reg[SIM_TCCR1] & (1 << CS13 | 1 << CS12 | 1 << CS11 | 1 << CS10);
+    if (clock == 0) {
+        decoder_board.tick = board->cycles + 1; // stopped
+    } else {
+        while (board->cycles >= decoder_board.tick) { // CK/2^(clock - 1)
+            if (++reg[SIM_TCNT1_8] == 0) reg[SIM_TIFR] |= (1 << TOV1);
+            if (reg[SIM_TCNT1_8] == reg[SIM_OCR1A_8]) reg[SIM_TIFR] |= (1 << OCF1A);
+            decoder_board.tick += 1ULL << (clock - 1);
+        }
+    }
+    uint64_t ns = sim_board_ns(board);
+    uint8_t level = sim_tag_level(decoder_board.tag, ns) ? (1 << SIGNAL_INPUT) : 0;
+    if ((reg[SIM_PINB] & (1 << SIGNAL_INPUT)) != level) {
+        reg[SIM_PINB] ^= (1 << SIGNAL_INPUT);
+        if (reg[SIM_PCMSK] & (1 << SIGNAL_INPUT)) reg[SIM_GIFR] |= (1 << PCIF);
+    }
+    sim_uart_rx_poll(&decoder_board.tx, ns);
+}
+static bool decoder_interrupt(sim_board_t * board) {
+    uint8_t * reg = board->reg;
+    if ((reg[SIM_GIFR] & (1 << PCIF)) && (reg[SIM_GIMSK] & (1 << PCIE))) {
+        reg[SIM_GIFR] &= ~(1 << PCIF);
+        sim_isr(board, DECODER_PCINT0, PCINT0_vect);
+        return true;
+    }
+    if ((reg[SIM_TIFR] & (1 << OCF1A)) && (reg[SIM_TIMSK] & (1 << OCIE1A))) {
+        reg[SIM_TIFR] &= ~(1 << OCF1A);
+        sim_isr(board, DECODER_TIMER1_COMPA, decoder_TIMER1_COMPA_vect);
+        return true;
+    }
+    if ((reg[SIM_TIFR] & (1 << TOV1)) && (reg[SIM_TIMSK] & (1 << TOIE1))) {
+        reg[SIM_TIFR] &= ~(1 << TOV1);
+        sim_isr(board, DECODER_TIMER1_OVF, TIMER1_OVF_vect);
+        return true;
+    }
+    return false;
+}
+static void decoder_written(sim_board_t * board, uint8_t reg, uint8_t old) {
+    if (reg == SIM_PORTB && ((board->reg[reg] ^ old) & (1 << TRANSMIT_PIN))) {
+        sim_uart_rx_pin(&decoder_board.tx, board->reg[reg] & (1 << TRANSMIT_PIN), sim_board_ns(board));
+    }
+}
+
+sim_board_t * decoder_board_create(const sim_tag_t * tag, sim_link_t * out) {
+    sim_board_t * board = &decoder_board.board;
+    board->name = "decoder";
+    board->hz = F_CPU;
+    board->main = (void (*)(void)) decoder_main;
+    board->step = decoder_step;
+    board->interrupt = decoder_interrupt;
+    board->written = decoder_written;
+    decoder_board.tag = tag;
+    decoder_board.tx.bit_ns = 1000000000 / UART_BAUD;
+    decoder_board.tx.level = true;
+    decoder_board.tx.bit = -1;
+    decoder_board.tx.out = out;
+    sim_add_board(board);
+    return board;
+}
@@ -0,0 +1,237 @@
+/* PharmaTracker host simulator: the main board (ATmega644P running main.c) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sim.h"
+
+#define __AVR_ATmega644P__
+#define main            main_board_main
+#define while(...)      while (sim_tick(SIM_LOOP_CYCLES), (__VA_ARGS__))
+#define for(...)        for (__VA_ARGS__) if (sim_tick(SIM_LOOP_CYCLES), 0) {} else
+#define asm(x)          sim_break(__FILE__, __LINE__)
+#include "../main.c"
+#undef main
+#undef while
+#undef for
+#undef asm
+
+/************************************************************************/
+/* Peripherals: the three timers, USART0 (from the decoder), USART1     */
+/* (the ESP8266), the EEPROM, the LCD on port A and the buttons on port */
+/* B, with their pin change interrupt.                                  */
+/************************************************************************/
+enum {MAIN_PCINT1 = 5, MAIN_TIMER2_COMPA = 9, MAIN_TIMER1_COMPA = 13, MAIN_TIMER0_COMPA = 16, MAIN_USART0_RX = 20,
+      MAIN_EE_READY = 25, MAIN_USART1_RX = 28, MAIN_USART1_UDRE = 29}; // vector numbers, the lower one wins
+
+typedef struct {
+    sim_link_t * in;                // bytes received
+    uint8_t data;                   // the byte in the receive buffer
+    uint32_t overruns;
+    uint64_t tx_done;               // when the shift register is done with the byte being sent
+    bool tx_buffered;               // a byte waits in UDR for the shift register
+    uint8_t tx_data;
+} usart_t;
+
+static struct {
+    sim_board_t board;
+    sim_lcd_t * lcd;
+    sim_esp_t * esp;
+    usart_t usart0, usart1;
+    uint64_t timer0, timer1, timer2;    // cycle of the next compare match of each timer
+    uint64_t timer2_start;              // cycle at which TCNT2 was last 0
+    uint32_t buzzer_toggles;
+} main_board;
+
+static uint16_t prescaler(uint8_t cs, bool timer2) {
+    static const uint16_t timer01[] = {0, 1, 8, 64, 256, 1024, 0, 0};   // 6, 7: external clock, not used
+    static const uint16_t timer2s[] = {0, 1, 8, 32, 64, 128, 256, 1024};
+    return timer2 ? timer2s[cs & 7] : timer01[cs & 7];
+}
+static void ctc_timer(sim_board_t * board, uint64_t * next, uint16_t scale, uint32_t top, uint8_t flag_reg,
+                      uint8_t flag, uint64_t * start) {
+    if (scale == 0) {
+        *next = board->cycles + 1; // stopped
+        return;
+    }
+    uint64_t period = (uint64_t) scale * (top + 1);
+    while (board->cycles >= *next) {
+        board->reg[flag_reg] |= (1 << flag);
+        if (start != NULL) *start = *next;
+        *next += period;
+    }
+}
+static uint64_t usart_byte_ns(sim_board_t * board, uint8_t ubrrh, uint8_t ubrrl) {
+    uint32_t ubrr = (board->reg[ubrrh] << 8) | board->reg[ubrrl];
+    return 10ULL * 16 * (ubrr + 1) * 1000000000ULL / board->hz;
+}
+static void usart_receive(sim_board_t * board, usart_t * usart, uint8_t ucsra, uint64_t byte_ns, uint64_t ns) {
+    while (usart->in != NULL && sim_link_ready(usart->in, ns)) {
+        if (!(board->reg[ucsra + (SIM_UCSR0B - SIM_UCSR0A)] & (1 << RXEN0))) {
+            sim_link_pop(usart->in); // the receiver is off
+        } else if (!(board->reg[ucsra] & (1 << RXC0))) {
+            usart->data = sim_link_pop(usart->in);
+            board->reg[ucsra] |= (1 << RXC0);
+        } else if (usart->in->ns[usart->in->tail & (SIM_LINK_SIZE - 1)] + byte_ns <= ns) {
+            sim_link_pop(usart->in); // the next one came in while the last one wasn't read: lost
+            usart->overruns++;
+            board->reg[ucsra] |= (1 << DOR0);
+        } else {
+            break;
+        }
+    }
+}
+static void usart1_transmit(sim_board_t * board, uint8_t data, uint64_t ns) {
+    uint64_t byte_ns = usart_byte_ns(board, SIM_UBRR1H, SIM_UBRR1L);
+    usart_t * usart = &main_board.usart1;
+    if (usart->tx_done > ns) { // the shift register is busy, UDR holds the byte
+        usart->tx_buffered = true;
+        usart->tx_data = data;
+        board->reg[SIM_UCSR1A] &= ~(1 << UDRE1);
+        return;
+    }
+    usart->tx_done = ns + byte_ns;
+    sim_esp_receive(main_board.esp, data, usart->tx_done);
+}
+
+static void eeprom_control(sim_board_t * board, uint8_t old, uint64_t ns) { // EECR was written
+    uint8_t * reg = board->reg;
+    if ((reg[SIM_EECR] & (1 << EERE)) && !(old & (1 << EEPE))) { // a read, ignored during a write
+        reg[SIM_EEDR] = *sim_eeprom_address(board->reg16[SIM_EEAR]);
+    }
+    reg[SIM_EECR] &= ~(1 << EERE);
+    if ((reg[SIM_EECR] & (1 << EEPE)) && !(old & (1 << EEPE))) {
+        if (!(old & (1 << EEMPE))) { // EEPE only takes while EEMPE is set
+            reg[SIM_EECR] &= ~(1 << EEPE);
+            return;
+        }
+        *sim_eeprom_address(board->reg16[SIM_EEAR]) = reg[SIM_EEDR];
+        sim_eeprom_writes++;
+        sim_eeprom_ready_ns = ns + SIM_EEPROM_WRITE_NS;
+        reg[SIM_EECR] &= ~(1 << EEMPE);
+    }
+}
+static void main_step(sim_board_t * board) {
+    uint8_t * reg = board->reg;
+    uint64_t ns = sim_board_ns(board);
+    ctc_timer(board, &main_board.timer0, prescaler(reg[SIM_TCCR0B], false), reg[SIM_OCR0A], SIM_TIFR0, OCF0A, NULL);
+    ctc_timer(board, &main_board.timer1, prescaler(reg[SIM_TCCR1B], false), board->reg16[SIM_OCR1A], SIM_TIFR1,
+              OCF1A, NULL);
+    ctc_timer(board, &main_board.timer2, prescaler(reg[SIM_TCCR2B], true), reg[SIM_OCR2A], SIM_TIFR2, OCF2A,
+              &main_board.timer2_start);
+    usart_receive(board, &main_board.usart0, SIM_UCSR0A, usart_byte_ns(board, SIM_UBRR0H, SIM_UBRR0L), ns);
+    usart_receive(board, &main_board.usart1, SIM_UCSR1A, usart_byte_ns(board, SIM_UBRR1H, SIM_UBRR1L), ns);
+    if ((reg[SIM_EECR] & (1 << EEPE)) && ns >= sim_eeprom_ready_ns) reg[SIM_EECR] &= ~(1 << EEPE);
+    usart_t * usart = &main_board.usart1;
+    if (usart->tx_buffered && ns >= usart->tx_done) {
+        usart->tx_buffered = false;
+        reg[SIM_UCSR1A] |= (1 << UDRE1);
+        usart1_transmit(board, usart->tx_data, usart->tx_done);
+    }
+}
+static bool main_interrupt(sim_board_t * board) {
+    uint8_t * reg = board->reg;
+    if ((reg[SIM_PCIFR] & (1 << PCIF1)) && (reg[SIM_PCICR] & (1 << PCIE1))) {
+        reg[SIM_PCIFR] &= ~(1 << PCIF1);
+        sim_isr(board, MAIN_PCINT1, PCINT1_vect);
+    } else if ((reg[SIM_TIFR2] & (1 << OCF2A)) && (reg[SIM_TIMSK2] & (1 << OCIE2A))) {
+        reg[SIM_TIFR2] &= ~(1 << OCF2A);
+        sim_isr(board, MAIN_TIMER2_COMPA, TIMER2_COMPA_vect);
+    } else if ((reg[SIM_TIFR1] & (1 << OCF1A)) && (reg[SIM_TIMSK1] & (1 << OCIE1A))) {
+        reg[SIM_TIFR1] &= ~(1 << OCF1A);
+        sim_isr(board, MAIN_TIMER1_COMPA, TIMER1_COMPA_vect);
+    } else if ((reg[SIM_TIFR0] & (1 << OCF0A)) && (reg[SIM_TIMSK0] & (1 << OCIE0A))) {
+        reg[SIM_TIFR0] &= ~(1 << OCF0A);
+        sim_isr(board, MAIN_TIMER0_COMPA, TIMER0_COMPA_vect);
+    } else if ((reg[SIM_UCSR0A] & (1 << RXC0)) && (reg[SIM_UCSR0B] & (1 << RXCIE0))) {
+        sim_isr(board, MAIN_USART0_RX, USART0_RX_vect); // reading UDR0 clears RXC0
+    } else if (!(reg[SIM_EECR] & (1 << EEPE)) && (reg[SIM_EECR] & (1 << EERIE))) {
+        sim_isr(board, MAIN_EE_READY, EE_READY_vect); // as long as it is enabled and no write is in progress
+    } else if ((reg[SIM_UCSR1A] & (1 << RXC1)) && (reg[SIM_UCSR1B] & (1 << RXCIE1))) {
+        sim_isr(board, MAIN_USART1_RX, USART1_RX_vect);
+    } else if ((reg[SIM_UCSR1A] & (1 << UDRE1)) && (reg[SIM_UCSR1B] & (1 << UDRIE1))) {
+        sim_isr(board, MAIN_USART1_UDRE, USART1_UDRE_vect);
+    } else {
+        return false;
+    }
+    return true;
+}
+static void main_access(sim_board_t * board, uint8_t reg) {
+    uint8_t * regs = board->reg;
+    uint64_t ns = sim_board_ns(board);
+    switch (reg) {
+        case SIM_UDR0: // read by the RX ISR, anything else is a write
+        case SIM_UDR1: {
+            bool is_0 = (reg == SIM_UDR0);
+            if (board->vector == (is_0 ? MAIN_USART0_RX : MAIN_USART1_RX)) {
+                regs[reg] = is_0 ? main_board.usart0.data : main_board.usart1.data;
+                regs[is_0 ? SIM_UCSR0A : SIM_UCSR1A] &= ~(1 << RXC0 | 1 << DOR0);
+            } else {
+                board->force_write = true;
+            }
+            break;
+        }
+        case SIM_TCNT2: {
+            uint16_t scale = prescaler(regs[SIM_TCCR2B], true);
+            if (scale != 0) regs[reg] = (board->cycles - main_board.timer2_start) / scale;
+            break;
+        }
+        case SIM_PINA: { // D7 reads the busy flag while E is high and RW selects reading
+            bool rw = !main_board.lcd->rw_tied_low && (regs[SIM_PORTA] & (1 << LCD_RW));
+            bool reading = rw && (regs[SIM_PORTA] & (1 << LCD_E));
+            bool busy = reading && !main_board.lcd->read_low && sim_lcd_busy(main_board.lcd, ns);
+            regs[reg] = busy ? (1 << PINA6) : 0;
+            break;
+        }
+    }
+}
+static void main_written(sim_board_t * board, uint8_t reg, uint8_t old) {
+    uint8_t value = board->reg[reg];
+    uint64_t ns = sim_board_ns(board);
+    if (reg == SIM_PORTA && (old & (1 << LCD_E)) && !(value & (1 << LCD_E))) {
+        bool rw = !main_board.lcd->rw_tied_low && (value & (1 << LCD_RW));
+        sim_lcd_strobe(main_board.lcd, value & (1 << LCD_RS), rw, (value >> 3) & 0x0F, ns);
+    } else if (reg == SIM_PORTB && ((value ^ old) & (1 << PB5))) {
+        main_board.buzzer_toggles++;
+    } else if (reg == SIM_UDR1) {
+        usart1_transmit(board, value, ns);
+    } else if (reg == SIM_EECR) {
+        eeprom_control(board, old, ns);
+    }
+}
+
+sim_board_t * main_board_create(sim_link_t * creader, sim_esp_t * esp, sim_lcd_t * lcd) {
+    sim_board_t * board = &main_board.board;
+    board->name = "main";
+    board->hz = F_CPU;
+    board->main = (void (*)(void)) main_board_main;
+    board->step = main_step;
+    board->interrupt = main_interrupt;
+    board->access = main_access;
+    board->written = main_written;
+    board->reg[SIM_UCSR0A] = (1 << UDRE0); // reset values
+    board->reg[SIM_UCSR1A] = (1 << UDRE1);
+    main_board.lcd = lcd;
+    lcd->rw_tied_low = !LCD_BUSY_FLAG; // wired as the boards the firmware is built for
+    main_board.esp = esp;
+    main_board.usart0.in = creader;
+    main_board.usart1.in = &esp->out;
+    sim_eeprom_erase();
+    sim_add_board(board);
+    return board;
+}
+void main_board_button(uint8_t pin, bool pressed) {
+    uint8_t * reg = main_board.board.reg;
+    if (pressed == !!(reg[SIM_PINB] & (1 << pin))) return;
+    reg[SIM_PINB] ^= (1 << pin);
+    if (reg[SIM_PCMSK1] & (1 << pin)) reg[SIM_PCIFR] |= (1 << PCIF1); // PB0..PB7 are PCINT8..PCINT15
+}
+uint8_t main_board_task_count(void) {
+    return TASK_COUNT;
+}
+void main_board_task_stats(uint8_t task, uint32_t * max_us, uint32_t * average_us, uint16_t * runs) {
+    task_stats(task, max_us, average_us);
+    *runs = tasks[task].runs;
+}
@@ -0,0 +1,278 @@
+/* PharmaTracker host simulator: peripherals outside the microcontrollers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+/************************************************************************/
+/* Byte links                                                           */
+/************************************************************************/
+void sim_link_push(sim_link_t * link, uint8_t data, uint64_t ns) {
+    if (link->head - link->tail == SIM_LINK_SIZE) {
+        link->lost++;
+        return;
+    }
+    link->data[link->head & (SIM_LINK_SIZE - 1)] = data;
+    link->ns[link->head & (SIM_LINK_SIZE - 1)] = ns;
+    link->head++;
+    link->bytes++;
+    link->last_ns = ns;
+}
+bool sim_link_ready(const sim_link_t * link, uint64_t ns) {
+    return link->head != link->tail && link->ns[link->tail & (SIM_LINK_SIZE - 1)] <= ns;
+}
+uint8_t sim_link_pop(sim_link_t * link) {
+    return link->data[link->tail++ & (SIM_LINK_SIZE - 1)];
+}
+
+/************************************************************************/
+/* EM4100 tag: 9 header 1's, 10 rows of 4 data bits + even parity, 4    */
+/* even column parity bits and a 0 stop bit, Manchester encoded: a 1 is */
+/* low then high, a 0 high then low (the level after the middle of the  */
+/* bit is the bit).                                                     */
+/************************************************************************/
+uint64_t sim_em4100_frame(const uint8_t id[5]) {
+    uint64_t frame = 0x1FF;
+    uint8_t columns = 0;
+    for (uint8_t row = 0; row < 10; row++) {
+        uint8_t nibble = (row & 1) ? id[row >> 1] & 0x0F : id[row >> 1] >> 4;
+        uint8_t parity = __builtin_parity(nibble);
+        frame = (frame << 5) | (nibble << 1) | parity;
+        columns ^= nibble;
+    }
+    return (frame << 5) | (columns << 1); // column parities and the stop bit
+}
+bool sim_tag_level(const sim_tag_t * tag, uint64_t ns) {
+    if (ns < tag->on_ns || ns >= tag->off_ns) return false;
+    uint64_t half = (ns - tag->on_ns) / tag->half_bit_ns;
+    bool bit = (tag->frame >> (63 - (half / 2) % 64)) & 1;
+    return (half & 1) ? bit : !bit;
+}
+
+/************************************************************************/
+/* UART receiver: the start bit edge times the samples, taken in the    */
+/* middle of each bit.                                                  */
+/************************************************************************/
+void sim_uart_rx_pin(sim_uart_rx_t * rx, bool level, uint64_t ns) {
+    if (rx->bit < 0 && rx->level && !level) { // start bit
+        rx->bit = 0;
+        rx->data = 0;
+        rx->sample_ns = ns + rx->bit_ns + rx->bit_ns / 2;
+    }
+    rx->level = level;
+}
+void sim_uart_rx_poll(sim_uart_rx_t * rx, uint64_t ns) {
+    while (rx->bit >= 0 && ns >= rx->sample_ns) {
+        if (rx->bit < 8) {
+            rx->data |= rx->level << rx->bit;
+            rx->bit++;
+            rx->sample_ns += rx->bit_ns;
+            continue;
+        }
+        if (rx->level) {
+            sim_link_push(rx->out, rx->data, rx->sample_ns);
+        } else {
+            rx->framing_errors++;
+        }
+        rx->bit = -1;
+    }
+}
+
+/************************************************************************/
+/* HD44780: after power up it takes 8-bit instructions, of which only   */
+/* the upper nibble is wired, until a function set switches it to 4-bit */
+/* mode. Every instruction keeps it busy for as long as the datasheet   */
+/* says, and one sent before that counts as an overrun.                 */
+/************************************************************************/
+#define LCD_INSTRUCTION_NS  37000
+#define LCD_WRITE_NS        43000
+#define LCD_CLEAR_NS        1520000
+
+void sim_lcd_init(sim_lcd_t * lcd) {
+    memset(lcd, 0, sizeof(*lcd));
+    memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+}
+static void lcd_execute(sim_lcd_t * lcd, bool rs, uint8_t value, uint64_t ns) {
+    uint32_t busy = LCD_INSTRUCTION_NS;
+    if (ns < lcd->busy_until_ns) lcd->overruns++;
+    if (rs) {
+        lcd->ddram[lcd->address] = value;
+        lcd->address = (lcd->address + 1) & 0x7F;
+        lcd->writes++;
+        lcd->changed_ns = ns;
+        busy = LCD_WRITE_NS;
+    } else if (value & 0x80) { // set DDRAM address
+        lcd->address = value & 0x7F;
+    } else if (value & 0x40) { // set CGRAM address, not used
+    } else if (value & 0x20) { // function set
+        if (!(value & 0x10)) lcd->four_bit = true;
+    } else if (value & 0x10) { // cursor shift
+        lcd->address = (lcd->address + ((value & 0x04) ? 1 : -1)) & 0x7F;
+    } else if (value & 0x08) { // display control
+        lcd->cursor = value & 0x02;
+    } else if (value & 0x04) { // entry mode
+    } else if (value & 0x02) { // home
+        lcd->address = 0;
+        busy = LCD_CLEAR_NS;
+    } else if (value & 0x01) { // clear
+        memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+        lcd->address = 0;
+        lcd->changed_ns = ns;
+        busy = LCD_CLEAR_NS;
+    }
+    if (!rs) lcd->commands++;
+    lcd->busy_until_ns = ns + busy;
+}
+void sim_lcd_strobe(sim_lcd_t * lcd, bool rs, bool rw, uint8_t nibble, uint64_t ns) {
+    if (rw) { // reading: the busy flag comes with the high nibble
+        lcd->read_low = !lcd->read_low;
+        return;
+    }
+    if (!lcd->four_bit) {
+        lcd_execute(lcd, rs, nibble << 4, ns);
+        return;
+    }
+    if (!lcd->low_nibble) {
+        lcd->high = nibble;
+        lcd->low_nibble = true;
+        return;
+    }
+    lcd->low_nibble = false;
+    lcd_execute(lcd, rs, (lcd->high << 4) | nibble, ns);
+}
+bool sim_lcd_busy(const sim_lcd_t * lcd, uint64_t ns) {
+    return ns < lcd->busy_until_ns;
+}
+void sim_lcd_line(const sim_lcd_t * lcd, uint8_t line, char text[17]) {
+    memcpy(text, &lcd->ddram[line ? 0x40 : 0x00], 16);
+    text[16] = 0;
+}
+
+/************************************************************************/
+/* ESP8266: answers the AT commands the firmware uses the way the AT    */
+/* firmware does (echo off), and plays the server for the data sent     */
+/* over the TCP connection: each request gets "200 OK" after a round    */
+/* trip, and every line of a batch is recorded, as is the body of the   */
+/* last stats request. A server hook can answer with another status     */
+/* instead, the server then keeps nothing of the request, or close the  */
+/* connection without an answer, which loses the request.               */
+/************************************************************************/
+#define SERVER_ANSWER "\r\n+IPD,42:HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nOK\r\n" // as flaskapp.py answers
+
+static void esp_send(sim_esp_t * esp, const char * text, uint64_t ns) {
+    for (; *text != 0; text++) {
+        uint64_t start = (esp->out.last_ns > ns) ? esp->out.last_ns : ns;
+        sim_link_push(&esp->out, *text, start + esp->byte_ns);
+    }
+}
+void sim_esp_init(sim_esp_t * esp, uint32_t baud) {
+    memset(esp, 0, sizeof(*esp));
+    esp->byte_ns = 10 * 1000000000ULL / baud;
+    esp->server_ns = 60000000;
+    esp->connect_ns = 40000000;
+    esp->associate_ns = 1500000000;
+    esp->wifi_ns = UINT64_MAX;
+}
+static void esp_request(sim_esp_t * esp, uint64_t ns) { // the data of an AT+CIPSEND is complete
+    char reply[48];
+    snprintf(reply, sizeof(reply), "\r\nRecv %u bytes\r\n\r\nSEND OK\r\n", esp->request_size);
+    esp_send(esp, reply, ns + 2000000);
+    esp->request[esp->request_size] = 0;
+    char * body = strstr(esp->request, "\r\n\r\n");
+    if (body == NULL) return;
+    esp->requests++;
+    char * length = strstr(esp->request, "\r\nContent-Length: ");
+    if (length == NULL || length > body || strtoul(length + 18, NULL, 10) != strlen(body + 4)) esp->bad_lengths++;
+    uint16_t status = (esp->server != NULL) ? esp->server(esp->requests - 1, ns) : 200;
+    if (status == SIM_SERVER_CLOSE) {
+        esp->closed++;
+        esp->connected = false;
+        esp_send(esp, "CLOSED\r\n", ns + esp->server_ns);
+        return;
+    }
+    if (status < 200 || status > 299) {
+        char answer[80], header[16];
+        snprintf(answer, sizeof(answer), "HTTP/1.1 %u Error\r\nContent-Length: 0\r\n\r\n", status);
+        snprintf(header, sizeof(header), "\r\n+IPD,%zu:", strlen(answer));
+        esp->failed++;
+        esp_send(esp, header, ns + esp->server_ns);
+        esp_send(esp, answer, ns + esp->server_ns);
+        return;
+    }
+    if (strncmp(esp->request, "POST /stats ", 12) == 0) { // the counters, not events
+        snprintf(esp->stats, sizeof(esp->stats), "%s", body + 4);
+        esp->stats_requests++;
+        esp_send(esp, SERVER_ANSWER, ns + esp->server_ns);
+        return;
+    }
+    for (char * line = body + 4; *line != 0; ) {
+        char * end = strchr(line, '\n');
+        if (end == NULL) break;
+        if (esp->record_count < SIM_ESP_RECORDS) {
+            sim_esp_record_t * record = &esp->records[esp->record_count++];
+            size_t n = end - line;
+            if (n >= sizeof(record->line)) n = sizeof(record->line) - 1;
+            memcpy(record->line, line, n);
+            record->line[n] = 0;
+            record->received_ns = ns + esp->server_ns / 2;
+        }
+        line = end + 1;
+    }
+    esp_send(esp, SERVER_ANSWER, ns + esp->server_ns);
+    for (; esp->unanswered < esp->record_count; esp->unanswered++) {
+        esp->records[esp->unanswered].answered_ns = esp->out.last_ns;
+    }
+}
+static void esp_command(sim_esp_t * esp, const char * command, uint64_t ns) {
+    bool wifi = ns >= esp->wifi_ns;
+    esp->commands++;
+    if (strcmp(command, "AT+RST") == 0) {
+        esp->connected = false;
+        esp->wifi_ns = ns + esp->associate_ns;
+        esp_send(esp, "\r\nOK\r\n", ns + 1000000);
+        esp_send(esp, " ets Jan  8 2013,rst cause:2, boot mode:(3,6)\r\n\r\nready\r\n", ns + 300000000);
+    } else if (strcmp(command, "ATE0") == 0) {
+        esp_send(esp, "\r\nOK\r\n", ns + 1000000);
+    } else if (strcmp(command, "AT+CIPSTATUS") == 0) {
+        esp_send(esp, !wifi ? "STATUS:5\r\n" : esp->connected ? "STATUS:3\r\n+CIPSTATUS:0,\"TCP\"\r\n" : "STATUS:2\r\n",
+                 ns + 2000000);
+        esp_send(esp, "\r\nOK\r\n", ns);
+    } else if (strncmp(command, "AT+CIPSTART=", 12) == 0) {
+        if (!wifi) {
+            esp_send(esp, "\r\nERROR\r\n", ns + 1000000);
+        } else if (esp->connected) {
+            esp_send(esp, "ALREADY CONNECTED\r\n\r\nERROR\r\n", ns + 1000000);
+        } else {
+            esp->connected = true;
+            esp_send(esp, "CONNECT\r\n\r\nOK\r\n", ns + esp->connect_ns);
+        }
+    } else if (strncmp(command, "AT+CIPSEND=", 11) == 0) {
+        if (!esp->connected) {
+            esp_send(esp, "link is not valid\r\n\r\nERROR\r\n", ns + 1000000);
+            return;
+        }
+        esp->data_left = atoi(command + 11);
+        esp->request_size = 0;
+        esp_send(esp, "\r\nOK\r\n> ", ns + 1000000);
+    } else if (strcmp(command, "AT+CIPCLOSE") == 0) {
+        esp_send(esp, esp->connected ? "CLOSED\r\n\r\nOK\r\n" : "\r\nERROR\r\n", ns + 1000000);
+        esp->connected = false;
+    } else if (command[0] != 0) {
+        esp_send(esp, "\r\nERROR\r\n", ns + 1000000);
+    }
+}
+void sim_esp_receive(sim_esp_t * esp, uint8_t data, uint64_t ns) {
+    if (esp->data_left > 0) {
+        if (esp->request_size < sizeof(esp->request) - 1) esp->request[esp->request_size++] = data;
+        if (--esp->data_left == 0) esp_request(esp, ns);
+        return;
+    }
+    if (data == '\n') {
+        esp->line[esp->length] = 0;
+        if (esp->length > 0 && esp->line[esp->length - 1] == '\r') esp->line[esp->length - 1] = 0;
+        esp->length = 0;
+        esp_command(esp, esp->line, ns);
+    } else if (esp->length < sizeof(esp->line) - 1) {
+        esp->line[esp->length++] = data;
+    }
+}
@@ -0,0 +1,173 @@
+/* PharmaTracker host simulator: the swipe scenario
+ *
+ * Build and run from the repository root:
+ *   make sim
+ *   build/ptsim [swipes] [period_ms]
+ *
+ * Powers both boards up and swipes card 1 every RETRY_MS from then on
+ * until a scan is accepted (the LCD shows the check out), which times
+ * how long after power on the system is usable, then waits for the boot
+ * event to reach the server.
+ * Then swipes cards 1 and 2 in turn over the antenna
+ * every period_ms (the decoder doesn't resend a tag that only just left
+ * the field, so the same card twice in a row would test that instead),
+ * and follows each swipe through the decoder, the UART link, the card
+ * registry and the upload to the server. Prints one line per swipe and a
+ * summary, all times in ms of simulated time, and how much of the swipes
+ * each CPU was awake rather than in idle sleep. Exits with status 2 if a
+ * swipe didn't make it to the LCD and the server, or if the LCD was sent
+ * an instruction while it was still busy (make check).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sim.h"
+#include "../creader_protocol.h"
+
+#define SWIPE_MS        200     // the card stays in the field that long
+#define RETRY_MS        500     // until the first scan is accepted, the card is swiped this often
+#define BOOT_LIMIT_MS   20000
+#define POLL_MS         1       // how often the LCD and the server are looked at
+#define TAG_HALF_BIT_NS 256000  // RF/64 at 125 kHz
+
+static const uint8_t card_ids[2][5] = { // cards 1 and 2 of the default registry
+    {0x31, 0x00, 0x37, 0xD9, 0x3D},
+    {0x66, 0x00, 0x6C, 0x4B, 0x7F},
+};
+
+static sim_link_t creader;
+static sim_tag_t tag;
+static sim_esp_t esp;
+static sim_lcd_t lcd;
+
+typedef struct {
+    double min, max, total;
+    uint32_t count;
+} stat_t;
+
+static void stat_add(stat_t * stat, double value) {
+    if (stat->count == 0 || value < stat->min) stat->min = value;
+    if (stat->count == 0 || value > stat->max) stat->max = value;
+    stat->total += value;
+    stat->count++;
+}
+static void stat_print(const char * name, const stat_t * stat) {
+    if (stat->count == 0) {
+        printf("%-12s n=0\n", name);
+        return;
+    }
+    printf("%-12s n=%u min=%.2f avg=%.2f max=%.2f\n", name, stat->count, stat->min, stat->total / stat->count,
+           stat->max);
+}
+static bool lcd_starts_with(uint8_t line, const char * text) {
+    char shown[17];
+    sim_lcd_line(&lcd, line, shown);
+    return strncmp(shown, text, strlen(text)) == 0;
+}
+static double ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+int main(int argc, char ** argv) {
+    uint32_t swipes = (argc > 1) ? atoi(argv[1]) : 20;
+    uint32_t period_ms = (argc > 2) ? atoi(argv[2]) : 3000;
+    clock_t host_start = clock();
+
+    sim_lcd_init(&lcd);
+    sim_esp_init(&esp, 9600);
+    tag.half_bit_ns = TAG_HALF_BIT_NS;
+    sim_board_t * decoder = decoder_board_create(&tag, &creader);
+    sim_board_t * board = main_board_create(&creader, &esp, &lcd);
+
+    uint64_t now = 0;
+    tag.frame = sim_em4100_frame(card_ids[0]);
+    while (!lcd_starts_with(0, "Check")) {
+        tag.on_ns = now - now % (RETRY_MS * 1000000ULL);
+        tag.off_ns = tag.on_ns + SWIPE_MS * 1000000ULL;
+        now += POLL_MS * 1000000ULL;
+        sim_run(now);
+        if (ms(now) > BOOT_LIMIT_MS) {
+            fprintf(stderr, "no scan was accepted in %u ms\n", BOOT_LIMIT_MS);
+            return 1;
+        }
+    }
+    printf("first scan   %.2f\n", ms(lcd.changed_ns));
+    tag.off_ns = (tag.off_ns < now) ? tag.off_ns : now;
+    while (!lcd_starts_with(0, "1: ") || esp.record_count == 0) { // the clocks screen, the boot event uploaded
+        now += POLL_MS * 1000000ULL;
+        sim_run(now);
+        if (ms(now) > BOOT_LIMIT_MS) {
+            fprintf(stderr, "the main board didn't boot in %u ms\n", BOOT_LIMIT_MS);
+            return 1;
+        }
+    }
+    printf("first upload %.2f\n", ms(esp.records[0].received_ns));
+
+    stat_t frame_stat = {0}, display_stat = {0}, server_stat = {0}, ack_stat = {0}, handling_stat = {0};
+    uint32_t missed = 0;
+    uint64_t first_swipe = now;
+    uint64_t cycles[2] = {decoder->cycles, board->cycles}, slept[2] = {decoder->sleep_cycles, board->sleep_cycles};
+    printf("swipe        frame  display   server      ack\n");
+    for (uint32_t i = 0; i < swipes; i++) {
+        uint64_t start = now;
+        uint32_t bytes = creader.bytes, records = esp.record_count;
+        uint64_t display = 0;
+        tag.frame = sim_em4100_frame(card_ids[i & 1]);
+        tag.on_ns = start;
+        tag.off_ns = start + SWIPE_MS * 1000000ULL;
+        while (now < start + period_ms * 1000000ULL) {
+            now += POLL_MS * 1000000ULL;
+            sim_run(now);
+            if (display == 0 && lcd.changed_ns > start && lcd_starts_with(0, "Check")) display = lcd.changed_ns;
+        }
+        // the latencies are taken from the swipe, when the card enters the field
+        double frame = -1; // when the last byte of the first ID frame sent after the swipe arrived
+        for (uint32_t j = bytes; j + CREADER_BINARY_SIZE <= creader.bytes; j++) {
+            if ((creader.data[j & (SIM_LINK_SIZE - 1)] & 0xF0) != CREADER_BINARY_MARK) continue;
+            frame = ms(creader.ns[(j + CREADER_BINARY_SIZE - 1) & (SIM_LINK_SIZE - 1)] - start);
+            break;
+        }
+        double shown = (display != 0) ? ms(display - start) : -1;
+        double server = -1, ack = -1;
+        if (esp.record_count > records) {
+            server = ms(esp.records[records].received_ns - start);
+            if (esp.records[records].answered_ns != 0) ack = ms(esp.records[records].answered_ns - start);
+        }
+        printf("%5u %10.2f %8.2f %8.2f %8.2f\n", i + 1, frame, shown, server, ack);
+        if (frame < 0 || shown < 0 || server < 0 || ack < 0) missed++;
+        if (frame >= 0) stat_add(&frame_stat, frame);
+        if (shown >= 0) stat_add(&display_stat, shown);
+        if (frame >= 0 && shown >= 0) stat_add(&handling_stat, shown - frame);
+        if (server >= 0) stat_add(&server_stat, server);
+        if (ack >= 0) stat_add(&ack_stat, ack);
+    }
+
+    double host_s = (double) (clock() - host_start) / CLOCKS_PER_SEC;
+    double swipe_s = ms(now - first_swipe) / 1000;
+    printf("\nlatency from the swipe (ms)\n");
+    stat_print("frame", &frame_stat);
+    stat_print("display", &display_stat);
+    stat_print("server", &server_stat);
+    stat_print("ack", &ack_stat);
+    printf("\nscan handling, from the frame at the main board to the LCD (ms)\n");
+    stat_print("handling", &handling_stat);
+    printf("\nswipes %u, missed %u, uploaded %u events in %u requests, %.2f events/s\n", swipes, missed,
+           esp.record_count, esp.requests, esp.record_count / swipe_s);
+    printf("decoder: %u interrupts, main: %u interrupts, %u EEPROM bytes written, link bytes %u (lost %u)\n",
+           decoder->interrupts, board->interrupts, sim_eeprom_writes, creader.bytes, creader.lost);
+    printf("LCD: %u commands, %u writes, %u sent while it was busy\n", lcd.commands, lcd.writes, lcd.overruns);
+    printf("CPU awake during the swipes: decoder %.1f%%, main %.1f%%\n",
+           100 - 100.0 * (decoder->sleep_cycles - slept[0]) / (decoder->cycles - cycles[0]),
+           100 - 100.0 * (board->sleep_cycles - slept[1]) / (board->cycles - cycles[1]));
+    printf("\ntask          runs  max_us  avg_us\n");
+    for (uint8_t task = 0; task < main_board_task_count(); task++) {
+        uint32_t max_us, average_us;
+        uint16_t runs;
+        main_board_task_stats(task, &max_us, &average_us, &runs);
+        printf("%4u    %10u %7u %7u\n", task, runs, max_us, average_us);
+    }
+    if (esp.stats_requests != 0) printf("\nlast of %u stats uploads:\n%s", esp.stats_requests, esp.stats);
+    printf("\nsimulated %.1f s in %.2f s (%.1fx real time)\n", ms(now) / 1000, host_s, ms(now) / 1000 / host_s);
+    return (missed == 0 && lcd.overruns == 0) ? 0 : 2;
+}
@@ -0,0 +1,187 @@
+/* PharmaTracker host simulator: virtual time, registers and scheduling of the boards */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "avr/eeprom.h"
+
+sim_board_t * sim_current;
+uint32_t sim_eeprom_writes;
+uint64_t sim_eeprom_ready_ns;
+
+static sim_board_t * boards[SIM_MAX_BOARDS];
+static uint8_t board_count;
+static ucontext_t scheduler;
+static uint64_t slice_end_ns;   // the board running yields once its clock gets there
+
+/************************************************************************/
+/* Clocks                                                               */
+/************************************************************************/
+uint64_t sim_board_ns(const sim_board_t * board) {
+    return board->cycles / board->hz * 1000000000ULL + board->cycles % board->hz * 1000000000ULL / board->hz;
+}
+uint64_t sim_ns_to_cycles(const sim_board_t * board, uint64_t ns) {
+    return ns / 1000000000ULL * board->hz + ns % 1000000000ULL * board->hz / 1000000000ULL;
+}
+
+static void commit(sim_board_t * board) { // the last register access is over, tell the models if it was a write
+    if (board->accessed < 0) return;
+    uint8_t reg = board->accessed;
+    board->accessed = -1;
+    if (board->reg[reg] != board->accessed_value || board->force_write) {
+        board->force_write = false;
+        if (board->written != NULL) board->written(board, reg, board->accessed_value);
+    }
+}
+void sim_tick(uint32_t cycles) {
+    sim_board_t * board = sim_current;
+    commit(board);
+    board->cycles += cycles;
+    board->step(board);
+    if (board->reg[SIM_SREG] & SIM_I) board->interrupt(board);
+    if (sim_board_ns(board) >= slice_end_ns) swapcontext(&board->context, &scheduler);
+}
+void sim_isr(sim_board_t * board, uint8_t vector, void (*isr)(void)) { // the flag was cleared by the caller
+    uint8_t outer = board->vector;
+    board->reg[SIM_SREG] &= ~SIM_I;
+    board->vector = vector;
+    board->cycles += SIM_ISR_CYCLES;
+    board->interrupts++;
+    isr();
+    commit(board);
+    board->vector = outer;
+    board->reg[SIM_SREG] |= SIM_I; // RETI
+}
+void sim_delay_ns(double ns) {
+    uint64_t cycles = sim_ns_to_cycles(sim_current, ns);
+    while (cycles > 0) { // interrupts keep running, as they do in the busy loop of _delay_ms
+        uint32_t step = (cycles > 64) ? 64 : cycles;
+        sim_tick(step);
+        cycles -= step;
+    }
+}
+void sim_sleep(uint8_t control, uint8_t idle) {
+    sim_board_t * board = sim_current;
+    if (!(control & idle)) return; // SE clear: SLEEP does nothing
+    if (control != idle || !(board->reg[SIM_SREG] & SIM_I)) {
+        fprintf(stderr, "%s: sleep mode not modelled, or nothing can wake it up (%.3f ms)\n", board->name,
+                sim_board_ns(board) / 1e6);
+        abort();
+    }
+    uint32_t interrupts = board->interrupts;
+    while (board->interrupts == interrupts) { // the clock runs on until an interrupt wakes the CPU
+        sim_tick(SIM_SLEEP_CYCLES);
+        board->sleep_cycles += SIM_SLEEP_CYCLES;
+    }
+}
+void sim_break(const char * file, int line) {
+    fprintf(stderr, "%s: ASSERT failed at %s:%d (%.3f ms)\n", sim_current->name, file, line,
+            sim_board_ns(sim_current) / 1e6);
+    abort();
+}
+
+/************************************************************************/
+/* Registers                                                            */
+/************************************************************************/
+volatile uint8_t * sim_register(uint8_t reg) {
+    sim_board_t * board = sim_current;
+    sim_tick(SIM_ACCESS_CYCLES); // interrupts run before the access, like between two instructions
+    if (board->access != NULL) board->access(board, reg);
+    board->accessed = reg;
+    board->accessed_value = board->reg[reg];
+    return &board->reg[reg];
+}
+volatile uint16_t * sim_register16(uint8_t reg) {
+    sim_tick(2 * SIM_ACCESS_CYCLES);
+    return &sim_current->reg16[reg];
+}
+
+/************************************************************************/
+/* EEPROM: the EEMEM variables are the EEPROM. Writes take as long as   */
+/* on the chip, reads only cost the access. The library functions wait  */
+/* for a write the firmware started through the registers, as avr-libc  */
+/* does, and for their own writes to be done.                           */
+/************************************************************************/
+extern uint8_t __start_sim_eeprom[] __attribute__((weak)), __stop_sim_eeprom[] __attribute__((weak)); // none on the decoder
+
+void sim_eeprom_erase(void) {
+    memset(__start_sim_eeprom, 0xFF, __stop_sim_eeprom - __start_sim_eeprom);
+}
+uint8_t * sim_eeprom_address(uint16_t eear) { // EEMEM pointers were cast to 16 bits
+    uint16_t offset = eear - (uint16_t)(uintptr_t) __start_sim_eeprom;
+    if (offset >= __stop_sim_eeprom - __start_sim_eeprom) {
+        fprintf(stderr, "%s: EEAR 0x%04X is outside the EEPROM\n", sim_current->name, eear);
+        abort();
+    }
+    return __start_sim_eeprom + offset;
+}
+static void eeprom_busy_wait(void) {
+    while (sim_board_ns(sim_current) < sim_eeprom_ready_ns) sim_tick(64);
+}
+uint8_t eeprom_read_byte(const uint8_t * address) {
+    eeprom_busy_wait();
+    sim_tick(4);
+    return *address;
+}
+void eeprom_update_byte(uint8_t * address, uint8_t value) {
+    eeprom_busy_wait();
+    sim_tick(4);
+    if (*address == value) return;
+    *address = value;
+    sim_eeprom_writes++;
+    sim_delay_ns(SIM_EEPROM_WRITE_NS);
+}
+void eeprom_read_block(void * destination, const void * source, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        ((uint8_t *) destination)[i] = eeprom_read_byte((const uint8_t *) source + i);
+    }
+}
+void eeprom_update_block(const void * source, void * destination, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        eeprom_update_byte((uint8_t *) destination + i, ((const uint8_t *) source)[i]);
+    }
+}
+
+/************************************************************************/
+/* Scheduling: the board furthest behind runs until it is               */
+/* SIM_QUANTUM_NS ahead of the next one.                                */
+/************************************************************************/
+static void board_entry(void) {
+    sim_current->main();
+    sim_current->halted = true;
+    fprintf(stderr, "%s: main() returned\n", sim_current->name);
+    for (;;) swapcontext(&sim_current->context, &scheduler);
+}
+void sim_add_board(sim_board_t * board) {
+    if (board_count == SIM_MAX_BOARDS) abort();
+    board->accessed = -1;
+    board->stack = malloc(SIM_STACK_SIZE);
+    getcontext(&board->context);
+    board->context.uc_stack.ss_sp = board->stack;
+    board->context.uc_stack.ss_size = SIM_STACK_SIZE;
+    board->context.uc_link = NULL;
+    makecontext(&board->context, board_entry, 0);
+    boards[board_count++] = board;
+}
+void sim_run(uint64_t until_ns) {
+    for (;;) {
+        sim_board_t * next = NULL;
+        uint64_t now = UINT64_MAX, after = UINT64_MAX;
+        for (uint8_t i = 0; i < board_count; i++) {
+            if (boards[i]->halted) continue;
+            uint64_t ns = sim_board_ns(boards[i]);
+            if (ns < now) {
+                after = now;
+                now = ns;
+                next = boards[i];
+            } else if (ns < after) {
+                after = ns;
+            }
+        }
+        if (next == NULL || now >= until_ns) return;
+        slice_end_ns = (after == UINT64_MAX) ? until_ns : after + SIM_QUANTUM_NS;
+        if (slice_end_ns > until_ns) slice_end_ns = until_ns;
+        sim_current = next;
+        swapcontext(&scheduler, &next->context);
+    }
+}
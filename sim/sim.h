@@ -0,0 +1,206 @@
+/* PharmaTracker host simulator */
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <ucontext.h>
+
+/************************************************************************/
+/* Both firmwares are compiled for the host unchanged: the shim headers */
+/* in this directory turn every I/O register into a call to             */
+/* sim_register, and _delay_ms/_delay_us into simulated time. Each      */
+/* board runs its own main() in a coroutine with its own virtual clock, */
+/* counted in CPU cycles. The clock is coarse, not cycle accurate: a    */
+/* register access costs SIM_ACCESS_CYCLES, a loop iteration            */
+/* SIM_LOOP_CYCLES, an interrupt SIM_ISR_CYCLES and a delay its length. */
+/* Idle sleep lets the clock run on until an interrupt wakes the CPU,   */
+/* and counts the cycles slept, which gives the CPU duty cycle.         */
+/* Whenever a board's clock moves, its peripherals are brought up to    */
+/* date and the pending interrupts run, exactly where the firmware      */
+/* would be interrupted on the chip. The boards take turns, none gets   */
+/* more than SIM_QUANTUM_NS ahead of the others, which bounds the skew  */
+/* of anything passing between them.                                    */
+/************************************************************************/
+#define SIM_ACCESS_CYCLES   1
+#define SIM_LOOP_CYCLES     4
+#define SIM_ISR_CYCLES      10      // vector, RETI and the register pushes/pops
+#define SIM_QUANTUM_NS      10000
+#define SIM_STACK_SIZE      (256 * 1024)
+#define SIM_MAX_BOARDS      4
+#define SIM_EEPROM_WRITE_NS 3400000 // erase + write of one byte
+#define SIM_SLEEP_CYCLES    4       // how often a sleeping CPU looks for an interrupt
+#define SIM_I               0x80    // global interrupt enable bit of SREG
+
+#define SIM_REGISTERS(REG) \
+    REG(PINA) REG(DDRA) REG(PORTA) REG(PINB) REG(DDRB) REG(PORTB) \
+    REG(TCCR0A) REG(TCCR0B) REG(TCNT0) REG(OCR0A) REG(TIMSK0) REG(TIFR0) \
+    REG(TCCR1A) REG(TCCR1B) REG(TIMSK1) REG(TIFR1) \
+    REG(TCCR2A) REG(TCCR2B) REG(TCNT2) REG(OCR2A) REG(TIMSK2) REG(TIFR2) \
+    REG(UBRR0H) REG(UBRR0L) REG(UCSR0A) REG(UCSR0B) REG(UCSR0C) REG(UDR0) \
+    REG(UBRR1H) REG(UBRR1L) REG(UCSR1A) REG(UCSR1B) REG(UCSR1C) REG(UDR1) \
+    REG(GIMSK) REG(GIFR) REG(PCMSK) REG(PCICR) REG(PCIFR) REG(PCMSK0) REG(PCMSK1) \
+    REG(MCUCR) REG(SMCR) REG(SREG) REG(EECR) REG(EEDR) \
+    REG(TCCR1) REG(TCNT1_8) REG(OCR1A_8) REG(TIMSK) REG(TIFR)   // ATtiny85: its Timer1 is 8-bit
+#define SIM_REGISTERS16(REG) REG(OCR1A) REG(TCNT1) REG(EEAR)
+#define SIM_ENUM(name)      SIM_##name,
+
+enum {SIM_REGISTERS(SIM_ENUM) SIM_REGISTER_COUNT};
+enum {SIM_REGISTERS16(SIM_ENUM) SIM_REGISTER16_COUNT};
+
+typedef struct sim_board sim_board_t;
+struct sim_board {
+    const char * name;
+    uint32_t hz;
+    void (*main)(void);                                 // the firmware
+    void (*step)(sim_board_t * board);                  // bring the peripherals up to the board's clock
+    bool (*interrupt)(sim_board_t * board);             // run the most urgent pending and enabled ISR, if any
+    void (*access)(sim_board_t * board, uint8_t reg);   // a register is about to be read or written, may be NULL
+    void (*written)(sim_board_t * board, uint8_t reg, uint8_t old); // a register was written, may be NULL
+    void * model;                                       // the board's peripherals
+    // owned by sim.c
+    uint64_t cycles;                                    // virtual clock
+    uint8_t reg[SIM_REGISTER_COUNT];
+    uint16_t reg16[SIM_REGISTER16_COUNT];
+    int16_t accessed;                                   // register accessed last, -1 once committed
+    uint8_t accessed_value;                             // its value before the access
+    bool force_write;                                   // the access hook says it is a write, even of the same value
+    uint8_t vector;                                     // vector # of the ISR running, 0: none
+    uint32_t interrupts;                                // # of ISRs run
+    uint64_t sleep_cycles;                              // cycles spent in SLEEP
+    bool halted;                                        // main() returned
+    ucontext_t context;
+    void * stack;
+};
+
+extern sim_board_t * sim_current;   // the board running
+
+void sim_add_board(sim_board_t * board);
+void sim_run(uint64_t until_ns);    // run every board until its clock reaches until_ns
+uint64_t sim_board_ns(const sim_board_t * board);
+uint64_t sim_ns_to_cycles(const sim_board_t * board, uint64_t ns);
+void sim_tick(uint32_t cycles);
+void sim_isr(sim_board_t * board, uint8_t vector, void (*isr)(void));
+void sim_delay_ns(double ns);
+void sim_sleep(uint8_t control, uint8_t idle); // control: the SE and SM bits, idle: their value for idle sleep
+void sim_break(const char * file, int line);
+volatile uint8_t * sim_register(uint8_t reg);
+volatile uint16_t * sim_register16(uint8_t reg);
+void sim_eeprom_erase(void);
+uint8_t * sim_eeprom_address(uint16_t eear); // the EEMEM byte an EEAR value points at
+
+extern uint32_t sim_eeprom_writes; // # of EEPROM bytes written
+extern uint64_t sim_eeprom_ready_ns; // the byte being written is done then (EEPE clears)
+
+/************************************************************************/
+/* Peripheral models (models.c)                                         */
+/************************************************************************/
+// a byte stream between two parts, each byte stamped with when it is complete
+#define SIM_LINK_SIZE       1024    // power of 2
+
+typedef struct {
+    uint8_t data[SIM_LINK_SIZE];
+    uint64_t ns[SIM_LINK_SIZE];
+    uint32_t head, tail;
+    uint32_t bytes;                 // # of bytes ever sent
+    uint32_t lost;                  // # of bytes dropped because the link was full
+    uint64_t last_ns;               // when the last byte was complete
+} sim_link_t;
+
+void sim_link_push(sim_link_t * link, uint8_t data, uint64_t ns);
+bool sim_link_ready(const sim_link_t * link, uint64_t ns); // a byte was complete at ns
+uint8_t sim_link_pop(sim_link_t * link);
+
+// an EM4100 tag in the field of the antenna between on_ns and off_ns: the demodulated envelope
+typedef struct {
+    uint64_t frame;                 // the 64 bits sent, first one in bit 63
+    uint32_t half_bit_ns;
+    uint64_t on_ns, off_ns;
+} sim_tag_t;
+
+uint64_t sim_em4100_frame(const uint8_t id[5]);
+bool sim_tag_level(const sim_tag_t * tag, uint64_t ns);
+
+// a UART receiver sampling a pin driven by software (the decoder's TX line)
+typedef struct {
+    uint32_t bit_ns;
+    bool level;                     // the pin, idles high
+    int8_t bit;                     // bit being received: -1 idle, 0..7 data, 8 stop
+    uint64_t sample_ns;             // when the next bit is sampled
+    uint8_t data;
+    uint32_t framing_errors;
+    sim_link_t * out;
+} sim_uart_rx_t;
+
+void sim_uart_rx_pin(sim_uart_rx_t * rx, bool level, uint64_t ns);
+void sim_uart_rx_poll(sim_uart_rx_t * rx, uint64_t ns);
+
+// HD44780 in 4-bit mode, as wired to the main board
+typedef struct {
+    char ddram[128];
+    uint8_t address;
+    bool four_bit;
+    bool low_nibble;                // the next nibble written is the low one
+    bool read_low;                  // the next nibble read is the low one
+    uint8_t high;
+    bool cursor;
+    uint64_t busy_until_ns;
+    bool rw_tied_low;               // wired as the first boards: every strobe writes
+    uint32_t commands, writes;
+    uint32_t overruns;              // instructions sent while it was still busy
+    uint64_t changed_ns;            // when the text last changed
+} sim_lcd_t;
+
+void sim_lcd_init(sim_lcd_t * lcd);
+void sim_lcd_strobe(sim_lcd_t * lcd, bool rs, bool rw, uint8_t nibble, uint64_t ns); // falling edge of E
+bool sim_lcd_busy(const sim_lcd_t * lcd, uint64_t ns);
+void sim_lcd_line(const sim_lcd_t * lcd, uint8_t line, char text[17]);
+
+// ESP8266 running the AT firmware, connected to an HTTP server that answers every request
+#define SIM_ESP_RECORDS     1024
+#define SIM_SERVER_CLOSE    0       // server: close the connection without an answer
+
+typedef struct {
+    char line[32];                  // a line of a POST /batch body
+    uint64_t received_ns;           // when the server got it
+    uint64_t answered_ns;           // when the answer to its request reached the main board
+} sim_esp_record_t;
+
+typedef struct {
+    sim_link_t out;                 // bytes to the main board
+    uint32_t byte_ns;               // time on the wire of one byte
+    uint32_t server_ns;             // round trip to the server
+    uint32_t connect_ns;
+    uint64_t associate_ns;          // from reset until the access point accepted it
+    uint64_t wifi_ns;               // associated to the access point from then on
+    bool connected;                 // TCP connection to the server open
+    char line[96];                  // command being received
+    uint8_t length;
+    uint16_t data_left;             // # of bytes of AT+CIPSEND data still to come
+    char request[1024];             // the data being sent
+    uint16_t request_size;
+    uint32_t requests, commands;
+    sim_esp_record_t records[SIM_ESP_RECORDS];
+    uint32_t record_count;
+    uint32_t unanswered;            // first record whose answer hasn't been sent
+    char stats[512];                // body of the last POST /stats
+    uint32_t stats_requests;
+    uint16_t (*server)(uint32_t request, uint64_t ns); // HTTP status of each answer, NULL: always 200
+    uint32_t failed, closed;        // requests answered with another status than 2xx, without an answer
+    uint32_t bad_lengths;           // requests whose Content-Length isn't the length of their body
+} sim_esp_t;
+
+void sim_esp_init(sim_esp_t * esp, uint32_t baud);
+void sim_esp_receive(sim_esp_t * esp, uint8_t data, uint64_t ns);
+
+/************************************************************************/
+/* The boards (decoder_board.c, main_board.c)                           */
+/************************************************************************/
+sim_board_t * decoder_board_create(const sim_tag_t * tag, sim_link_t * out);
+sim_board_t * main_board_create(sim_link_t * creader, sim_esp_t * esp, sim_lcd_t * lcd);
+void main_board_button(uint8_t pin, bool pressed);
+uint8_t main_board_task_count(void);
+void main_board_task_stats(uint8_t task, uint32_t * max_us, uint32_t * average_us, uint16_t * runs);
+
+#endif /* SIM_H_ */
@@ -0,0 +1,178 @@
+/* PharmaTracker host check: bursts of scans
+ *
+ * Build and run from the repository root:
+ *   make check
+ *   build/test_burst [scans per burst] [seed]
+ *
+ * Boots main.c on the simulated main board with BURST_CARDS registered
+ * cards, then sends it bursts of scans of different cards, binary frames
+ * back to back at the decoder's 2400 baud, as fast as the link carries
+ * them, faster than the EEPROM writer takes their records. After
+ * every burst it checks that the ring of scanned IDs never overflowed,
+ * that no byte or frame was lost, and that every card of the burst was
+ * checked out or in. At the end every scan has to reach the server, in
+ * the order sent, a frame corrupted on the link has to be counted as
+ * lost from the gap in the sequence numbers, and a heartbeat of a card
+ * must not check it in or out. No task may hold the scheduler waiting
+ * for the EEPROM writer or the TX ring to the ESP8266 meanwhile. Exits
+ * with status 1 on the first failure.
+ */
+#include "main_board.c"
+
+#define BURST_CARDS     24
+#define BURST           24      // scans per burst: every card, more than the journal stages
+#define BURSTS          8
+#define BYTE_NS         (10 * 1000000000ULL / 2400)    // start, 8 data bits and stop at the decoder's baud
+#define SETTLE_MS       2000    // after a burst, for the main loop to catch up and the LCD message to go
+#define UPLOAD_LIMIT_MS 60000
+#define TASK_LIMIT_US   10000   // longest run of any task: none waits for the EEPROM or the TX ring
+
+static uint64_t random_state;
+
+static uint32_t random_below(uint32_t n) { // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (random_state * 0x2545F4914F6CDD1DULL >> 32) % n;
+}
+
+static uint8_t crc8(uint8_t crc, uint8_t data) { // creader_crc8, which main_board.c compiled for the board only
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static uint64_t send_frame(sim_link_t * link, uint8_t mark, uint8_t card, uint8_t sequence, uint64_t ns) {
+    uint8_t frame[CREADER_BINARY_SIZE] = {mark | (sequence & 0x0F)};
+    memcpy(&frame[1], cards[card].id, CREADER_ID_SIZE);
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < CREADER_BINARY_SIZE - 1; i++) {
+        crc = crc8(crc, frame[i]);
+    }
+    frame[CREADER_BINARY_SIZE - 1] = crc;
+    for (uint8_t i = 0; i < CREADER_BINARY_SIZE; i++) {
+        ns += BYTE_NS;
+        sim_link_push(link, frame[i], ns);
+    }
+    return ns; // when it's sent
+}
+static uint64_t send_scan(sim_link_t * link, uint8_t card, uint8_t sequence, uint64_t ns) {
+    return send_frame(link, CREADER_BINARY_MARK, card, sequence, ns);
+}
+
+int main(int argc, char ** argv) {
+    uint32_t burst = (argc > 1) ? atoi(argv[1]) : BURST;
+    random_state = (argc > 2) ? strtoull(argv[2], NULL, 0) | 1 : 1;
+    if (burst == 0 || burst > BURST_CARDS) burst = BURST_CARDS;
+    static sim_link_t creader;
+    static sim_esp_t esp;
+    static sim_lcd_t lcd;
+    sim_lcd_init(&lcd);
+    sim_esp_init(&esp, 9600);
+    main_board_create(&creader, &esp, &lcd);
+    for (uint8_t card = 0; card < BURST_CARDS; card++) { // the erased EEPROM leaves these at boot
+        uint8_t id[CREADER_ID_SIZE] = {0xB5, 0x00, 0x00, card, 0x01};
+        memcpy(cards[card].id, id, CREADER_ID_SIZE);
+        cards[card].max_time = 59 * 60 + 59; // no alarm while the check runs
+        cards[card].status = CHECKED_IN;
+    }
+
+    static char expected[BURSTS * BURST_CARDS][2 * CREADER_ID_SIZE + 2]; // ID and action of every scan, in order
+    uint32_t scans = 0;
+    uint8_t sequence = 0;
+    uint64_t ns = 1000000000ULL; // booted
+    sim_run(ns);
+    uint8_t burst_cards[BURST_CARDS];
+    for (uint32_t round = 0; round < BURSTS; round++) {
+        if (!(round & 1)) { // different cards each time, checked out, then checked in by the next burst
+            bool taken[BURST_CARDS] = {false};
+            for (uint32_t i = 0; i < burst; i++) {
+                uint8_t card = random_below(BURST_CARDS);
+                while (taken[card]) card = (card + 1) % BURST_CARDS;
+                taken[card] = true;
+                burst_cards[i] = card;
+            }
+        }
+        for (uint32_t i = 0; i < burst; i++) { // in any order
+            uint32_t j = i + random_below(burst - i);
+            uint8_t card = burst_cards[j];
+            burst_cards[j] = burst_cards[i];
+            burst_cards[i] = card;
+            const uint8_t * id = cards[card].id;
+            snprintf(expected[scans++], sizeof(expected[0]), "%02X%02X%02X%02X%02X%c", id[0], id[1], id[2], id[3],
+                     id[4], (round & 1) ? 'i' : 'o');
+            ns = send_scan(&creader, card, sequence++, ns);
+        }
+        ns += SETTLE_MS * 1000000ULL;
+        sim_run(ns);
+        if (creader_buff.overflows != 0 || creader_buff.errors != 0 || main_board.usart0.overruns != 0
+            || creader.lost != 0 || isready_creader_buff()) {
+            fprintf(stderr, "burst %u of %u scans: %u overflows, %u bad frames, %u overruns, %u bytes lost%s\n",
+                    round + 1, burst, creader_buff.overflows, creader_buff.errors, main_board.usart0.overruns,
+                    creader.lost, isready_creader_buff() ? ", scans still queued" : "");
+            return 1;
+        }
+        uint32_t out = 0;
+        for (uint8_t card = 0; card < BURST_CARDS; card++) {
+            out += (cards[card].status == CHECKED_OUT);
+        }
+        for (uint32_t i = 0; i < burst; i++) {
+            card_status_t status = (round & 1) ? CHECKED_IN : CHECKED_OUT;
+            if (cards[burst_cards[i]].status != status || out != ((round & 1) ? 0 : burst)) {
+                fprintf(stderr, "burst %u: card %u isn't checked %s, %u cards are out\n", round + 1,
+                        burst_cards[i] + 1, (round & 1) ? "in" : "out", out);
+                return 1;
+            }
+        }
+    }
+
+    uint64_t limit = ns + UPLOAD_LIMIT_MS * 1000000ULL;
+    while (esp.record_count < scans + 1 && ns < limit) { // the boot event comes first
+        ns += 100000000ULL;
+        sim_run(ns);
+    }
+    for (uint32_t i = 0; i < scans; i++) {
+        const char * line = (i + 1 < esp.record_count) ? esp.records[i + 1].line + 2 : "none"; // after the boot
+        if (strncmp(line, expected[i], 2 * CREADER_ID_SIZE + 1) != 0) {
+            fprintf(stderr, "scan %u of %u: the server got %.11s, expected %.11s\n", i + 1, scans, line,
+                    expected[i]);
+            return 1;
+        }
+    }
+    if (stats.creader_lost != 0) {
+        fprintf(stderr, "%u frames counted as lost, none were\n", stats.creader_lost);
+        return 1;
+    }
+    ns = send_scan(&creader, 0, sequence++, ns);
+    creader.data[(creader.head - 2) & (SIM_LINK_SIZE - 1)] ^= 0x10; // a bit flipped on the link: its CRC fails
+    ns = send_scan(&creader, 1, sequence++, ns + 1000000000ULL);
+    sim_run(ns + SETTLE_MS * 1000000ULL);
+    if (stats.creader_lost != 1) {
+        fprintf(stderr, "a frame lost on the link was counted as %u\n", stats.creader_lost);
+        return 1;
+    }
+    card_status_t status = cards[1].status;
+    uint32_t records = esp.record_count;
+    ns = send_frame(&creader, CREADER_HEARTBEAT_MARK, 1, sequence++, ns + SETTLE_MS * 1000000ULL);
+    sim_run(ns + SETTLE_MS * 1000000ULL);
+    if (cards[1].status != status || esp.record_count != records || stats.creader_lost != 1) {
+        fprintf(stderr, "a heartbeat was taken as a scan, or counted as %u lost\n", stats.creader_lost - 1);
+        return 1;
+    }
+    uint32_t max_us[TASK_COUNT], average_us;
+    uint16_t runs;
+    for (uint8_t task = 0; task < TASK_COUNT; task++) {
+        main_board_task_stats(task, &max_us[task], &average_us, &runs);
+        if (max_us[task] > TASK_LIMIT_US) {
+            fprintf(stderr, "task %u ran for %.1f ms\n", task, max_us[task] / 1000.0);
+            return 1;
+        }
+    }
+    printf("bursts: %u bursts of %u scans at %.1f ms per frame, none dropped, all uploaded in order\n", BURSTS,
+           burst, CREADER_BINARY_SIZE * BYTE_NS / 1e6);
+    printf("        longest run of the card reader task %.1f ms, of the network task %.1f ms\n",
+           max_us[CARD_READER_TASK] / 1000.0, max_us[NETWORK_TASK] / 1000.0);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* PharmaTracker host check: button debouncing
+ *
+ * Build and run from the repository root:
+ *   make check
+ *   build/test_buttons [seed]
+ *
+ * Presses the buttons of the simulated main board the way mechanical
+ * contacts do: every press and every release chatters for a few
+ * milliseconds before the contact settles, and now and then a spike of
+ * a millisecond or two hits a button nobody touches. The tick ISR and
+ * the pin change interrupt of main.c debounce them, and the check wants
+ * exactly one event per press, of the right button, while it is held,
+ * and none for the spikes. Exits with status 1 on the first mismatch.
+ */
+#include "main_board.c"
+
+#define PRESSES         150
+#define BOUNCE_US       5000    // longest chatter of a contact
+#define EVENT_LOG_SIZE  16
+
+static uint64_t random_state;
+static struct {
+    button_t button;
+    uint32_t ms;
+} event_log[EVENT_LOG_SIZE];
+static uint32_t event_count;
+
+static uint32_t random_below(uint32_t n) { // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (random_state * 0x2545F4914F6CDD1DULL >> 32) % n;
+}
+
+static void buttons_main(void) { // runs on the board instead of main.c's main()
+    system_tick_init();
+    buttons_init();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sei();
+    for (;;) {
+        button_t button = probe_buttons();
+        if (button == NONE) { // the tick wakes it every millisecond
+            sleep_enable();
+            sleep_cpu();
+            sleep_disable();
+        } else if (event_count < EVENT_LOG_SIZE) {
+            event_log[event_count].button = button;
+            event_log[event_count++].ms = millis();
+        }
+    }
+}
+
+static uint64_t chatter(uint8_t pin, bool settled, uint64_t ns) { // returns when the contact settled
+    uint64_t end = ns + 1000ULL * random_below(BOUNCE_US);
+    bool level = settled;
+    while (ns < end) {
+        sim_run(ns);
+        main_board_button(pin, level);
+        level = !level;
+        ns += 1000ULL * (20 + random_below(800)); // 20 us to 0.8 ms between bounces
+    }
+    sim_run(end);
+    main_board_button(pin, settled);
+    return end;
+}
+
+int main(int argc, char ** argv) {
+    random_state = (argc > 1) ? strtoull(argv[1], NULL, 0) | 1 : 1;
+    static sim_link_t creader;
+    static sim_esp_t esp;
+    static sim_lcd_t lcd;
+    sim_esp_init(&esp, 9600);
+    sim_board_t * board = main_board_create(&creader, &esp, &lcd);
+    board->main = buttons_main;
+
+    uint64_t ns = 10000000;
+    uint32_t spikes = 0;
+    for (uint32_t press = 0; press < PRESSES; press++) {
+        uint8_t pin = random_below(BUTTON_COUNT);
+        button_t expected = button_pins[pin];
+        // short taps to holds just below the auto-repeat of UP and DOWN
+        uint32_t hold_ms = 2 * BUTTON_INTEGRATOR + random_below(BUTTON_REPEAT_DELAY - 4 * BUTTON_INTEGRATOR);
+        uint64_t pressed = chatter(pin, true, ns);
+        uint64_t released = chatter(pin, false, pressed + hold_ms * 1000000ULL);
+        ns = released + (3 * BUTTON_INTEGRATOR + random_below(300)) * 1000000ULL; // both settle before the next
+        if (random_below(4) == 0) { // a spike on some button halfway to the next press
+            uint8_t spiked = random_below(BUTTON_COUNT);
+            uint64_t at = (released + ns) / 2;
+            sim_run(at);
+            main_board_button(spiked, true);
+            sim_run(at + (1 + random_below(2)) * 1000000ULL);
+            main_board_button(spiked, false);
+            spikes++;
+        }
+        sim_run(ns);
+        uint32_t from_ms = pressed / 1000000, to_ms = released / 1000000 + 1; // the event comes while it is held
+        if (event_count != 1 || event_log[0].button != expected || event_log[0].ms < from_ms
+            || event_log[0].ms > to_ms) {
+            fprintf(stderr, "press %u of button %u, held %u ms from %u ms: %u events", press, expected, hold_ms,
+                    from_ms, event_count);
+            for (uint32_t i = 0; i < event_count && i < EVENT_LOG_SIZE; i++) {
+                fprintf(stderr, "%s button %u at %u ms", i ? "," : ":", event_log[i].button, event_log[i].ms);
+            }
+            fprintf(stderr, "\n");
+            return 1;
+        }
+        event_count = 0;
+    }
+    printf("buttons: %u bouncing presses and %u spikes, one event per press\n", PRESSES, spikes);
+    return 0;
+}
@@ -0,0 +1,126 @@
+/* PharmaTracker host check: the decoder's edge timestamps
+ *
+ * Build and run from the repository root:
+ *   make check
+ *   build/test_edges
+ *
+ * Boots decoder.c on the simulated decoder board in raw capture mode, so
+ * that every run length the edge ISR measures comes out on the UART, and
+ * holds tags at each data rate to the antenna in turn, with gaps of no
+ * signal in between: shorter than the 256 ticks of TCNT1, just longer,
+ * and several overflows long, one of them 10 ticks past a multiple of
+ * 256. Every run has to arrive, with the level of the signal, within a
+ * tick of its length, and the runs of 256 ticks or more have to saturate
+ * instead of wrapping into a plausible pulse. A level byte has to come
+ * at least every CAPTURE_LEVEL_RUNS runs, with the right level, so that
+ * a capture started at any time syncs, and the sync byte only at the
+ * start, since no run is lost. Exits with status 1 on the first failure.
+ */
+#define RAW_CAPTURE     true
+#include "decoder_board.c"
+
+#define TICK_NS         (1000000000ULL / TICK_HZ)
+#define CARRIER_NS      (1000000000ULL / CARRIER_HZ)
+#define FRAMES          3       // per tag
+#define MS              1000000ULL
+#define MAX_RUNS        4096
+
+static const struct {
+    uint8_t rf;                     // the tag's data rate
+    uint32_t gap_ticks;             // of no signal before it
+} tags[] = {{32, 200}, {40, 300}, {64, 600}, {32, 3 * 256 + 10}, {40, 5000}, {64, 100}};
+#define TAGS            (sizeof(tags) / sizeof(tags[0]))
+
+static sim_tag_t tag[TAGS];
+
+static bool signal_level(uint64_t ns) { // of the demodulated signal, one tag at a time
+    for (uint32_t i = 0; i < TAGS; i++) {
+        if (ns >= tag[i].on_ns && ns < tag[i].off_ns) return sim_tag_level(&tag[i], ns);
+    }
+    return false;
+}
+
+int main(void) {
+    static sim_link_t out;
+    uint8_t id[5] = {0x1D, 0x00, 0x5A, 0x7E, 0x42};
+    uint64_t ns = 2 * MS; // booted, and the first edge comes after a long idle
+    for (uint32_t i = 0; i < TAGS; i++) {
+        tag[i].frame = sim_em4100_frame(id);
+        tag[i].half_bit_ns = tags[i].rf * CARRIER_NS / 2;
+        tag[i].on_ns = ns + tags[i].gap_ticks * TICK_NS;
+        tag[i].off_ns = ns = tag[i].on_ns + FRAMES * 128 * tag[i].half_bit_ns;
+        id[4]++;
+    }
+    uint64_t end_ns = ns + 10 * MS;
+
+    static uint8_t expected_level[MAX_RUNS];
+    static uint32_t expected_ticks[MAX_RUNS];
+    uint32_t expected = 0;
+    bool level = false;
+    uint64_t edge_ns = 0;
+    for (ns = 0; ns < end_ns && expected < MAX_RUNS; ns += 1000) { // the tags' edges are on whole microseconds
+        if (signal_level(ns) == level) continue;
+        expected_level[expected] = level;
+        expected_ticks[expected++] = (ns - edge_ns + TICK_NS / 2) / TICK_NS;
+        edge_ns = ns;
+        level = !level;
+    }
+    expected_ticks[0] = 0xFFFF; // from boot
+
+    decoder_board_create(&tag[0], &out);
+    uint32_t runs = 0, syncs = 0, levels = 0, since_level = 0, saturated = 0;
+    level = false;
+    uint32_t current = 0;
+    for (ns = 0; ns < end_ns;) {
+        uint64_t next = ns + MS;
+        if (current < TAGS && next > tag[current].off_ns) next = tag[current].off_ns;
+        sim_run(next);
+        if (current < TAGS && next == tag[current].off_ns && ++current < TAGS) { // no signal until the next one
+            decoder_board.tag = &tag[current];
+        }
+        ns = next;
+        while (sim_link_ready(&out, ns)) {
+            uint8_t data = sim_link_pop(&out);
+            if (data >= CAPTURE_LEVEL) { // the level of the next run
+                if ((data & ~1) == CAPTURE_SYNC) {
+                    syncs++;
+                } else if (level != (data & 1)) {
+                    fprintf(stderr, "run %u: a level byte says %s, the run is %s\n", runs + 1,
+                            (data & 1) ? "high" : "low", level ? "high" : "low");
+                    return 1;
+                } else {
+                    levels++;
+                }
+                level = data & 1;
+                since_level = 0;
+                continue;
+            }
+            if (++since_level > CAPTURE_LEVEL_RUNS) {
+                fprintf(stderr, "run %u: %u runs without a level byte\n", runs + 1, since_level);
+                return 1;
+            }
+            if (runs == expected) {
+                fprintf(stderr, "run %u: a run of %u ticks more than the signal had\n", runs + 1, data);
+                return 1;
+            }
+            uint32_t want = expected_ticks[runs] < CAPTURE_LEVEL - 1 ? expected_ticks[runs] : CAPTURE_LEVEL - 1;
+            if (level != expected_level[runs] || data + 1 < want || data > want + 1) {
+                fprintf(stderr, "run %u of %u: %s for %u ticks, the signal was %s for %u\n", runs + 1, expected,
+                        level ? "high" : "low", data, expected_level[runs] ? "high" : "low",
+                        expected_ticks[runs]);
+                return 1;
+            }
+            saturated += (want == CAPTURE_LEVEL - 1);
+            runs++;
+            level = !level;
+        }
+    }
+    if (runs != expected || syncs != 1 || out.lost != 0 || decoder_board.tx.framing_errors != 0) {
+        fprintf(stderr, "%u of %u runs received, %u syncs, %u bytes lost, %u framing errors\n", runs, expected,
+                syncs, out.lost, decoder_board.tx.framing_errors);
+        return 1;
+    }
+    printf("edges: %u runs of %u tags at RF/32, RF/40 and RF/64 timed to a tick, %u gaps saturated, "
+           "a level byte every %u runs or less (%u)\n", runs, (unsigned) TAGS, saturated, CAPTURE_LEVEL_RUNS, levels);
+    return 0;
+}
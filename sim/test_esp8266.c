@@ -0,0 +1,105 @@
+/* PharmaTracker host check: the ESP8266 response matcher
+ *
+ * Build and run from the repository root:
+ *   make check
+ *   build/test_esp8266 [sim/fixtures/esp8266.txt]
+ *
+ * Plays the transcripts of the fixture to USART1 of the simulated main
+ * board, byte by byte at 9600 baud, and checks that the RX ISR of main.c
+ * queues exactly the expected events: every response the firmware waits
+ * for, and none for the lines that only look like one. Exits with status
+ * 1 on the first block that doesn't match.
+ */
+#include "main_board.c"
+
+#define EVENT_LOG_SIZE  64
+
+static const char * const event_names[] = { // indexed by response_t
+    "NONE", "ALREADY_CONNECTED", "CLOSED", "ERROR", "OK", "SEND_FAIL", "SEND_OK", "STATUS_2", "STATUS_3",
+    "STATUS_4", "STATUS_5", "LINK_INVALID", "READY", "PROMPT", "HTTP_OK",
+    "HTTP_REJECTED", "HTTP_ERROR",
+};
+_Static_assert(sizeof(event_names) / sizeof(event_names[0]) == RESPONSE_HTTP_ERROR + 1,
+               "every response needs a name in the fixtures");
+
+static response_t event_log[EVENT_LOG_SIZE];
+static uint32_t event_count;
+
+static void matcher_main(void) { // runs on the board instead of main.c's main()
+    UBRR1L = ESP8266_BAUD_REG_VAL;
+    UCSR1B = (1 << RXEN1) | (1 << RXCIE1);
+    ESP8266_matcher_init();
+    sei();
+    for (;;) {
+        sim_tick(SIM_LOOP_CYCLES); // the loop macros of main_board.c only cover main.c
+        response_t response = ESP8266_next_event();
+        if (response != RESPONSE_NONE && event_count < EVENT_LOG_SIZE) event_log[event_count++] = response;
+    }
+}
+
+static size_t unescape(const char * text, char * bytes) {
+    size_t n = 0;
+    for (; *text != 0 && *text != '\n'; text++) {
+        if (*text != '\\') {
+            bytes[n++] = *text;
+            continue;
+        }
+        switch (*++text) {
+            case 'r': bytes[n++] = '\r'; break;
+            case 'n': bytes[n++] = '\n'; break;
+            case 'x': bytes[n++] = strtol((char[]) {text[1], text[2], 0}, NULL, 16); text += 2; break;
+            default: bytes[n++] = *text; break;
+        }
+    }
+    return n;
+}
+
+int main(int argc, char ** argv) {
+    const char * path = (argc > 1) ? argv[1] : "sim/fixtures/esp8266.txt";
+    FILE * fixture = fopen(path, "r");
+    if (fixture == NULL) {
+        perror(path);
+        return 1;
+    }
+    static sim_link_t creader;
+    static sim_esp_t esp;
+    static sim_lcd_t lcd;
+    sim_esp_init(&esp, 9600);
+    sim_board_t * board = main_board_create(&creader, &esp, &lcd);
+    board->main = matcher_main;
+
+    uint64_t now = 0;
+    uint32_t line_number = 0, blocks = 0, checked = 0;
+    char line[512], bytes[512];
+    while (fgets(line, sizeof(line), fixture) != NULL) {
+        line_number++;
+        if (line[0] == '<') {
+            size_t n = unescape(line + 2, bytes);
+            for (size_t i = 0; i < n; i++) {
+                now += esp.byte_ns;
+                sim_link_push(&esp.out, bytes[i], now);
+            }
+            continue;
+        }
+        if (line[0] != '=') continue; // comments and blank lines
+        now += 10 * esp.byte_ns; // the last byte is handled
+        sim_run(now);
+        char expected[512] = "", got[512] = "";
+        for (char * name = strtok(line + 1, " \n"); name != NULL; name = strtok(NULL, " \n")) {
+            snprintf(expected + strlen(expected), sizeof(expected) - strlen(expected), " %s", name);
+        }
+        for (uint32_t i = checked; i < event_count; i++) {
+            snprintf(got + strlen(got), sizeof(got) - strlen(got), " %s", event_names[event_log[i]]);
+        }
+        checked = event_count;
+        blocks++;
+        if (strcmp(expected, got) != 0 || ESP8266.lost != 0) {
+            fprintf(stderr, "%s:%u: expected [%s ], got [%s ], %u events lost\n", path, line_number, expected, got,
+                    ESP8266.lost);
+            return 1;
+        }
+    }
+    fclose(fixture);
+    printf("esp8266 matcher: %u blocks, %u events, all as expected\n", blocks, checked);
+    return 0;
+}
@@ -0,0 +1,144 @@
+/* PharmaTracker host check: the deadline heap of main.c
+ *
+ * Build and run from the repository root:
+ *   make check
+ *   build/test_heap [seed]
+ *
+ * Runs random checkouts, check ins and deadline changes (deadline_add,
+ * deadline_remove, and the remove and add of a changed max time) on the
+ * simulated main board, with deadlines around the wrap of the 16-bit
+ * checkout clock, and after every step checks the heap against a plain
+ * list of the checked out cards: the min-heap order, heap_index, and
+ * the count. Then pops every card the way check_alarm does, expecting
+ * them earliest first, and does the same after saving the cards to the
+ * EEPROM through the EEPROM writer, forgetting them, and rebuilding the
+ * heap with card_restore. Exits with status 1 on the first failure.
+ */
+#include "main_board.c"
+
+#define STEPS           20000
+#define RESTORES        20
+#define MAX_TIME        (59 * 60 + 59) // the longest the max time screen takes
+
+static uint64_t random_state;
+static bool done;
+static int status;
+
+static uint32_t random_below(uint32_t n) { // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (random_state * 0x2545F4914F6CDD1DULL >> 32) % n;
+}
+
+static void check_fail(const char * what, uint32_t step) {
+    fprintf(stderr, "step %u: %s (%u cards in the heap)\n", step, what, deadline_count);
+    status = 1;
+}
+
+static bool check_heap(const bool * out, uint32_t step) { // out: which cards are checked out
+    uint8_t count = 0;
+    for (uint8_t card = 0; card < CARD_COUNT; card++) {
+        if (!out[card]) continue;
+        count++;
+        if (heap_index[card] >= deadline_count || deadline_heap[heap_index[card]] != card) {
+            check_fail("heap_index doesn't point back at the card", step);
+            return false;
+        }
+    }
+    if (count != deadline_count) {
+        check_fail("the heap doesn't hold the cards checked out", step);
+        return false;
+    }
+    for (uint8_t position = 1; position < deadline_count; position++) {
+        if (is_earlier(deadline_heap[position], deadline_heap[(position - 1) >> 1])) {
+            check_fail("a card is earlier than its parent", step);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool check_pops(bool * out, uint16_t now, uint32_t step) { // empties the heap as check_alarm does
+    int32_t last = INT32_MIN; // overdue cards are left with less than 0
+    while (deadline_count > 0) {
+        uint8_t card = deadline_heap[0];
+        int32_t left = (int16_t)(cards[card].deadline - now); // deadlines are within 59:59 of now
+        if (!out[card] || left < last) {
+            check_fail(out[card] ? "cards don't come out earliest first" : "a card came out twice", step);
+            return false;
+        }
+        last = left;
+        out[card] = false;
+        deadline_remove(card);
+        if (!check_heap(out, step)) return false;
+    }
+    for (uint8_t card = 0; card < CARD_COUNT; card++) {
+        if (out[card]) {
+            check_fail("a card never came out", step);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void heap_main(void) { // runs on the board instead of main.c's main()
+    static bool out[CARD_COUNT];
+    uint32_t step = 0;
+    sei(); // for the EEPROM writer
+    for (uint8_t round = 0; round < RESTORES && status == 0; round++) {
+        // a clock anywhere, near its wrap in half of the rounds
+        checkout_seconds = (round & 1) ? 0xFFFF - random_below(2 * MAX_TIME) : random_below(0x10000);
+        for (uint32_t i = 0; i < STEPS / RESTORES && status == 0; i++, step++) {
+            uint8_t card = random_below(CARD_COUNT);
+            if (random_below(8) == 0) checkout_seconds += random_below(60); // time goes by
+            if (!out[card]) { // checked out
+                cards[card].max_time = 1 + random_below(MAX_TIME);
+                deadline_add(card);
+                out[card] = true;
+            } else if (random_below(3) == 0) { // its max time changed, as the max time screen does it
+                cards[card].max_time = 1 + random_below(MAX_TIME);
+                deadline_remove(card);
+                deadline_add(card);
+            } else { // checked in
+                deadline_remove(card);
+                out[card] = false;
+            }
+            check_heap(out, step);
+        }
+        // the snapshot brings back the same heap
+        for (uint8_t card = 0; card < CARD_COUNT && status == 0; card++) {
+            cards[card].status = out[card] ? CHECKED_OUT : CHECKED_IN;
+            card_save(card);
+        }
+        while (eeprom_ready() || !eeprom_idle()) {
+            if (eeprom_ready()) eeprom_task();
+            sim_tick(SIM_LOOP_CYCLES);
+        }
+        for (uint8_t card = 0; card < CARD_COUNT; card++) { // only the EEPROM has them now
+            cards[card].status = CHECKED_IN;
+            cards[card].deadline = 0;
+        }
+        deadline_count = 0;
+        card_restore();
+        if (status == 0 && check_heap(out, step)) check_pops(out, checkout_clock(), step);
+    }
+    if (status == 0) printf("deadline heap: %u steps and %u restores, always in order\n", step, RESTORES);
+    done = true;
+    for (;;) sim_tick(SIM_LOOP_CYCLES);
+}
+
+int main(int argc, char ** argv) {
+    random_state = (argc > 1) ? strtoull(argv[1], NULL, 0) | 1 : 1;
+    static sim_link_t creader;
+    static sim_esp_t esp;
+    static sim_lcd_t lcd;
+    sim_esp_init(&esp, 9600);
+    sim_board_t * board = main_board_create(&creader, &esp, &lcd);
+    board->main = heap_main;
+    for (uint64_t now = 0; !done; ) {
+        now += 1000000000;
+        sim_run(now);
+    }
+    return status;
+}
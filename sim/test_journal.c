@@ -0,0 +1,146 @@
+/* PharmaTracker host check: the event journal while offline
+ *
+ * Build and run from the repository root:
+ *   make check
+ *   build/test_journal
+ *
+ * Boots main.c on the simulated main board with the WiFi down and scans
+ * cards until the journal is full: the boot event and JOURNAL_SIZE - 2
+ * scans have to fit, the next scan is dropped. Once the WiFi is up all of
+ * them have to reach the server, in order. Then the server answers 503
+ * for a while, as more scans come in, so the journal wraps around while
+ * the records go out late and their sent marks lag behind the EEPROM
+ * writer; those have to arrive in order as well. At the end every record
+ * in the EEPROM has to be intact and marked as sent. Exits with status 1
+ * on the first failure.
+ */
+#include "main_board.c"
+
+#define CARDS           ((JOURNAL_SIZE + 1) / 2)    // each one scanned out and in
+#define SCAN_PERIOD_MS  300
+#define WIFI_DOWN_MS    (JOURNAL_SIZE * SCAN_PERIOD_MS + 5000)
+#define SECOND_LAP      (JOURNAL_SIZE - 6)          // scans while the server fails
+#define UPLOAD_LIMIT_MS 120000
+#define BYTE_NS         (10 * 1000000000ULL / 2400)
+#define MS              1000000ULL
+
+static char expected[2 * JOURNAL_SIZE][2 * CREADER_ID_SIZE + 2]; // ID and action of every scan kept, in order
+static uint32_t scans;
+static bool server_down;
+
+static uint8_t crc8(uint8_t crc, uint8_t data) { // creader_crc8, which main_board.c compiled for the board only
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static uint64_t send_scan(sim_link_t * link, uint8_t card, bool keep, uint64_t ns) {
+    static uint8_t sequence;
+    const uint8_t * id = cards[card].id;
+    uint8_t frame[CREADER_BINARY_SIZE] = {CREADER_BINARY_MARK | (sequence++ & 0x0F)};
+    memcpy(&frame[1], id, CREADER_ID_SIZE);
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < CREADER_BINARY_SIZE - 1; i++) {
+        crc = crc8(crc, frame[i]);
+    }
+    frame[CREADER_BINARY_SIZE - 1] = crc;
+    if (keep) {
+        snprintf(expected[scans++], sizeof(expected[0]), "%02X%02X%02X%02X%02X%c", id[0], id[1], id[2], id[3],
+                 id[4], (cards[card].status == CHECKED_IN) ? 'o' : 'i');
+    }
+    for (uint8_t i = 0; i < CREADER_BINARY_SIZE; i++) {
+        ns += BYTE_NS;
+        sim_link_push(link, frame[i], ns);
+    }
+    ns += SCAN_PERIOD_MS * MS;
+    sim_run(ns);
+    return ns;
+}
+
+static uint16_t server(uint32_t request, uint64_t ns) {
+    return server_down ? 503 : 200;
+}
+
+static bool wait_uploads(sim_esp_t * esp, uint64_t * ns, uint32_t from) { // the scans from from on, after the boot
+    uint64_t limit = *ns + UPLOAD_LIMIT_MS * MS;
+    while (esp->record_count < scans + 1 && *ns < limit) {
+        *ns += 100 * MS;
+        sim_run(*ns);
+    }
+    for (uint32_t i = from; i < scans; i++) {
+        const char * line = (i + 1 < esp->record_count) ? esp->records[i + 1].line + 2 : "none";
+        if (strncmp(line, expected[i], 2 * CREADER_ID_SIZE + 1) != 0) {
+            fprintf(stderr, "scan %u of %u: the server got %.11s, expected %.11s\n", i + 1, scans, line,
+                    expected[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    static sim_link_t creader;
+    static sim_esp_t esp;
+    static sim_lcd_t lcd;
+    sim_lcd_init(&lcd);
+    sim_esp_init(&esp, 9600);
+    esp.associate_ns = WIFI_DOWN_MS * MS;
+    esp.server = server;
+    main_board_create(&creader, &esp, &lcd);
+    for (uint8_t card = 0; card < CARDS; card++) { // the erased EEPROM leaves these at boot
+        uint8_t id[CREADER_ID_SIZE] = {0x7E, 0x00, 0x00, card, 0x03};
+        memcpy(cards[card].id, id, CREADER_ID_SIZE);
+        cards[card].max_time = 59 * 60 + 59; // no alarm while the check runs
+        cards[card].status = CHECKED_IN;
+    }
+
+    uint64_t ns = 1000 * MS; // booted, the boot event journaled
+    sim_run(ns);
+    for (uint32_t i = 0; i < JOURNAL_SIZE - 2; i++) { // what the journal holds next to the boot event
+        ns = send_scan(&creader, i % CARDS, true, ns);
+    }
+    if (upload.dropped != 0) {
+        fprintf(stderr, "%u of %u scans dropped while offline\n", upload.dropped, JOURNAL_SIZE - 2);
+        return 1;
+    }
+    ns = send_scan(&creader, (JOURNAL_SIZE - 2) % CARDS, false, ns);
+    if (upload.dropped != 1) {
+        fprintf(stderr, "the journal took %u scans, it holds %u\n", JOURNAL_SIZE - 1 - upload.dropped,
+                JOURNAL_SIZE - 2);
+        return 1;
+    }
+    if (!wait_uploads(&esp, &ns, 0)) return 1;
+    uint32_t first_lap = scans;
+
+    server_down = true;
+    for (uint32_t i = 0; i < SECOND_LAP; i++) {
+        if (i == SECOND_LAP / 2) server_down = false;
+        ns = send_scan(&creader, i % CARDS, true, ns);
+    }
+    if (!wait_uploads(&esp, &ns, first_lap)) return 1;
+    ns += 5000 * MS; // the last answers, and the writer catching up
+    sim_run(ns);
+
+    uint32_t sent = 0;
+    for (uint8_t slot = 0; slot < JOURNAL_SIZE; slot++) {
+        journal_record_t * record = &journal_eeprom[slot];
+        uint8_t crc = 0, * bytes = (uint8_t *) record;
+        for (uint8_t i = 0; i < offsetof(journal_record_t, crc); i++) {
+            if (i != offsetof(journal_record_t, state)) crc = crc8(crc, bytes[i]);
+        }
+        if (record->crc != crc || record->state != JOURNAL_SENT) {
+            fprintf(stderr, "journal slot %u: %s\n", slot, (record->crc != crc) ? "bad CRC" : "not marked as sent");
+            return 1;
+        }
+        sent++;
+    }
+    if (upload.dropped != 1) {
+        fprintf(stderr, "%u scans dropped in the second lap\n", upload.dropped - 1);
+        return 1;
+    }
+    printf("journal: %u scans offline and %u through a failing server, all uploaded in order, %u records in "
+           "the EEPROM marked as sent\n", first_lap, scans - first_lap, sent);
+    return 0;
+}
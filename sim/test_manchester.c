@@ -0,0 +1,234 @@
+/* PharmaTracker host check: the EM4100 Manchester decode engine
+ *
+ * Build and run from the repository root:
+ *   make check
+ *   build/test_manchester
+ *
+ * Feeds manchester.c known tags at every data rate of the decoder, in
+ * both decode modes and through every entry point (runs as the pin
+ * change ISR feeds them, samples, packed words), and checks that exactly
+ * the IDs sent come out: no frame is missed once the decoder is in sync,
+ * and nothing is decoded from corrupted frames or from no tag at all.
+ * Then times the run and packed paths on a long clean trace and prints
+ * samples/s and frames/s. Exits with status 1 on the first failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "../manchester.h"
+
+#define FRAMES          6       // frame periods sent per check
+#define BENCH_FRAMES    20000   // frame periods of the timed trace
+#define TAIL            (5 * 64)    // samples after the tag left the field
+#define MAX_SAMPLES     (BENCH_FRAMES * 64 * 2 * 64 + TAIL)
+
+static const uint8_t data_rates[] = {32, 40, 64};  // DATA_RATES in decoder.c: a half bit lasts rf ticks
+#define RATE_COUNT      (sizeof(data_rates) / sizeof(data_rates[0]))
+
+static const uint8_t tags[][MANCHESTER_ID_SIZE] = {
+    {0x31, 0x00, 0x37, 0xD9, 0x3D},     // the cards of sim/scenario.c
+    {0x66, 0x00, 0x6C, 0x4B, 0x7F},
+    {0x01, 0x23, 0x45, 0x67, 0x89},
+    {0xFF, 0xFF, 0xFF, 0xFF, 0xFF},     // as many 1's as a frame can carry outside the header
+    {0x00, 0x00, 0x00, 0x00, 0x01},
+    {0x84, 0x21, 0x08, 0x42, 0x10},
+};
+#define TAG_COUNT       (sizeof(tags) / sizeof(tags[0]))
+
+static manchester_rate_t rates[RATE_COUNT];
+static uint8_t * samples;
+static uint64_t * words;
+static uint32_t checks;
+
+/************************************************************************/
+/* 9 header 1's, 10 rows of 4 data bits and their even parity, 4 even   */
+/* column parities and a 0 stop bit, sent from bit 63 down.             */
+/************************************************************************/
+static uint64_t em4100_frame(const uint8_t id[MANCHESTER_ID_SIZE]) {
+    uint64_t frame = 0x1FF;
+    uint8_t columns = 0;
+    for (uint8_t row = 0; row < 10; row++) {
+        uint8_t nibble = (row & 1) ? id[row >> 1] & 0x0F : id[row >> 1] >> 4;
+        columns ^= nibble;
+        frame = (frame << 5) | (nibble << 1) | __builtin_parity(nibble);
+    }
+    return (frame << 5) | (columns << 1);
+}
+
+/************************************************************************/
+/* A tag from bit first of its frame to the end of frame # frames, one  */
+/* sample per tick: a 1 is low then high, a 0 high then low. The tag leaves    */
+/* the field with a steady level longer than any pulse, and a word of   */
+/* the other one, which end the last runs. Returns the # of samples,    */
+/* which are also packed 64 per word, oldest in bit 0.                  */
+/************************************************************************/
+static size_t synthesize(uint64_t frame, uint8_t half_bit, unsigned first, unsigned frames) {
+    size_t n = 0;
+    bool level = 0;
+    for (unsigned bit = first; bit < 64 * frames; bit++) {
+        level = (frame >> (63 - bit % 64)) & 1;
+        memset(samples + n, !level, half_bit);
+        memset(samples + n + half_bit, level, half_bit);
+        n += 2 * half_bit;
+    }
+    memset(samples + n, !level, TAIL - 64);
+    memset(samples + n + TAIL - 64, level, 64);
+    n += TAIL;
+    memset(words, 0, (n + 63) / 64 * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) words[i / 64] |= (uint64_t)samples[i] << (i % 64);
+    return n;
+}
+
+static void init(manchester_t * m, bool adaptive, uint8_t rate) {
+    if (adaptive) manchester_init_adaptive(m, rates, RATE_COUNT);
+    else manchester_init(m, rates[rate].threshold);
+}
+
+static void fail(const char * what, bool adaptive, uint8_t rate, size_t tag, size_t got, size_t expected) {
+    fprintf(stderr, "%s, %s decoder, RF/%u, tag %zu: %zu frames, expected %zu\n", what,
+            adaptive ? "adaptive" : "fixed", data_rates[rate], tag, got, expected);
+    exit(1);
+}
+
+/************************************************************************/
+/* Decodes n samples through the three entry points, and checks they    */
+/* agree with each other and with the ID expected (NULL: none at all).  */
+/* Returns the # of frames decoded.                                     */
+/************************************************************************/
+static size_t decode_all(size_t n, bool adaptive, uint8_t rate, size_t tag, const uint8_t * id) {
+    static manchester_frame_t frames[3][64];
+    size_t counts[3] = {0, 0, 0};
+    manchester_t m;
+    init(&m, adaptive, rate);
+    uint8_t level = samples[0];
+    uint16_t length = 0;
+    for (size_t i = 0; i < n; i++) { // runs, as the pin change ISR measures them
+        if (samples[i] == level) {
+            length++;
+            continue;
+        }
+        if (manchester_feed_run(&m, level, length, &frames[0][counts[0]]) && counts[0] < 63) counts[0]++;
+        level = samples[i];
+        length = 1;
+    }
+    init(&m, adaptive, rate);
+    manchester_decode_samples(&m, samples, n, frames[1], 64, &counts[1]);
+    init(&m, adaptive, rate);
+    manchester_decode_packed(&m, words, n / 64, frames[2], 64, &counts[2]);
+    for (uint8_t path = 1; path < 3; path++) {
+        if (counts[path] != counts[0] || memcmp(frames[path], frames[0], counts[0] * sizeof(frames[0][0])) != 0) {
+            fail(path == 1 ? "samples and runs disagree" : "packed words and runs disagree", adaptive, rate, tag,
+                 counts[path], counts[0]);
+        }
+    }
+    for (size_t i = 0; i < counts[0]; i++) {
+        if (id == NULL || memcmp(frames[0][i].id, id, MANCHESTER_ID_SIZE) != 0) {
+            fail("wrong ID decoded", adaptive, rate, tag, counts[0], id == NULL ? 0 : FRAMES);
+        }
+    }
+    checks++;
+    return counts[0];
+}
+
+static double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(void) {
+    for (uint8_t i = 0; i < RATE_COUNT; i++) {
+        manchester_rate_t rate = MANCHESTER_RATE(data_rates[i]);
+        rates[i] = rate;
+    }
+    samples = malloc(MAX_SAMPLES);
+    words = malloc(MAX_SAMPLES / 64 * sizeof(uint64_t) + sizeof(uint64_t));
+    if (samples == NULL || words == NULL) return 1;
+
+    for (uint8_t rate = 0; rate < RATE_COUNT; rate++) {
+        for (uint8_t adaptive = 0; adaptive < 2; adaptive++) {
+            for (size_t tag = 0; tag < TAG_COUNT; tag++) {
+                uint64_t frame = em4100_frame(tags[tag]);
+                for (unsigned first = 0; first < 64; first += 7) { // the tag enters the field at any bit
+                    size_t n = synthesize(frame, data_rates[rate], first, FRAMES);
+                    // every frame after the first one: both modes synchronize on a long pulse, which
+                    // the trace doesn't start with, and the adaptive one also needs it ahead of a header
+                    size_t got = decode_all(n, adaptive, rate, tag, tags[tag]);
+                    size_t expected = FRAMES - 1;
+                    if (got != expected) fail("frames missed", adaptive, rate, tag, got, expected);
+                }
+                // the adaptive mode bridges a one sample glitch in every few half bits
+                if (adaptive) {
+                    size_t n = synthesize(frame, data_rates[rate], 0, FRAMES);
+                    for (size_t i = data_rates[rate] / 2; i < n - TAIL; i += 3 * data_rates[rate] + 1) {
+                        samples[i] ^= 1;
+                        words[i / 64] ^= 1ULL << (i % 64);
+                    }
+                    size_t got = decode_all(n, adaptive, rate, tag, tags[tag]);
+                    if (got != FRAMES - 1) fail("frames missed with glitches", adaptive, rate, tag, got, FRAMES - 1);
+                }
+                // a bit flipped in every frame: each window fails a parity check, nothing comes out
+                for (unsigned bit = 1; bit < 55; bit += 9) {
+                    size_t n = synthesize(frame ^ (1ULL << bit), data_rates[rate], 0, FRAMES);
+                    decode_all(n, adaptive, rate, tag, NULL);
+                }
+            }
+            // a header followed by zeros, which passes the parity checks but is no ID
+            size_t n = synthesize(0x1FFULL << 55, data_rates[rate], 0, FRAMES);
+            decode_all(n, adaptive, rate, TAG_COUNT, NULL);
+            // no tag: a steady level, then a plain square wave at the half bit rate (all 1's, no frame)
+            memset(samples, 0, 64 * 2 * data_rates[rate]);
+            memset(words, 0, 2 * data_rates[rate] * sizeof(uint64_t));
+            decode_all(64 * 2 * data_rates[rate], adaptive, rate, TAG_COUNT, NULL);
+            n = synthesize(~0ULL, data_rates[rate], 0, FRAMES);
+            decode_all(n, adaptive, rate, TAG_COUNT, NULL);
+        }
+    }
+    printf("manchester: %u decodes checked, every ID as expected\n", checks);
+
+    // throughput on a long clean trace of the first tag at RF/64, as the firmware and rftrace see it
+    size_t n = synthesize(em4100_frame(tags[0]), 64, 0, BENCH_FRAMES);
+    uint16_t * lengths = malloc(n * sizeof(uint16_t)); // the runs, as the pin change ISR measures them
+    if (lengths == NULL) return 1;
+    size_t runs = 0;
+    for (size_t i = 0, start = 0; i < n; i++) {
+        if (i + 1 == n || samples[i + 1] != samples[i]) {
+            lengths[runs++] = i + 1 - start;
+            start = i + 1;
+        }
+    }
+    runs--; // the last one never ends
+    for (uint8_t adaptive = 0; adaptive < 2; adaptive++) {
+        manchester_t m;
+        manchester_frame_t frame;
+        size_t frames = 0, found;
+        init(&m, adaptive, 2);
+        double start = now_seconds();
+        for (size_t done = 0; done < n / 64; ) {
+            done += manchester_decode_packed(&m, words + done, n / 64 - done, &frame, 1, &found);
+            frames += found;
+        }
+        double packed = now_seconds() - start;
+        size_t packed_frames = frames;
+        frames = 0;
+        init(&m, adaptive, 2);
+        start = now_seconds();
+        for (size_t i = 0; i < runs; i++) {
+            frames += manchester_feed_run(&m, (samples[0] + i) & 1, lengths[i], &frame);
+        }
+        double run = now_seconds() - start;
+        if (packed_frames != frames || frames < BENCH_FRAMES - 1) {
+            fail("frames missed in the timed trace", adaptive, 2, 0, frames, BENCH_FRAMES - 1);
+        }
+        printf("%-8s packed: %6.1f Msamples/s %8.0f frames/s   runs: %6.1f Mruns/s %8.0f frames/s\n",
+               adaptive ? "adaptive" : "fixed", n / packed / 1e6, packed_frames / packed, runs / run / 1e6,
+               frames / run);
+    }
+    free(lengths);
+    free(samples);
+    free(words);
+    return 0;
+}
@@ -0,0 +1,190 @@
+/* PharmaTracker host check: uploads through a failing server
+ *
+ * Build and run from the repository root:
+ *   make check
+ *   build/test_uploads [seed]
+ *
+ * Boots main.c on the simulated main board and scans a card every
+ * SCAN_PERIOD_MS: every card out, then every card back in. The ESP8266
+ * model plays the server. For the check outs it answers every request
+ * with 200. For the check ins it answers some with 500, 503 or 429, and
+ * closes the connection on others without an answer, and from the first
+ * check in on it is down for OUTAGE_MS, answering everything with 503.
+ *
+ * Every scan has to reach the server in the end, and nothing else may,
+ * and every request has to give the length of its body. While the
+ * server is down the upload has to back off rather than retry at a
+ * fixed rate. Prints, for both halves, the latency from the end of the
+ * scan's frame to the server and to the answer at the main board, and
+ * how many requests went wrong. Exits with status 1 on the first
+ * failure.
+ */
+#include "main_board.c"
+
+#define CARDS               24
+#define SCANS               (2 * CARDS)
+#define SCAN_PERIOD_MS      500
+#define FAILURES            6       // 1 in FAILURES requests of the second half gets 500, 503 or 429
+#define CLOSES              10      // 1 in CLOSES is closed without an answer
+#define OUTAGE_MS           20000   // from the first check in on
+#define OUTAGE_REQUESTS     10      // most requests while the server is down: 0, 1, 3, 7 and 15 s in, 2 at a time
+#define UPLOAD_LIMIT_MS     120000
+#define BYTE_NS             (10 * 1000000000ULL / 2400)
+#define MS                  1000000ULL
+
+typedef struct {
+    char line[2 * CREADER_ID_SIZE + 2];     // ID and action, as in a batch line
+    uint64_t sent_ns;                       // the end of its frame
+    uint64_t received_ns, answered_ns;      // the first time the server got it, answered it
+    uint32_t copies;
+} scan_t;
+
+static uint64_t random_state;
+static scan_t scans[SCANS];
+static uint64_t outage_ns = UINT64_MAX;
+static uint32_t outage_requests;
+static bool faults;
+
+static uint32_t random_below(uint32_t n) { // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (random_state * 0x2545F4914F6CDD1DULL >> 32) % n;
+}
+
+static uint8_t crc8(uint8_t crc, uint8_t data) { // creader_crc8, which main_board.c compiled for the board only
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static uint64_t send_scan(sim_link_t * link, const uint8_t * id, uint8_t sequence, uint64_t ns) {
+    uint8_t frame[CREADER_BINARY_SIZE] = {CREADER_BINARY_MARK | (sequence & 0x0F)};
+    memcpy(&frame[1], id, CREADER_ID_SIZE);
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < CREADER_BINARY_SIZE - 1; i++) {
+        crc = crc8(crc, frame[i]);
+    }
+    frame[CREADER_BINARY_SIZE - 1] = crc;
+    for (uint8_t i = 0; i < CREADER_BINARY_SIZE; i++) {
+        ns += BYTE_NS;
+        sim_link_push(link, frame[i], ns);
+    }
+    return ns;
+}
+
+static uint16_t server(uint32_t request, uint64_t ns) {
+    static const uint16_t errors[] = {500, 503, 429};
+    if (ns >= outage_ns && ns < outage_ns + OUTAGE_MS * MS) {
+        outage_requests++;
+        return 503;
+    }
+    if (!faults) return 200;
+    if (random_below(CLOSES) == 0) return SIM_SERVER_CLOSE;
+    if (random_below(FAILURES) == 0) return errors[random_below(3)];
+    return 200;
+}
+
+static void latency_print(const char * name, uint32_t first, uint32_t last) {
+    double server_sum = 0, server_max = 0, answer_sum = 0, answer_max = 0;
+    for (uint32_t i = first; i < last; i++) {
+        double server = (scans[i].received_ns - scans[i].sent_ns) / 1e6;
+        double answer = (scans[i].answered_ns - scans[i].sent_ns) / 1e6;
+        server_sum += server;
+        answer_sum += answer;
+        if (server > server_max) server_max = server;
+        if (answer > answer_max) answer_max = answer;
+    }
+    printf("%-9s server avg %8.1f max %8.1f ms   answer avg %8.1f max %8.1f ms\n", name,
+           server_sum / (last - first), server_max, answer_sum / (last - first), answer_max);
+}
+
+int main(int argc, char ** argv) {
+    random_state = (argc > 1) ? strtoull(argv[1], NULL, 0) | 1 : 1;
+    static sim_link_t creader;
+    static sim_esp_t esp;
+    static sim_lcd_t lcd;
+    sim_lcd_init(&lcd);
+    sim_esp_init(&esp, 9600);
+    esp.server = server;
+    main_board_create(&creader, &esp, &lcd);
+    for (uint8_t card = 0; card < CARDS; card++) { // the erased EEPROM leaves these at boot
+        uint8_t id[CREADER_ID_SIZE] = {0x5C, 0x00, 0x00, card, 0x02};
+        memcpy(cards[card].id, id, CREADER_ID_SIZE);
+        cards[card].max_time = 59 * 60 + 59; // no alarm while the check runs
+        cards[card].status = CHECKED_IN;
+    }
+
+    uint64_t ns = 3000 * MS; // booted, the ESP8266 associated
+    sim_run(ns);
+    for (uint32_t i = 0; i < SCANS; i++) {
+        if (i == CARDS) { // the check ins go to a failing server
+            faults = true;
+            outage_ns = ns;
+        }
+        const uint8_t * id = cards[i % CARDS].id;
+        snprintf(scans[i].line, sizeof(scans[i].line), "%02X%02X%02X%02X%02X%c", id[0], id[1], id[2], id[3], id[4],
+                 (i < CARDS) ? 'o' : 'i');
+        scans[i].sent_ns = send_scan(&creader, id, i, ns);
+        ns += SCAN_PERIOD_MS * MS;
+        sim_run(ns);
+    }
+
+    uint64_t limit = ns + UPLOAD_LIMIT_MS * MS;
+    uint32_t record = 0, received = 0, boots = 0;
+    for (; ns < limit && received < SCANS; ns += 100 * MS) {
+        sim_run(ns);
+        for (; record < esp.record_count; record++) {
+            const char * line = esp.records[record].line + 2; // after the boot
+            uint32_t i = 0;
+            while (i < SCANS && strncmp(line, scans[i].line, 2 * CREADER_ID_SIZE + 1) != 0) i++;
+            if (i == SCANS) {
+                if (line[2 * CREADER_ID_SIZE] == 'b' && boots++ == 0) continue; // the boot event, once
+                fprintf(stderr, "the server got %s, which wasn't scanned\n", esp.records[record].line);
+                return 1;
+            }
+            if (scans[i].copies++ == 0) {
+                scans[i].received_ns = esp.records[record].received_ns;
+                received++;
+            }
+        }
+    }
+    sim_run(ns + 1000 * MS); // the last answers
+    uint32_t duplicates = 0;
+    for (uint32_t i = 0; i < SCANS; i++) {
+        if (scans[i].copies == 0) {
+            fprintf(stderr, "scan %u (%s) never reached the server\n", i + 1, scans[i].line);
+            return 1;
+        }
+        duplicates += scans[i].copies - 1;
+    }
+    for (uint32_t r = 0; r < esp.record_count; r++) { // the first answer to each scan
+        uint32_t i = 0;
+        while (i < SCANS && strncmp(esp.records[r].line + 2, scans[i].line, 2 * CREADER_ID_SIZE + 1) != 0) i++;
+        if (i < SCANS && scans[i].answered_ns == 0) scans[i].answered_ns = esp.records[r].answered_ns;
+    }
+    for (uint32_t i = 0; i < SCANS; i++) {
+        if (scans[i].answered_ns == 0) {
+            fprintf(stderr, "scan %u (%s) was never answered\n", i + 1, scans[i].line);
+            return 1;
+        }
+    }
+    if (esp.bad_lengths != 0) {
+        fprintf(stderr, "%u requests with a Content-Length other than the length of their body\n", esp.bad_lengths);
+        return 1;
+    }
+    if (outage_requests > OUTAGE_REQUESTS) {
+        fprintf(stderr, "%u requests in the %u s outage, the upload doesn't back off\n", outage_requests,
+                OUTAGE_MS / 1000);
+        return 1;
+    }
+    printf("uploads: %u scans in %u requests, %u answered with an error, %u closed, %u duplicates\n", SCANS,
+           esp.requests, esp.failed, esp.closed, duplicates);
+    printf("         %u requests in the %u s outage, %u errors and %u rejections seen by the main board\n",
+           outage_requests, OUTAGE_MS / 1000, upload.errors, upload.rejected);
+    latency_print("200 only", 0, CARDS);
+    latency_print("failing", CARDS, SCANS);
+    return 0;
+}
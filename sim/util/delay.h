@@ -0,0 +1,14 @@
+/* PharmaTracker host simulator: busy-wait delays advance the board's clock */
+#ifndef SIM_UTIL_DELAY_H_
+#define SIM_UTIL_DELAY_H_
+
+#include "../sim.h"
+
+static inline void _delay_ms(double ms) {
+    sim_delay_ns(ms * 1e6);
+}
+static inline void _delay_us(double us) {
+    sim_delay_ns(us * 1e3);
+}
+
+#endif /* SIM_UTIL_DELAY_H_ */
@@ -0,0 +1,304 @@
+/* PharmaTracker decoder benchmark: synthetic EM4100 tags over a noisy channel
+ *
+ * Build and run from the repository root:
+ *   make rfbench
+ *   build/rfbench [-n trials] [-s seed] [-f tsv|csv] [-w] > results.tsv
+ *
+ * Every scenario of the channel table is run at every data rate of the
+ * decoder: each trial is a random tag ID (with its row and column
+ * parities) sent by a tag entering the field at a random time and phase
+ * of its frame, through the channel model, sampled at the tick rate of
+ * the decoder. Both decode modes of manchester.c get the same samples:
+ * "fixed", the TOLERANCE style fixed short/long threshold (set to 1.5
+ * nominal half bits of the rate), and "adaptive", the bit clock recovery
+ * the firmware runs. One row per scenario, rate and decoder:
+ *   read_rate       trials in which the right ID was decoded while the tag was in the field
+ *   false_rate      frames that passed the parity checks but carry another ID, of all frames decoded
+ *   ttfr_*_ms       time to first read: from the tag entering the field to the end of its first frame
+ *   msamples_s      decode throughput of the packed sample path, in millions of samples per second
+ * With -w, the scenarios are a sweep of every combination of edge jitter
+ * and tag clock skew instead, named "jitter_skew" (j0.10_s0.15), with the
+ * same columns.
+ * The seed makes runs reproducible, so the tables of two builds of the
+ * decoder can be compared line by line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include "../manchester.h"
+
+#define TICK_HZ             (8000000 / 32)          // F_CPU / TICK_PRESCALER in decoder.c: one sample per timer tick
+#define PRESENT_FRAMES      4       // a trial's tag stays in the field this many frame periods
+#define FILTER_SHIFT        2       // the analog front end, a one pole low-pass moving 1/4 of the way every tick
+#define DROPOUT_DEPTH       0.9     // a fade takes away this much of the amplitude
+#define TRIAL_WORDS         ((PRESENT_FRAMES + 1) * 64 * 2 * 64 / 64)  // samples of the longest trial (RF/64), in words
+
+static const uint8_t data_rates[] = {32, 40, 64};  // DATA_RATES in decoder.c
+#define RATE_COUNT          (sizeof(data_rates) / sizeof(data_rates[0]))
+
+/************************************************************************/
+/* Channel scenarios. The signal is the demodulated envelope, +1 or -1  */
+/* per half bit, ahead of the front end filter and the comparator.      */
+/************************************************************************/
+typedef struct {
+    const char * name;
+    bool tag;               // false: noise only, nothing should be decoded
+    double noise;           // standard deviation of the additive white noise, in signal amplitudes
+    double jitter;          // standard deviation of every edge, in half bits
+    double skew;            // the tag's bit clock is this much fast or slow (the sign is random)
+    double dropouts;        // fades per second, at random times
+    double dropout_ms;      // how long a fade lasts
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    {"clean",       true,  0.0,  0.00, 0.00, 0,  0},
+    {"noise_0.4",   true,  0.4,  0.00, 0.00, 0,  0},
+    {"noise_0.5",   true,  0.5,  0.00, 0.00, 0,  0},
+    {"noise_0.6",   true,  0.6,  0.00, 0.00, 0,  0},
+    {"noise_0.8",   true,  0.8,  0.00, 0.00, 0,  0},
+    {"jitter_0.10", true,  0.0,  0.10, 0.00, 0,  0},
+    {"jitter_0.15", true,  0.0,  0.15, 0.00, 0,  0},
+    {"jitter_0.20", true,  0.0,  0.20, 0.00, 0,  0},
+    {"skew_0.05",   true,  0.0,  0.00, 0.05, 0,  0},
+    {"skew_0.15",   true,  0.0,  0.00, 0.15, 0,  0},
+    {"skew_0.25",   true,  0.0,  0.00, 0.25, 0,  0},
+    {"dropout",     true,  0.3,  0.00, 0.00, 20, 2},
+    {"field",       true,  0.4,  0.05, 0.05, 5,  2},
+    {"no_tag",      false, 1.0,  0.00, 0.00, 0,  0},
+};
+#define SCENARIO_COUNT      (sizeof(scenarios) / sizeof(scenarios[0]))
+
+#define SWEEP_STEPS         6       // -w: jitter and skew each go 0, 0.05... 0.25
+#define SWEEP_STEP          0.05
+
+/************************************************************************/
+/* Reproducible randomness: xorshift64*, seeded per trial so that every */
+/* decoder sees the same signals whatever else changes.                 */
+/************************************************************************/
+static uint64_t random_state;
+
+static uint64_t random_next(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+static double random_uniform(void) { // [0, 1)
+    return (random_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+static double random_gauss(void) {
+    double u = random_uniform(), v = random_uniform();
+    return sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v);
+}
+
+/************************************************************************/
+/* A tag: 9 header 1's, 10 rows of 4 data bits and their even parity,   */
+/* 4 even column parities and a 0 stop bit, sent from bit 63 down.      */
+/************************************************************************/
+static uint64_t em4100_frame(const manchester_frame_t * tag) {
+    uint64_t frame = 0x1FF;
+    uint8_t columns = 0;
+    for (uint8_t row = 0; row < 10; row++) {
+        uint8_t nibble = (row & 1) ? tag->id[row >> 1] & 0x0F : tag->id[row >> 1] >> 4;
+        columns ^= nibble;
+        frame = (frame << 5) | (nibble << 1) | __builtin_parity(nibble);
+    }
+    return (frame << 5) | (columns << 1);
+}
+
+/************************************************************************/
+/* One trial through the channel: the tag enters the field after up to  */
+/* a frame period of noise, at a random bit of its frame, and stays for */
+/* PRESENT_FRAMES frame periods. Samples are packed 64 per word, oldest */
+/* in the least significant bit, as manchester_decode_packed takes them.*/
+/************************************************************************/
+typedef struct {
+    manchester_frame_t tag;
+    uint64_t on, off;               // ticks when the tag entered and left the field
+    uint64_t * words;
+    size_t word_count;
+} trial_t;
+
+static void synthesize(trial_t * trial, const scenario_t * s, uint8_t rf) {
+    uint64_t frame_ticks = 64 * 2 * (uint64_t)rf; // a half bit lasts rf ticks at one tick per carrier half period
+    for (uint8_t i = 0; i < MANCHESTER_ID_SIZE; i++) trial->tag.id[i] = random_next() >> 56;
+    uint64_t frame = em4100_frame(&trial->tag);
+    double half_bit = rf * ((random_next() & 1) ? 1 + s->skew : 1 - s->skew);
+    trial->on = random_next() % frame_ticks;
+    trial->off = s->tag ? trial->on + PRESENT_FRAMES * frame_ticks : trial->on;
+    uint64_t ticks = trial->on + PRESENT_FRAMES * frame_ticks;
+    trial->word_count = (ticks + 63) / 64;
+    unsigned first_bit = random_next() % 64;
+    uint64_t half = 0;              // half bit being sent
+    double edge = trial->on + half_bit; // when it ends
+    double fade_start = s->dropouts ? trial->on + TICK_HZ * -log(1 - random_uniform()) / s->dropouts : INFINITY;
+    double fade_end = fade_start + s->dropout_ms * TICK_HZ / 1000;
+    double filtered = 0;
+    for (size_t w = 0; w < trial->word_count; w++) {
+        uint64_t word = 0;
+        for (unsigned b = 0; b < 64; b++) {
+            uint64_t t = w * 64 + b;
+            double x = 0;
+            if (t >= trial->on && t < trial->off) {
+                while (t >= edge) { // next half bit, its end moved by the jitter but never before its start
+                    half++;
+                    double jitter = s->jitter * half_bit * random_gauss();
+                    if (jitter < -0.45 * half_bit) jitter = -0.45 * half_bit;
+                    if (jitter > 0.45 * half_bit) jitter = 0.45 * half_bit;
+                    edge = trial->on + (half + 1) * half_bit + jitter;
+                }
+                bool bit = (frame >> (63 - (first_bit + half / 2) % 64)) & 1;
+                x = ((half & 1) ? bit : !bit) ? 1 : -1;
+                while (t >= fade_end) {
+                    fade_start = fade_end + TICK_HZ * -log(1 - random_uniform()) / s->dropouts;
+                    fade_end = fade_start + s->dropout_ms * TICK_HZ / 1000;
+                }
+                if (t >= fade_start) x *= 1 - DROPOUT_DEPTH;
+            }
+            if (s->noise > 0) x += s->noise * random_gauss();
+            filtered += (x - filtered) / (1 << FILTER_SHIFT);
+            word |= (uint64_t)(filtered > 0) << b;
+        }
+        trial->words[w] = word;
+    }
+}
+
+/************************************************************************/
+/* Results of a decoder on a scenario and a rate                        */
+/************************************************************************/
+typedef struct {
+    uint32_t trials, reads;
+    uint64_t frames, false_frames;
+    double * ttfr;                  // ms, one per read
+    uint64_t samples;
+    double seconds;                 // spent decoding
+} result_t;
+
+static double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+static void decode(manchester_t * m, const trial_t * trial, result_t * r) {
+    double start = now_seconds();
+    size_t done = 0;
+    bool read = false;
+    while (done < trial->word_count) {
+        manchester_frame_t frame;
+        size_t found;
+        done += manchester_decode_packed(m, trial->words + done, trial->word_count - done, &frame, 1, &found);
+        if (found == 0) break;
+        uint64_t at = done * 64; // the frame completed in the last word consumed
+        r->frames++;
+        if (memcmp(frame.id, trial->tag.id, MANCHESTER_ID_SIZE) != 0 || at <= trial->on) {
+            r->false_frames++;
+        } else if (!read) {
+            read = true;
+            r->ttfr[r->reads++] = (at - trial->on) * 1000.0 / TICK_HZ;
+        }
+    }
+    r->seconds += now_seconds() - start;
+    r->samples += trial->word_count * 64;
+    r->trials++;
+}
+
+static int compare_doubles(const void * a, const void * b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+static void print_result(char sep, const char * decoder, uint8_t rf, const scenario_t * s, result_t * r) {
+    printf("%s%c%u%c%s%c%u", decoder, sep, rf, sep, s->name, sep, r->trials);
+    if (s->tag) printf("%c%.4f", sep, (double)r->reads / r->trials);
+    else printf("%cNA", sep);
+    printf("%c%llu%c%llu%c%.6f", sep, (unsigned long long)r->frames, sep, (unsigned long long)r->false_frames, sep,
+           r->frames ? (double)r->false_frames / r->frames : 0.0);
+    if (r->reads > 0) {
+        qsort(r->ttfr, r->reads, sizeof(double), compare_doubles);
+        double total = 0;
+        for (uint32_t i = 0; i < r->reads; i++) total += r->ttfr[i];
+        printf("%c%.2f%c%.2f%c%.2f", sep, total / r->reads, sep, r->ttfr[r->reads / 2], sep,
+               r->ttfr[(r->reads * 95 + 99) / 100 - 1]);
+    } else {
+        printf("%cNA%cNA%cNA", sep, sep, sep);
+    }
+    printf("%c%.1f\n", sep, r->samples / r->seconds / 1e6);
+}
+
+int main(int argc, char ** argv) {
+    uint32_t trials = 200;
+    uint64_t seed = 1;
+    char sep = '\t';
+    const scenario_t * list = scenarios;
+    uint8_t count = SCENARIO_COUNT;
+    static scenario_t sweep[SWEEP_STEPS * SWEEP_STEPS];
+    static char names[SWEEP_STEPS * SWEEP_STEPS][16];
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:f:w")) != -1) {
+        if (opt == 'n' && atoi(optarg) > 0) trials = atoi(optarg);
+        else if (opt == 's') seed = strtoull(optarg, NULL, 0);
+        else if (opt == 'f' && strcmp(optarg, "csv") == 0) sep = ',';
+        else if (opt == 'f' && strcmp(optarg, "tsv") == 0) sep = '\t';
+        else if (opt == 'w') {
+            for (uint8_t j = 0; j < SWEEP_STEPS; j++) {
+                for (uint8_t k = 0; k < SWEEP_STEPS; k++) {
+                    scenario_t * point = &sweep[j * SWEEP_STEPS + k];
+                    point->tag = true;
+                    point->jitter = j * SWEEP_STEP;
+                    point->skew = k * SWEEP_STEP;
+                    snprintf(names[j * SWEEP_STEPS + k], sizeof(names[0]), "j%.2f_s%.2f", point->jitter, point->skew);
+                    point->name = names[j * SWEEP_STEPS + k];
+                }
+            }
+            list = sweep;
+            count = SWEEP_STEPS * SWEEP_STEPS;
+        } else {
+            fprintf(stderr, "usage: %s [-n trials] [-s seed] [-f tsv|csv] [-w]\n", argv[0]);
+            return 2;
+        }
+    }
+    manchester_rate_t rates[RATE_COUNT];
+    for (uint8_t i = 0; i < RATE_COUNT; i++) {
+        manchester_rate_t rate = MANCHESTER_RATE(data_rates[i]); // RF/n: a half bit lasts n ticks
+        rates[i] = rate;
+    }
+    trial_t trial;
+    trial.words = malloc(TRIAL_WORDS * sizeof(uint64_t));
+    result_t results[2];
+    results[0].ttfr = malloc(trials * sizeof(double));
+    results[1].ttfr = malloc(trials * sizeof(double));
+    if (trial.words == NULL || results[0].ttfr == NULL || results[1].ttfr == NULL) return 1;
+    printf("decoder%crate%cscenario%ctrials%cread_rate%cframes%cfalse_frames%cfalse_rate"
+           "%cttfr_mean_ms%cttfr_p50_ms%cttfr_p95_ms%cmsamples_s\n", sep, sep, sep, sep, sep, sep, sep, sep, sep,
+           sep, sep);
+    for (uint8_t s = 0; s < count; s++) {
+        for (uint8_t i = 0; i < RATE_COUNT; i++) {
+            for (uint8_t d = 0; d < 2; d++) {
+                double * ttfr = results[d].ttfr;
+                memset(&results[d], 0, sizeof(result_t));
+                results[d].ttfr = ttfr;
+            }
+            for (uint32_t n = 0; n < trials; n++) {
+                random_state = (seed * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)s << 56 | (uint64_t)i << 48 | n) ^ 1;
+                for (uint8_t k = 0; k < 4; k++) random_next(); // mix the seed
+                synthesize(&trial, &list[s], data_rates[i]);
+                manchester_t m;
+                manchester_init(&m, rates[i].threshold);
+                decode(&m, &trial, &results[0]);
+                manchester_init_adaptive(&m, rates, RATE_COUNT);
+                decode(&m, &trial, &results[1]);
+            }
+            print_result(sep, "fixed", data_rates[i], &list[s], &results[0]);
+            print_result(sep, "adaptive", data_rates[i], &list[s], &results[1]);
+            fflush(stdout);
+        }
+    }
+    free(trial.words);
+    free(results[0].ttfr);
+    free(results[1].ttfr);
+    return 0;
+}
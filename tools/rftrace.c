@@ -0,0 +1,476 @@
+/* PharmaTracker raw RF trace tool
+ *
+ * Build and run from the repository root:
+ *   make rftrace
+ *   build/rftrace capture /dev/ttyUSB0 field.rft [seconds]
+ *   build/rftrace analyze [-n listed] [-b bin] field.rft...
+ *
+ * capture records the stream of a decoder built with RAW_CAPTURE (a USB
+ * serial adapter on its TX pin, set to CAPTURE_BAUD) into a trace file,
+ * or converts a raw dump of that stream ("-" reads it from stdin).
+ * analyze runs the Manchester decode engine of the decoder over traces
+ * and reports the frames decoded, where the bit clock was lost, where
+ * and in which rows and columns the parity checks failed, and the
+ * histogram of the pulse widths at either level. Traces are streamed
+ * (files are memory mapped a window at a time), so archives of any size
+ * are analyzed in constant memory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include "../manchester.h"
+
+#define DECODER_TICK_HZ     (8000000 / 32)          // F_CPU / TICK_PRESCALER in decoder.c
+#define CAPTURE_BAUD        83333                   // as in decoder.c
+#define TRACE_SYNC          0xFE                    // CAPTURE_SYNC in decoder.c
+#define TRACE_LEVEL         0xFC                    // CAPTURE_LEVEL in decoder.c
+#define MAP_WINDOW          (64 << 20)              // bytes of a trace file mapped at a time
+#define READ_CHUNK          (64 << 10)              // bytes read at a time from a pipe or a device
+#define TAG_MAX             16                      // distinct tags reported per trace
+
+static const uint8_t data_rates[] = {32, 40, 64};  // DATA_RATES in decoder.c
+
+/************************************************************************/
+/* Trace file: a 16 byte header, then the stream of the decoder as is:  */
+/* one byte per run, its length in ticks, the levels alternating, a     */
+/* TRACE_SYNC | level byte giving the level of the next run before the  */
+/* first run and after runs were lost, and since version 2 a            */
+/* TRACE_LEVEL | level byte every 64 runs. Header, little endian:       */
+/* "PTRF", version and header size (16 bits each), the tick rate and    */
+/* the carrier frequency in Hz (32 bits each). Version 1 traces have no */
+/* level bytes: runs of 252 and 253 ticks are runs.                     */
+/************************************************************************/
+#define TRACE_MAGIC         "PTRF"
+#define TRACE_VERSION       2
+#define TRACE_HEADER_SIZE   16
+
+typedef struct {
+    uint16_t version;
+    uint32_t tick_hz;               // run lengths are counted in ticks of this clock
+    uint32_t carrier_hz;
+} trace_info_t;
+
+static void put_le(uint8_t * p, uint32_t value, uint8_t size) {
+    for (uint8_t i = 0; i < size; i++, value >>= 8) p[i] = value & 0xFF;
+}
+static uint32_t get_le(const uint8_t * p, uint8_t size) {
+    uint32_t value = 0;
+    while (size-- > 0) value = (value << 8) | p[size];
+    return value;
+}
+static void trace_header(uint8_t * header, const trace_info_t * info) {
+    memcpy(header, TRACE_MAGIC, 4);
+    put_le(header + 4, TRACE_VERSION, 2);
+    put_le(header + 6, TRACE_HEADER_SIZE, 2);
+    put_le(header + 8, info->tick_hz, 4);
+    put_le(header + 12, info->carrier_hz, 4);
+}
+static bool trace_parse_header(const uint8_t * header, trace_info_t * info) {
+    info->version = get_le(header + 4, 2);
+    if (memcmp(header, TRACE_MAGIC, 4) != 0 || info->version == 0 || info->version > TRACE_VERSION) return false;
+    if (get_le(header + 6, 2) != TRACE_HEADER_SIZE) return false;
+    info->tick_hz = get_le(header + 8, 4);
+    info->carrier_hz = get_le(header + 12, 4);
+    return info->tick_hz != 0 && info->carrier_hz != 0;
+}
+
+/************************************************************************/
+/* The data rate table of the decoder for the tick rate of a trace,     */
+/* derived the way decoder.c derives it at compile time.                */
+/************************************************************************/
+#define RATE_COUNT          (sizeof(data_rates) / sizeof(data_rates[0]))
+
+static bool trace_rates(const trace_info_t * info, manchester_rate_t * rates) {
+    for (uint8_t i = 0; i < RATE_COUNT; i++) {
+        uint64_t half_bit = ((uint64_t)data_rates[i] * info->tick_hz + info->carrier_hz) / (2 * info->carrier_hz);
+        if (half_bit * 5 / 4 * 5 / 2 >= 256) return false; // the table holds 8-bit lengths
+        manchester_rate_t rate = MANCHESTER_RATE(half_bit);
+        rates[i] = rate;
+    }
+    return true;
+}
+
+/************************************************************************/
+/* Reading a trace in chunks: a regular file is memory mapped a window  */
+/* at a time and read ahead sequentially, anything else (a pipe, a      */
+/* serial device) is read into a buffer.                                */
+/************************************************************************/
+typedef struct {
+    int fd;
+    bool mapped;
+    uint64_t size;                  // mapped: size of the file
+    uint64_t offset;                // mapped: offset of the next window
+    uint8_t * window;
+    size_t window_size;
+    uint8_t buffer[READ_CHUNK];
+} trace_reader_t;
+
+static bool reader_open(trace_reader_t * r, const char * path) {
+    struct stat st;
+    r->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_NOCTTY);
+    if (r->fd < 0 || fstat(r->fd, &st) != 0) return false;
+    r->mapped = S_ISREG(st.st_mode);
+    r->size = st.st_size;
+    r->offset = 0;
+    r->window = NULL;
+    return true;
+}
+static const uint8_t * reader_next(trace_reader_t * r, size_t * length) {
+    if (!r->mapped) {
+        ssize_t n = read(r->fd, r->buffer, sizeof(r->buffer));
+        *length = n > 0 ? n : 0;
+        return n > 0 ? r->buffer : NULL;
+    }
+    if (r->window != NULL) munmap(r->window, r->window_size);
+    r->window = NULL;
+    if (r->offset >= r->size) return NULL;
+    r->window_size = (r->size - r->offset < MAP_WINDOW) ? r->size - r->offset : MAP_WINDOW;
+    void * window = mmap(NULL, r->window_size, PROT_READ, MAP_PRIVATE, r->fd, r->offset);
+    if (window == MAP_FAILED) return NULL;
+    madvise(window, r->window_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    r->window = window;
+    r->offset += r->window_size;
+    *length = r->window_size;
+    return r->window;
+}
+static void reader_close(trace_reader_t * r) {
+    if (r->window != NULL) munmap(r->window, r->window_size);
+    if (r->fd != STDIN_FILENO) close(r->fd);
+}
+
+/************************************************************************/
+/* Analysis of one trace. The decoder is fed the runs as the edge ISR   */
+/* feeds them, and its counters are watched after every run to place    */
+/* the sync losses and the parity failures in the trace. A failing      */
+/* window is checked again row by row and column by column, since the   */
+/* decoder stops at the first error.                                    */
+/************************************************************************/
+typedef struct {
+    uint64_t ticks;                 // end of the run
+    uint8_t level, length;          // the run
+    uint16_t half_bit;              // sync loss: the half bit the decoder expected, in 1/8 ticks
+    uint16_t rows;                  // parity failure: bit n set if row n failed
+    uint8_t columns;                // parity failure: bit n set if column n failed
+    uint64_t window;                // parity failure: the 64 bits that failed
+} trace_event_t;
+
+typedef struct {
+    manchester_frame_t frame;
+    uint64_t count, first;          // # of times decoded, end of the first one in ticks
+} trace_tag_t;
+
+typedef struct {
+    uint8_t header[TRACE_HEADER_SIZE];
+    size_t header_length;
+    trace_info_t info;
+    manchester_rate_t rates[RATE_COUNT];
+    manchester_t decoder;
+    int level;                      // level of the next run, -1 until the first sync byte
+    uint64_t ticks;                 // start of the next run
+    uint64_t bytes, runs, skipped, gaps;
+    uint64_t widths[2][256];        // # of runs of each length, per level
+    uint64_t frames;
+    trace_tag_t tags[TAG_MAX];
+    uint8_t tag_count;
+    uint64_t sync_losses, parity_errors;
+    uint64_t row_errors[10], column_errors[4];
+    trace_event_t * losses, * failures; // the first "listed" of each
+    uint32_t listed;
+} analysis_t;
+
+static void record_frame(analysis_t * a, const manchester_frame_t * frame) {
+    a->frames++;
+    for (uint8_t i = 0; i < a->tag_count; i++) {
+        if (memcmp(a->tags[i].frame.id, frame->id, MANCHESTER_ID_SIZE) == 0) {
+            a->tags[i].count++;
+            return;
+        }
+    }
+    if (a->tag_count == TAG_MAX) return;
+    trace_tag_t * tag = &a->tags[a->tag_count++];
+    tag->frame = *frame;
+    tag->count = 1;
+    tag->first = a->ticks;
+}
+static void record_parity(analysis_t * a, trace_event_t * event) {
+    uint64_t window = a->decoder.window;
+    uint8_t columns = (window >> 1) & 0x0F;
+    event->window = window;
+    event->rows = 0;
+    for (int8_t row = 9; row >= 0; row--) {
+        uint8_t bits = (window >> (5 + 5 * (9 - row))) & 0x1F;
+        if (__builtin_parity(bits)) {
+            event->rows |= 1 << row;
+            a->row_errors[row]++;
+        }
+        columns ^= bits >> 1;
+    }
+    event->columns = 0;
+    for (uint8_t column = 0; column < 4; column++) {
+        if ((columns >> (3 - column)) & 1) { // column 0 is the first bit of a row
+            event->columns |= 1 << column;
+            a->column_errors[column]++;
+        }
+    }
+}
+static void feed_run(analysis_t * a, uint8_t length) {
+    manchester_t * d = &a->decoder;
+    uint16_t losses = d->sync_losses, errors = d->parity_errors, half_bit = d->half_bit;
+    manchester_frame_t frame;
+    a->ticks += length;
+    a->runs++;
+    a->widths[a->level][length]++;
+    if (manchester_feed_run(d, a->level, length, &frame)) record_frame(a, &frame);
+    trace_event_t event = {a->ticks, a->level, length, half_bit, 0, 0, 0};
+    if (d->sync_losses != losses) {
+        if (a->sync_losses < a->listed) a->losses[a->sync_losses] = event;
+        a->sync_losses++;
+    }
+    if (d->parity_errors != errors) {
+        record_parity(a, &event);
+        if (a->parity_errors < a->listed) a->failures[a->parity_errors] = event;
+        a->parity_errors++;
+    }
+    a->level ^= 1;
+}
+static bool analyze_bytes(analysis_t * a, const uint8_t * p, size_t n) {
+    a->bytes += n;
+    while (a->header_length < TRACE_HEADER_SIZE && n > 0) {
+        a->header[a->header_length++] = *p++;
+        n--;
+        if (a->header_length < TRACE_HEADER_SIZE) continue;
+        if (!trace_parse_header(a->header, &a->info) || !trace_rates(&a->info, a->rates)) return false;
+        manchester_init_adaptive(&a->decoder, a->rates, RATE_COUNT);
+    }
+    for (; n > 0; p++, n--) {
+        if ((*p & ~1) == TRACE_SYNC) {
+            if (a->level >= 0) { // runs were lost, so was the bit clock
+                a->gaps++;
+                manchester_init_adaptive(&a->decoder, a->rates, RATE_COUNT);
+            }
+            a->level = *p & 1;
+        } else if ((*p & ~1) == TRACE_LEVEL && a->info.version >= 2) {
+            if (a->level >= 0 && a->level != (*p & 1)) { // can't be, but don't decode across it
+                a->gaps++;
+                manchester_init_adaptive(&a->decoder, a->rates, RATE_COUNT);
+            }
+            a->level = *p & 1;
+        } else if (a->level < 0) {
+            a->skipped++;
+        } else {
+            feed_run(a, *p);
+        }
+    }
+    return true;
+}
+
+static double seconds(const analysis_t * a, uint64_t ticks) {
+    return (double)ticks / a->info.tick_hz;
+}
+static void print_tally(const char * name, const uint64_t * counts, uint8_t n) {
+    printf("  %-10s", name);
+    for (uint8_t i = 0; i < n; i++) printf(" %u:%llu", i, (unsigned long long)counts[i]);
+    printf("\n");
+}
+static void print_bits(uint16_t bits, uint8_t n, int width) {
+    char text[32] = "", * p = text;
+    for (uint8_t i = 0; i < n; i++) {
+        if (bits & (1 << i)) p += sprintf(p, "%s%u", p == text ? "" : ",", i);
+    }
+    printf(" %-*s", width, p == text ? "-" : text);
+}
+static void print_histogram(const analysis_t * a, uint8_t bin) {
+    uint64_t most = 0;
+    for (int start = 0; start < 256; start += bin) {
+        uint64_t counts[2] = {0, 0};
+        for (int width = start; width < start + bin && width < 256; width++) {
+            counts[0] += a->widths[0][width];
+            counts[1] += a->widths[1][width];
+        }
+        if (counts[0] + counts[1] > most) most = counts[0] + counts[1];
+    }
+    printf("pulse widths (ticks of %.2f us)\n    width        low       high\n", 1e6 / a->info.tick_hz);
+    for (int start = 0; start < 256; start += bin) {
+        uint64_t counts[2] = {0, 0};
+        for (int width = start; width < start + bin && width < 256; width++) {
+            counts[0] += a->widths[0][width];
+            counts[1] += a->widths[1][width];
+        }
+        if (counts[0] + counts[1] == 0) continue;
+        int end = start + bin - 1 < 255 ? start + bin - 1 : 255;
+        printf("  %3d-%-3d %10llu %10llu ", start, end, (unsigned long long)counts[0],
+               (unsigned long long)counts[1]);
+        for (uint64_t bar = (counts[0] + counts[1]) * 40 / most; bar > 0; bar--) putchar('#');
+        printf("\n");
+    }
+}
+static void print_analysis(const char * path, const analysis_t * a, uint8_t bin) {
+    printf("%s: %.3f s at %u Hz, %llu runs, %llu capture gaps, %llu bytes before the first sync\n", path,
+           seconds(a, a->ticks), a->info.tick_hz, (unsigned long long)a->runs, (unsigned long long)a->gaps,
+           (unsigned long long)a->skipped);
+    printf("frames: %llu decoded\n", (unsigned long long)a->frames);
+    for (uint8_t i = 0; i < a->tag_count; i++) {
+        const uint8_t * id = a->tags[i].frame.id;
+        printf("  %02X%02X%02X%02X%02X %10llu  first at %.3f s\n", id[0], id[1], id[2], id[3], id[4],
+               (unsigned long long)a->tags[i].count, seconds(a, a->tags[i].first));
+    }
+    printf("sync losses: %llu\n", (unsigned long long)a->sync_losses);
+    if (a->sync_losses > 0) printf("      time (s)  level  width  expected half bit\n");
+    for (uint64_t i = 0; i < a->sync_losses && i < a->listed; i++) {
+        const trace_event_t * e = &a->losses[i];
+        printf("  %12.6f  %5u  %5u  %17.2f\n", seconds(a, e->ticks), e->level, e->length,
+               e->half_bit / (double)(1 << MANCHESTER_FRACTION));
+    }
+    printf("parity failures: %llu\n", (unsigned long long)a->parity_errors);
+    if (a->parity_errors > 0) {
+        print_tally("by row", a->row_errors, 10);
+        print_tally("by column", a->column_errors, 4);
+        printf("      time (s)  rows                 columns  window\n");
+    }
+    for (uint64_t i = 0; i < a->parity_errors && i < a->listed; i++) {
+        const trace_event_t * e = &a->failures[i];
+        printf("  %12.6f ", seconds(a, e->ticks));
+        print_bits(e->rows, 10, 20);
+        print_bits(e->columns, 4, 8);
+        printf(" %016llX\n", (unsigned long long)e->window);
+    }
+    print_histogram(a, bin);
+}
+
+static int analyze(int argc, char ** argv) {
+    uint32_t listed = 20;
+    uint8_t bin = 2;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+        if (opt == 'n') listed = strtoul(optarg, NULL, 0);
+        else if (opt == 'b' && atoi(optarg) >= 1 && atoi(optarg) <= 255) bin = atoi(optarg);
+        else return 2;
+    }
+    if (optind == argc) return 2;
+    int status = 0;
+    analysis_t * a = malloc(sizeof(analysis_t));
+    trace_event_t * events = malloc(2 * sizeof(trace_event_t) * (listed ? listed : 1));
+    if (a == NULL || events == NULL) return 1;
+    for (; optind < argc; optind++) {
+        const char * path = argv[optind];
+        trace_reader_t * reader = malloc(sizeof(trace_reader_t));
+        if (reader == NULL || !reader_open(reader, path)) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            free(reader);
+            status = 1;
+            continue;
+        }
+        memset(a, 0, sizeof(analysis_t));
+        a->level = -1;
+        a->listed = listed;
+        a->losses = events;
+        a->failures = events + listed;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        const uint8_t * chunk;
+        size_t length;
+        bool valid = true;
+        while (valid && (chunk = reader_next(reader, &length)) != NULL) {
+            valid = analyze_bytes(a, chunk, length);
+        }
+        reader_close(reader);
+        free(reader);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!valid || a->header_length < TRACE_HEADER_SIZE) {
+            fprintf(stderr, "%s: not a trace, or a tick rate the decoder can't run at\n", path);
+            status = 1;
+            continue;
+        }
+        print_analysis(path, a, bin);
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%s: %.1f MB in %.2f s (%.0f MB/s)\n", path, a->bytes / 1e6, elapsed,
+                a->bytes / 1e6 / (elapsed > 0 ? elapsed : 1e-9));
+    }
+    free(events);
+    free(a);
+    return status;
+}
+
+/************************************************************************/
+/* Capture: a serial device is set to raw 8N1 at CAPTURE_BAUD, which no */
+/* standard speed matches, so the arbitrary rate interface is used.     */
+/* Runs until the end of the input, the time limit or ^C.               */
+/************************************************************************/
+static volatile sig_atomic_t interrupted;
+
+static void on_interrupt(int signal) {
+    (void)signal;
+    interrupted = 1;
+}
+static bool serial_setup(int fd) {
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) != 0) return errno == ENOTTY; // not a serial device, read as is
+    tio.c_iflag = IGNBRK;
+    tio.c_oflag = 0;
+    tio.c_lflag = 0;
+    tio.c_cflag = (tio.c_cflag & ~(CBAUD | CSIZE | PARENB | CSTOPB | CRTSCTS)) | BOTHER | CS8 | CREAD | CLOCAL;
+    tio.c_ispeed = tio.c_ospeed = CAPTURE_BAUD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    return ioctl(fd, TCSETS2, &tio) == 0;
+}
+
+static int capture(int argc, char ** argv) {
+    if (argc < 3 || argc > 4) return 2;
+    trace_reader_t * reader = malloc(sizeof(trace_reader_t));
+    if (reader == NULL || !reader_open(reader, argv[1]) || !serial_setup(reader->fd)) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    reader->mapped = false; // a dump is copied as it comes
+    FILE * out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    trace_info_t info = {TRACE_VERSION, DECODER_TICK_HZ, DECODER_TICK_HZ / 2};
+    uint8_t header[TRACE_HEADER_SIZE];
+    trace_header(header, &info);
+    fwrite(header, 1, sizeof(header), out);
+    struct sigaction action = {.sa_handler = on_interrupt}; // no SA_RESTART: a blocked read returns
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGALRM, &action, NULL);
+    if (argc == 4) alarm(atoi(argv[3]));
+    uint64_t bytes = 0;
+    const uint8_t * chunk;
+    size_t length;
+    while (!interrupted && (chunk = reader_next(reader, &length)) != NULL) {
+        fwrite(chunk, 1, length, out);
+        bytes += length;
+    }
+    reader_close(reader);
+    free(reader);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "%s: %llu bytes captured\n", argv[2], (unsigned long long)bytes);
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    int status = 2;
+    if (argc >= 2 && strcmp(argv[1], "analyze") == 0) status = analyze(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "capture") == 0) status = capture(argc - 1, argv + 1);
+    if (status == 2) {
+        fprintf(stderr, "usage: %s capture device|dump|- trace [seconds]\n"
+                        "       %s analyze [-n listed] [-b bin] trace...\n", argv[0], argv[0]);
+    }
+    return status;
+}
@@ -2,7 +2,11 @@ import sqlite3
 db = sqlite3.connect('/data/logs.db', detect_types=sqlite3.PARSE_DECLTYPES)
 cursor = db.cursor()
 try:
-	cursor.execute('create table log (rfid integer, event integer , time timestamp)')
+	cursor.execute('create table log (rfid integer, event integer , time timestamp, device text, boot integer, sequence integer)')
+	cursor.execute('create unique index log_by_record on log (device, boot, sequence)')
+	cursor.execute('create table boots (device text, boot integer, start timestamp, primary key (device, boot))')
+	cursor.execute('create table stats (unit text, time timestamp, name text, value integer)')
+	cursor.execute('create index stats_by_name on stats (name, time)')
 	print "database was created"
 except:
 	print "Error creating the database. perhaps it already exits?"
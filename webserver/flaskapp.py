@@ -1,16 +1,42 @@
-from flask import Flask, render_template, abort, g
+from flask import Flask, render_template, abort, g, request
 from datetime import datetime, timedelta
+from werkzeug.serving import WSGIRequestHandler
 import sqlite3
+import threading
+import time
+try:
+    import queue
+except ImportError:  # Python 2
+    import Queue as queue
 
 DATABASE = '/data/logs.db'
 
 app = Flask(__name__)
 
 
+def create_tables(database):
+    database.execute('create table if not exists log (rfid integer, event integer, time timestamp, '
+                     'device text, boot integer, sequence integer)')
+    columns = [row[1] for row in database.execute('pragma table_info(log)')]
+    for column, kind in (('device', 'text'), ('boot', 'integer'), ('sequence', 'integer')):
+        if column not in columns:  # a log from before batches were numbered
+            database.execute('alter table log add column %s %s' % (column, kind))
+    # a batch sent again (its answer was lost) inserts nothing twice; /add rows have no key
+    database.execute('create unique index if not exists log_by_record on log (device, boot, sequence)')
+    columns = [row[1] for row in database.execute('pragma table_info(boots)')]
+    if columns and 'device' not in columns:  # boots of all units in one table: only a cache, start it over
+        database.execute('drop table boots')
+    database.execute('create table if not exists boots (device text, boot integer, start timestamp, '
+                     'primary key (device, boot))')
+    database.execute('create table if not exists stats (unit text, time timestamp, name text, value integer)')
+    database.execute('create index if not exists stats_by_name on stats (name, time)')
+
+
 def get_db_connection():
     database = getattr(g, '_database', None)
     if database is None:
         database = g._database = sqlite3.connect(DATABASE, detect_types=sqlite3.PARSE_DECLTYPES)
+        create_tables(database)
     return database
 
 
@@ -21,6 +47,112 @@ def close_database_connection(exception):
         database.close()
 
 
+# Uploads are written by a single thread that keeps one connection open in WAL
+# mode, whose statement cache keeps the inserts prepared. The requests that
+# arrived while the previous transaction was being committed, and within
+# GROUP_COMMIT_WINDOW of the first of them, share one transaction, so one
+# fsync, and each one runs in a savepoint so that a failing request doesn't
+# take the others down. A request is answered only once its transaction is
+# committed (synchronous=full: on disk), so an acknowledged event is never lost.
+# Without GROUP_COMMIT every request commits on its own connection.
+GROUP_COMMIT = True
+GROUP_COMMIT_WINDOW = 0      # seconds to wait for more requests: the commit itself is window enough
+GROUP_COMMIT_MAX = 256       # requests per transaction
+INGEST_TIMEOUT = 10          # seconds a request waits for its commit before giving up
+
+
+class IngestJob(object):
+    def __init__(self, work):
+        self.work = work
+        self.error = None
+        self.done = threading.Event()
+        self.lock = threading.Lock()
+        self.started = False     # the writer took it: it commits, or fails, with its group
+        self.cancelled = False   # its request gave up waiting: the writer skips it
+
+
+class IngestWriter(object):
+    def __init__(self, database):
+        self.database = database
+        self.jobs = queue.Queue()
+        self.lock = threading.Lock()
+        self.thread = None
+
+    def submit(self, work):
+        with self.lock:
+            if self.thread is None:
+                self.thread = threading.Thread(target=self.run, name='ingest')
+                self.thread.daemon = True
+                self.thread.start()
+        job = IngestJob(work)
+        self.jobs.put(job)
+        if not job.done.wait(INGEST_TIMEOUT):
+            with job.lock:
+                job.cancelled = not job.started
+            if job.cancelled:  # still queued: it never runs, so the client may send it again
+                abort(503, 'database busy')
+            job.done.wait()  # its transaction is under way, answer with its outcome
+        if job.error is not None:
+            raise job.error
+
+    def next_group(self):
+        group = [self.jobs.get()]
+        deadline = time.time() + GROUP_COMMIT_WINDOW
+        while len(group) < GROUP_COMMIT_MAX:
+            try:
+                group.append(self.jobs.get(timeout=max(0, deadline - time.time())))
+            except queue.Empty:
+                break
+        return group
+
+    def run(self):
+        # transactions are explicit (isolation_level=None), one per group
+        connection = sqlite3.connect(self.database, detect_types=sqlite3.PARSE_DECLTYPES, isolation_level=None)
+        connection.execute('pragma journal_mode=wal')
+        connection.execute('pragma synchronous=full')
+        create_tables(connection)
+        while True:
+            group = self.next_group()
+            try:
+                connection.execute('begin immediate')
+                for job in group:
+                    with job.lock:
+                        job.started = not job.cancelled
+                    if not job.started:
+                        continue
+                    connection.execute('savepoint job')
+                    try:
+                        job.work(connection)
+                        connection.execute('release job')
+                    except Exception as error:
+                        connection.execute('rollback to job')
+                        connection.execute('release job')
+                        job.error = error
+                connection.execute('commit')
+            except sqlite3.Error as error:  # nothing of the group was written
+                try:
+                    connection.execute('rollback')
+                except sqlite3.Error:  # the transaction never started
+                    pass
+                for job in group:
+                    job.error = job.error or error
+            for job in group:
+                job.done.set()
+
+
+ingest_writer = IngestWriter(DATABASE)
+
+
+# Runs work(connection) in a transaction, returns once it is committed.
+def ingest(work):
+    if GROUP_COMMIT:
+        ingest_writer.submit(work)
+        return
+    connection = get_db_connection()
+    with connection:
+        work(connection)
+
+
 class Event: CHECK_IN, CHECK_OUT, ALARM, REGISTERED, BOOT = range(5)
 
 @app.context_processor
@@ -50,28 +182,117 @@ def main_page():
     return render_template('table.html', log_rows=db_rows)
 
 
-@app.route('/add/<rfid>/<action>')
-def add_entry(rfid, action):
-    event = None
+def get_event(action):
     if action == 'i':
-        event = Event.CHECK_IN
+        return Event.CHECK_IN
     elif action == 'o':
-        event = Event.CHECK_OUT
+        return Event.CHECK_OUT
     elif action == 'a':
-        event = Event.ALARM
+        return Event.ALARM
     elif action == 'r':
-        event = Event.REGISTERED
+        return Event.REGISTERED
     elif action == 'b':
-        event = Event.BOOT
+        return Event.BOOT
     else:
         abort(400, 'invalid action')
-    timestamp = datetime.now() - timedelta(seconds=3) # account for the 3 second delay
-    connection = get_db_connection()
-    cur = connection.cursor()
-    cur.execute('insert into log values(?, ?, ?)', (rfid, event, timestamp))
-    cur.close()
-    connection.commit()
+
+
+@app.route('/add/<rfid>/<action>')
+def add_entry(rfid, action):
+    event = get_event(action)
+    row = (rfid, event, datetime.now())
+    ingest(lambda connection: connection.execute('insert into log (rfid, event, time) values(?, ?, ?)', row))
+    return 'OK\r\n'
+
+
+# The device has no real time clock, it stamps events with a boot number and
+# the seconds since that boot. Every batch request carries the device clock
+# at the time it was sent, which gives the wall clock time the device booted
+# at. The earliest estimate is kept as it includes the least network delay.
+# Boot numbers wrap around, so an estimate far off the stored one is a new boot.
+# Every unit counts its own boots, so they are kept per device.
+SAME_BOOT_TOLERANCE = timedelta(seconds=60)
+
+def sync_boot(connection, device, boot, seconds):
+    start = datetime.now() - timedelta(seconds=seconds)
+    row = connection.execute('select start from boots where device = ? and boot = ?', (device, boot)).fetchone()
+    if row is None or abs(row[0] - start) > SAME_BOOT_TOLERANCE or start < row[0]:
+        connection.execute('insert or replace into boots values(?, ?, ?)', (device, boot, start))
+        return start
+    return row[0]
+
+
+def get_boot_start(connection, device, boot, boots):
+    if boot not in boots:
+        row = connection.execute('select start from boots where device = ? and boot = ?', (device, boot)).fetchone()
+        boots[boot] = row[0] if row is not None else None
+    return boots[boot]
+
+
+# Units are told apart by their X-Device-Id: several can share an address
+# behind NAT. Older firmware doesn't send one, its address stands in.
+def get_device():
+    return request.headers.get('X-Device-Id', request.remote_addr)
+
+
+# Events drained from the device's journal, one per line:
+#   boot (2 hex), RFID (10 characters), action, seconds since that boot (8 hex),
+#   journal sequence number (4 hex, not sent by older firmware)
+# All the lines of a request are inserted in the same transaction. A record
+# already stored, from a request whose answer didn't make it back, is skipped.
+@app.route('/batch', methods=['POST'])
+def add_batch():
+    lines = []
+    device = get_device()
+    try:
+        clock = request.headers['X-Device-Clock']
+        current_boot, current_seconds = int(clock[0:2], 16), int(clock[2:10], 16)
+        for line in request.get_data(as_text=True).splitlines():
+            if len(line) not in (21, 25):
+                raise ValueError(line)
+            sequence = int(line[21:25], 16) if len(line) == 25 else None
+            lines.append((int(line[0:2], 16), line[2:12], line[12], int(line[13:21], 16), sequence))
+    except (KeyError, ValueError):
+        abort(400, 'invalid batch')
+    def insert_batch(connection):  # all of it, or none of it
+        boots = {current_boot: sync_boot(connection, device, current_boot, current_seconds)}
+        rows = []
+        for boot, rfid, action, seconds, sequence in lines:
+            start = get_boot_start(connection, device, boot, boots)
+            # a boot never synced (rebooted while offline): the receive time is the best guess left
+            timestamp = start + timedelta(seconds=seconds) if start is not None else datetime.now()
+            rows.append((rfid, get_event(action), timestamp, device, boot, sequence))
+        connection.executemany('insert or ignore into log (rfid, event, time, device, boot, sequence) '
+                               'values(?, ?, ?, ?, ?, ?)', rows)
+    ingest(insert_batch)
+    return 'OK\r\n'
+
+# Performance counters uploaded by each device every 10 minutes, one per line:
+#   name=value, or for a histogram name=min,max,count of each power of 2 bucket
+# A histogram is stored as name.min, name.max, name.0, name.1... so every row
+# is a single number that trend queries can group by name and unit.
+@app.route('/stats', methods=['POST'])
+def add_stats():
+    rows = []
+    unit = get_device()
+    timestamp = datetime.now()
+    try:
+        for line in request.get_data(as_text=True).splitlines():
+            name, values = line.split('=')
+            values = [int(value) for value in values.split(',')]
+            if len(values) == 1:
+                rows.append((unit, timestamp, name, values[0]))
+                continue
+            rows.append((unit, timestamp, name + '.min', values[0]))
+            rows.append((unit, timestamp, name + '.max', values[1]))
+            for bucket, count in enumerate(values[2:]):
+                rows.append((unit, timestamp, '%s.%d' % (name, bucket), count))
+    except ValueError:
+        abort(400, 'invalid stats')
+    ingest(lambda connection: connection.executemany('insert into stats values(?, ?, ?, ?)', rows))
     return 'OK\r\n'
 
 if __name__ == '__main__':
+    # the device pipelines its uploads over a keep-alive connection, which needs HTTP/1.1
+    WSGIRequestHandler.protocol_version = 'HTTP/1.1'
     app.run('0.0.0.0',80)
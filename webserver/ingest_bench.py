@@ -0,0 +1,81 @@
+# Local load benchmark of the upload path of flaskapp.py:
+#   python ingest_bench.py [-c 1,8,32] [-d seconds] [--dir directory]
+# For each number of concurrent clients, runs the app in process against a
+# fresh database, once committing every request on its own connection (the
+# direct path) and once through the group commit writer, with every client
+# sending /add requests back to back. Prints one tab separated row per run:
+# events per second and the latency percentiles of the acknowledgements.
+# The database goes in --dir, which should be on the disk the server uses
+# (a tmpfs makes fsync free and hides what group commit saves).
+from __future__ import print_function
+import argparse
+import os
+import shutil
+import sqlite3
+import tempfile
+import threading
+import time
+
+import flaskapp
+
+
+def percentile(values, fraction):
+    return values[min(len(values) - 1, int(len(values) * fraction))]
+
+
+def client(app, number, stop, latencies):
+    http = app.test_client()
+    sent = 0
+    while not stop.is_set():
+        rfid = '%05X%05X' % (number, sent)
+        start = time.time()
+        response = http.get('/add/%s/i' % rfid)
+        latencies.append(time.time() - start)
+        if response.status_code != 200:
+            raise RuntimeError('%s: %s' % (rfid, response.status_code))
+        sent += 1
+
+
+def run(directory, group_commit, clients, seconds):
+    path = os.path.join(directory, 'bench-%s-%d.db' % ('group' if group_commit else 'direct', clients))
+    flaskapp.DATABASE = path
+    flaskapp.GROUP_COMMIT = group_commit
+    flaskapp.ingest_writer = flaskapp.IngestWriter(path)
+    stop = threading.Event()
+    latencies = [[] for _ in range(clients)]
+    threads = [threading.Thread(target=client, args=(flaskapp.app, i, stop, latencies[i])) for i in range(clients)]
+    start = time.time()
+    for thread in threads:
+        thread.start()
+    time.sleep(seconds)
+    stop.set()
+    for thread in threads:
+        thread.join()
+    elapsed = time.time() - start
+    latencies = sorted(sum(latencies, []))
+    stored = sqlite3.connect(path).execute('select count(*) from log').fetchone()[0]
+    if stored != len(latencies):
+        raise RuntimeError('%d events acknowledged, %d stored' % (len(latencies), stored))
+    print('%s\t%d\t%d\t%.0f\t%.2f\t%.2f\t%.2f' % ('group' if group_commit else 'direct', clients, len(latencies),
+          len(latencies) / elapsed, percentile(latencies, 0.5) * 1000, percentile(latencies, 0.99) * 1000,
+          latencies[-1] * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='load benchmark of the upload path')
+    parser.add_argument('-c', '--clients', default='1,8,32', help='comma separated numbers of concurrent clients')
+    parser.add_argument('-d', '--seconds', type=float, default=5, help='length of each run')
+    parser.add_argument('--dir', default='.', help='where the databases are created')
+    options = parser.parse_args()
+    directory = tempfile.mkdtemp(prefix='ingest-bench-', dir=options.dir)
+    try:
+        print('path\tclients\tevents\tevents_s\tp50_ms\tp99_ms\tmax_ms')
+        for clients in [int(count) for count in options.clients.split(',')]:
+            for group_commit in (False, True):
+                run(directory, group_commit, clients, options.seconds)
+    finally:
+        shutil.rmtree(directory)
+
+
+if __name__ == '__main__':
+    main()